@@ -5,13 +5,9 @@ cd ..
 echo "Please specify the directory that contains the Spec benchmark traces."
 read benchmark_dir
 
-for file in $benchmark_dir/*.Z; do
-    echo $file
-    uncompress $file 
-done
-
-
-echo "Done with the decompression, now going to invoke cache-sim on each trace."
+# csim reads .Z, .gz and .zst traces directly, so there is no need to
+# decompress the traces to disk first.
+echo "Now going to invoke cache-sim on each trace."
 
 echo "Do you want to run with all associativity experiments, or just with default associativity? Enter 'yes' to run all experiments or nothing to do the default."
 read all_input
@@ -22,10 +18,8 @@ read num_iter
 for file in $benchmark_dir/*; do
     for (( i = 0; i < $num_iter; i++ )); do
         if [[ "$all_input" == *"yes"* ]]; then  
-            for assoc in 2 4 8; do
-                echo "Running $file with assoc of $assoc."
-                ./csim -f $file -a $assoc 
-            done
+            echo "Running $file with assocs of 2, 4 and 8."
+            ./csim -f $file --sweep 256K:2,256K:4,256K:8
         else 
             echo "Running $file with default assoc."
             ./csim -f $file
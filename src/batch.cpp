@@ -0,0 +1,208 @@
+#include "batch.hpp"
+#include "simulator.hpp"
+#include "profile.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+
+WorkStealingPool::WorkStealingPool(size_t num_workers)
+    : workers(num_workers ? num_workers : 1)
+{}
+
+bool WorkStealingPool::next_job(size_t self, size_t& job) {
+    {
+        Worker& own = this->workers[self];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.jobs.empty()) {
+            job = own.jobs.back();
+            own.jobs.pop_back();
+            return true;
+        }
+    }
+    // Nothing left of our own, so steal the oldest job from someone else
+    for (size_t i = 1; i < this->workers.size(); i++) {
+        Worker& victim = this->workers[(self + i) % this->workers.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.jobs.empty()) {
+            job = victim.jobs.front();
+            victim.jobs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::run(size_t num_jobs, const std::function<void(size_t)>& job) {
+    // Deal in reverse so each worker pops its jobs in batch file order
+    for (size_t i = num_jobs; i-- > 0;) {
+        this->workers[i % this->workers.size()].jobs.push_front(i);
+    }
+
+    std::vector<std::thread> threads;
+    for (size_t self = 0; self < this->workers.size(); self++) {
+        threads.emplace_back([this, self, &job] {
+            size_t next;
+            while (this->next_job(self, next)) {
+                job(next);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+struct BatchJob {
+    std::string trace_name;
+    SimConfig config;
+};
+
+// Simulate one job on a hierarchy of type H, producing its results
+template <typename H>
+static void run_job(Trace& trace, const BatchJob& job, std::string& csv, std::string& table) {
+    H* hierarchy = new H(job.config);
+    trace.next_instr();
+    while (trace.has_next_instr) {
+        hierarchy->step(trace.instruction);
+        trace.next_instr();
+    }
+    hierarchy->finish();
+    csv = hierarchy->csv_results(job.trace_name.c_str());
+    table = hierarchy->table_results(job.trace_name.c_str());
+    delete hierarchy;
+}
+
+// Read the batch file into a list of jobs. Returns false on a malformed line.
+static bool parse_batch_file(const char* filename, std::vector<BatchJob>& jobs) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        printf("error: could not open batch file %s\n", filename);
+        return false;
+    }
+    std::vector<std::string> traces;
+    std::vector<SimConfig> configs;
+    char line[4096];
+    u64 line_number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        line_number++;
+        char* comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char* directive = strtok(line, " \t\r\n");
+        char* argument = strtok(nullptr, " \t\r\n");
+        if (!directive) {
+            continue;
+        }
+        SimConfig config;
+        if (argument && strcmp(directive, "trace") == 0) {
+            traces.push_back(argument);
+        } else if (argument && strcmp(directive, "config") == 0 && parse_config_spec(argument, config)) {
+            configs.push_back(config);
+        } else {
+            printf("error: %s:%lu: expected 'trace <path>' or 'config <L2 size>:<L2 associativity>[:<block size>][:<policy>]'\n",
+                filename, line_number);
+            ok = false;
+        }
+    }
+    fclose(file);
+
+    if (configs.empty()) {
+        configs.push_back(DEFAULT_CONFIG);
+    }
+    for (const std::string& trace : traces) {
+        for (const SimConfig& config : configs) {
+            jobs.push_back(BatchJob{trace, config});
+        }
+    }
+    return ok;
+}
+
+int batch_main(int argc, char* argv[]) {
+    const char* usage = "Usage: csim --batch <batch file> [-j <threads>]\n";
+    // hardware_concurrency() is 0 when the core count can't be found
+    size_t num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    if (argc != 3 && !(argc == 5 && strcmp(argv[3], "-j") == 0)) {
+        printf("%s", usage);
+        return -1;
+    }
+    if (argc == 5) {
+        num_threads = strtoull(argv[4], nullptr, 10);
+        if (num_threads == 0) {
+            printf("%s", usage);
+            return -1;
+        }
+    }
+
+    std::vector<BatchJob> jobs;
+    if (!parse_batch_file(argv[2], jobs)) {
+        return -1;
+    }
+
+    // Jobs finish in any order, but their results are written out in batch
+    // file order: each finished job flushes itself and any later jobs that
+    // finished before it, under one lock, so results never interleave.
+    std::vector<std::string> csv_results(jobs.size());
+    std::vector<std::string> table_results(jobs.size());
+    std::vector<bool> is_done(jobs.size(), false);
+    size_t next_to_write = 0;
+    size_t num_failed = 0;
+    u64 total_records = 0;
+    std::mutex results_lock;
+    std::ofstream result_csv("results.csv", std::ios::app);
+
+    profile_start();
+    const auto run_start = std::chrono::steady_clock::now();
+    WorkStealingPool pool(num_threads);
+    pool.run(jobs.size(), [&](size_t index) {
+        BatchJob& job = jobs[index];
+        std::string csv, table;
+        Trace trace(&job.trace_name[0]);
+        if (trace.trace_fd == -1) {
+            table = "error: invalid filename " + job.trace_name + "\n";
+        } else if (is_production_config(job.config)) {
+            run_job<ProductionHierarchy>(trace, job, csv, table);
+        } else {
+            run_job<Hierarchy>(trace, job, csv, table);
+        }
+        // The trace has already said why it ended early; results for the
+        // part before would pass for the whole trace's
+        if (!trace.read_error.empty()) {
+            csv.clear();
+            table = "error: no results for " + job.trace_name + ", which ends early\n";
+        }
+        const bool is_failed = trace.trace_fd == -1 || !trace.read_error.empty();
+
+        PROFILE_SCOPE(PHASE_REPORT);
+        std::lock_guard<std::mutex> guard(results_lock);
+        num_failed += is_failed;
+        csv_results[index].swap(csv);
+        table_results[index].swap(table);
+        is_done[index] = true;
+        total_records += trace.last_ins;
+        while (next_to_write < jobs.size() && is_done[next_to_write]) {
+            result_csv << csv_results[next_to_write];
+            result_csv.flush();
+            fputs(table_results[next_to_write].c_str(), stdout);
+            fflush(stdout);
+            csv_results[next_to_write].clear();
+            table_results[next_to_write].clear();
+            next_to_write++;
+        }
+    });
+    const double run_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+
+    printf("Jobs: %zu on %zu threads in %.3f s (%.0f simulated records/s)\n", jobs.size(),
+        num_threads, run_seconds, run_seconds > 0 ? total_records / run_seconds : 0.0);
+    profile_report(argv[2], total_records, total_records);
+    if (num_failed > 0) {
+        printf("error: %zu of %zu jobs failed\n", num_failed, jobs.size());
+        return -1;
+    }
+    return 0;
+}
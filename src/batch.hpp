@@ -0,0 +1,38 @@
+#pragma once
+#include "shortints.h"
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// csim --batch <batch file> [-j <threads>]
+//
+// Runs every (trace, configuration) pair listed in the batch file as an
+// independent job, each with its own Machine and cache hierarchy, on a pool
+// of worker threads. The batch file has one directive per line, and '#'
+// starts a comment:
+//   trace <path to trace>
+//   config <L2 size>:<L2 associativity>[:<block size>][:<policy>]
+// as with --sweep, the policy being any -r accepts. Without any config lines
+// every trace runs with the default configuration.
+// Results are written to stdout and results.csv in batch file order.
+int batch_main(int argc, char* argv[]);
+
+// Runs a fixed set of jobs on worker threads. Jobs are dealt out round robin
+// up front; each worker takes jobs from the back of its own deque and, once
+// that runs dry, steals from the front of the other workers' deques.
+struct WorkStealingPool {
+    WorkStealingPool(size_t num_workers);
+    // Run job(0) .. job(num_jobs - 1) and wait for all of them to finish.
+    void run(size_t num_jobs, const std::function<void(size_t)>& job);
+
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<size_t> jobs;
+    };
+    std::vector<Worker> workers;
+
+    bool next_job(size_t self, size_t& job);
+};
@@ -0,0 +1,555 @@
+#include "bench.hpp"
+#include "simulator.hpp"
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// FNV-1a, folded over a run's results
+static u64 checksum_add(u64 checksum, const void* data, size_t len) {
+    const u8* bytes = static_cast<const u8*>(data);
+    for (size_t i = 0; i < len; i++) {
+        checksum = (checksum ^ bytes[i]) * 0x100000001b3UL;
+    }
+    return checksum;
+}
+
+static u64 checksum_add(u64 checksum, u64 value) {
+    return checksum_add(checksum, &value, sizeof(value));
+}
+
+const u64 CHECKSUM_SEED = 0xcbf29ce484222325UL;
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// find_way over 16-way sets of a 256 KiB cache's worth of tags, three
+// lookups in four hitting
+static BenchResult bench_tag_lookup() {
+    const u64 num_sets = 4096, assoc = 16, num_queries = 1 << 20, rounds = 16;
+    FastRandom rng;
+    std::vector<u64> tags(num_sets * assoc);
+    for (u64& tag : tags) {
+        tag = rng.next() >> 4;
+    }
+    std::vector<u64> query_sets(num_queries), query_tags(num_queries);
+    for (u64 i = 0; i < num_queries; i++) {
+        query_sets[i] = rng.below(num_sets);
+        query_tags[i] = rng.below(4) ? tags[query_sets[i]*assoc + rng.below(assoc)] : rng.next() >> 4;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    u64 found = 0;
+    for (u64 round = 0; round < rounds; round++) {
+        for (u64 i = 0; i < num_queries; i++) {
+            found += find_way(&tags[query_sets[i]*assoc], assoc, query_tags[i]) + 1;
+        }
+    }
+    const double seconds = seconds_since(start);
+    return BenchResult{"tag_lookup", num_queries * rounds / seconds, 0, checksum_add(CHECKSUM_SEED, found)};
+}
+
+// Reads and writes scattered over 16 times the L2's capacity, so nearly
+// every access misses, evicts a line (a dirty one for a quarter of them)
+// and fills from DRAM
+static BenchResult bench_cache_fill() {
+    const u64 num_accesses = 1 << 23, footprint = MiB(4);
+    Machine machine;
+    MainMemory dram(GiB(8), 64, dram_time_penalty, mW(800), W(4), dram_transfer_penalty, machine);
+    Cache l2(KiB(256), 8, 64, l2_time_penalty, mW(800), W(2), l2_transfer_penalty, L2_FLAGS, machine, &dram, RANDOM);
+    machine.add_cache(&dram);
+    machine.add_cache(&l2);
+    FastRandom rng;
+    std::vector<u64> addresses(num_accesses);
+    for (u64& addr : addresses) {
+        addr = rng.below(footprint / 64) * 64;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    for (u64 i = 0; i < num_accesses; i++) {
+        if (i % 4 == 0) {
+            l2.write(addresses[i], i);
+        } else {
+            l2.read(addresses[i]);
+        }
+    }
+    machine.drain();
+    const double seconds = seconds_since(start);
+
+    u64 checksum = CHECKSUM_SEED;
+    for (u64 count : {l2.read_hits, l2.read_misses, l2.write_hits, l2.write_misses, l2.dirty_evict_count, machine.time}) {
+        checksum = checksum_add(checksum, count);
+    }
+    return BenchResult{"cache_fill", num_accesses / seconds, 0, checksum};
+}
+
+// Parsing a Dinero trace from a file written just for it
+static BenchResult bench_trace_parse() {
+    const u64 num_records = 1 << 21;
+    char path[] = "/tmp/csim-bench-XXXXXX";
+    const int fd = mkstemp(path);
+    if (fd == -1) {
+        return BenchResult{"trace_parse", 0, 0, 0};
+    }
+    FILE* out = fdopen(fd, "w");
+    FastRandom rng;
+    u64 pc = 0x400000;
+    for (u64 i = 0; i < num_records; i++) {
+        const u64 op = rng.below(3);
+        pc += 4;
+        fprintf(out, "%lu %lx %lx\n", op, op == FETCH ? pc : 0x7fff0000 + rng.below(1 << 20) * 8, rng.next() >> 32);
+    }
+    fclose(out);
+
+    const auto start = std::chrono::steady_clock::now();
+    u64 checksum = CHECKSUM_SEED;
+    {
+        Trace trace(path);
+        trace.next_instr();
+        while (trace.has_next_instr) {
+            checksum = checksum_add(checksum, trace.instruction.address ^ trace.instruction.op);
+            trace.next_instr();
+        }
+        checksum = checksum_add(checksum, trace.last_ins);
+    }
+    const double seconds = seconds_since(start);
+    unlink(path);
+    return BenchResult{"trace_parse", num_records / seconds, 0, checksum};
+}
+
+// Pushing completions a few ns to a few hundred ns out, as misses do, and
+// popping them as time moves on a cycle at a time
+static BenchResult bench_in_flight_queue() {
+    const u64 num_events = 1 << 22;
+    InFlightQueue queue;
+    FastRandom rng;
+    Time now = 0;
+    u64 popped = 0;
+    u64 checksum = CHECKSUM_SEED;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (u64 i = 0; i < num_events; i++) {
+        const Time latency = rng.below(4) ? ns(5) + rng.below(ns(10)) : ns(50) + rng.below(ns(400));
+        queue.push(InFlightEvent{now + latency, rng.below(1 << 16), 0}, now);
+        now += CYCLE_TIME;
+        InFlightEvent event;
+        bool is_last_for_line;
+        while (queue.pop_until(now, event, is_last_for_line)) {
+            checksum = checksum_add(checksum, event.finish_time ^ event.line_index);
+            popped++;
+        }
+    }
+    const double seconds = seconds_since(start);
+    return BenchResult{"in_flight_queue", num_events / seconds, 0, checksum_add(checksum, popped)};
+}
+
+// InFlightQueue against a multimap doing the same job the obvious way, over
+// random pushes from a cycle to a few us out (so both the wheel and the
+// overflow heap are used), clock steps of a cycle up to well past the
+// wheel's horizon, and lines with several events pending at once. Every
+// pop is checked, and every so often the per-line and whole-queue queries
+// and a round trip through pending(). Returns false and sets error at the
+// first disagreement.
+static bool check_in_flight_queue(u64 steps, std::string& error) {
+    InFlightQueue queue;
+    std::multimap<Time, u64> reference; // Finish time to line key
+    std::map<u64, std::multiset<Time>> reference_lines;
+    FastRandom rng;
+    Time now = 0;
+    char message[256];
+    const auto line_key = [](const InFlightEvent& event) {
+        return (static_cast<u64>(event.cache_id) << 48) | event.line_index;
+    };
+    for (u64 step = 0; step < steps; step++) {
+        for (u64 n = rng.below(3); n > 0; n--) {
+            Time latency;
+            switch (rng.below(4)) {
+                case 0: latency = rng.below(CYCLE_TIME); break;
+                case 1: latency = ns(5) + rng.below(ns(10)); break;
+                case 2: latency = ns(50) + rng.below(ns(400)); break;
+                default: latency = rng.below(us(4)); break;
+            }
+            const InFlightEvent event{now + latency, rng.below(64), static_cast<u32>(rng.below(4))};
+            queue.push(event, now);
+            reference.emplace(event.finish_time, line_key(event));
+            reference_lines[line_key(event)].insert(event.finish_time);
+        }
+        now += rng.below(64) ? CYCLE_TIME * (1 + rng.below(4)) : rng.below(us(2));
+
+        InFlightEvent event;
+        bool is_last_for_line;
+        while (queue.pop_until(now, event, is_last_for_line)) {
+            // Events finishing at the same time may come out in any order
+            auto expected = reference.begin();
+            while (expected != reference.end() && expected->first == event.finish_time &&
+                expected->second != line_key(event)) {
+                ++expected;
+            }
+            if (reference.empty() || reference.begin()->first != event.finish_time || expected == reference.end() ||
+                expected->first != event.finish_time) {
+                snprintf(message, sizeof(message), "step %lu: popped line %lx at %lu, expected line %lx at %lu",
+                    step, line_key(event), event.finish_time, reference.empty() ? 0 : reference.begin()->second,
+                    reference.empty() ? 0 : reference.begin()->first);
+                error = message;
+                return false;
+            }
+            reference.erase(expected);
+            std::multiset<Time>& line = reference_lines[line_key(event)];
+            line.erase(line.find(event.finish_time));
+            if (is_last_for_line != line.empty()) {
+                snprintf(message, sizeof(message), "step %lu: line %lx is_last_for_line %d with %zu left", step,
+                    line_key(event), is_last_for_line, line.size());
+                error = message;
+                return false;
+            }
+            if (line.empty()) {
+                reference_lines.erase(line_key(event));
+            }
+        }
+        if (!reference.empty() && reference.begin()->first <= now) {
+            snprintf(message, sizeof(message), "step %lu: event at %lu not popped by %lu", step,
+                reference.begin()->first, now);
+            error = message;
+            return false;
+        }
+        if (queue.size() != reference.size()) {
+            snprintf(message, sizeof(message), "step %lu: size %lu, expected %zu", step, queue.size(),
+                reference.size());
+            error = message;
+            return false;
+        }
+
+        if (step % 64 == 0) {
+            const InFlightEvent probe{0, rng.below(64), static_cast<u32>(rng.below(4))};
+            const auto line = reference_lines.find(line_key(probe));
+            Time finish_time = 0;
+            const bool is_pending = queue.line_finish_time(probe.cache_id, probe.line_index, finish_time);
+            if (is_pending != (line != reference_lines.end()) ||
+                (is_pending && finish_time != *line->second.rbegin())) {
+                snprintf(message, sizeof(message), "step %lu: line_finish_time of line %lx wrong", step,
+                    line_key(probe));
+                error = message;
+                return false;
+            }
+            const Time last = reference.empty() ? 0 : reference.rbegin()->first;
+            if (queue.last_finish_time() != last) {
+                snprintf(message, sizeof(message), "step %lu: last_finish_time %lu, expected %lu", step,
+                    queue.last_finish_time(), last);
+                error = message;
+                return false;
+            }
+        }
+        if (step % 4096 == 0) {
+            // As a checkpoint does it: everything out and into a new queue
+            std::vector<InFlightEvent> events;
+            queue.pending(events);
+            queue = InFlightQueue();
+            for (const InFlightEvent& pending : events) {
+                queue.push(pending, now);
+            }
+        }
+    }
+    return true;
+}
+
+// A plain `csim -f trace` in a child process, in a scratch directory so its
+// results.csv doesn't land in ours. The rate is the records/s it reports.
+static BenchResult bench_trace_run(const char* trace_name) {
+    BenchResult result{trace_name, 0, 0, 0};
+    const char* slash = strrchr(trace_name, '/');
+    result.name = slash ? slash + 1 : trace_name;
+    char trace_path[PATH_MAX];
+    char scratch[] = "/tmp/csim-bench-XXXXXX";
+    int fds[2];
+    if (!realpath(trace_name, trace_path) || !mkdtemp(scratch)) {
+        return result;
+    }
+    if (pipe(fds) != 0) {
+        rmdir(scratch);
+        return result;
+    }
+    const pid_t child = fork();
+    if (child == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        if (chdir(scratch) == 0) {
+            execl("/proc/self/exe", "csim", "-f", trace_path, (char*)nullptr);
+        }
+        _exit(127);
+    }
+    close(fds[1]);
+
+    std::string output;
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(fds[0], buf, sizeof(buf))) > 0) {
+        output.append(buf, len);
+    }
+    close(fds[0]);
+    int status = 0;
+    struct rusage usage;
+    memset(&usage, 0, sizeof(usage));
+    if (child > 0) {
+        wait4(child, &status, 0, &usage);
+    }
+    const std::string results_csv = std::string(scratch) + "/results.csv";
+    unlink(results_csv.c_str());
+    rmdir(scratch);
+    if (child <= 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return result;
+    }
+
+    std::istringstream lines(output);
+    std::string line;
+    u64 checksum = CHECKSUM_SEED;
+    while (std::getline(lines, line)) {
+        u64 records;
+        double run_seconds, rate;
+        if (sscanf(line.c_str(), "Records: %lu in %lf s (%lf records/s)", &records, &run_seconds, &rate) == 3) {
+            result.rate = rate;
+        } else if (line.compare(0, 6, "File: ") != 0) {
+            // The File: line has the trace's full path, which would tie the
+            // checksum to where the repository is checked out
+            checksum = checksum_add(checksum_add(checksum, line.data(), line.size()), '\n');
+        }
+    }
+    result.peak_rss_kib = usage.ru_maxrss;
+    result.checksum = checksum;
+    return result;
+}
+
+// The best of repeat runs. Every run must give the same checksum; the
+// rate of the fastest is kept, as the one least disturbed by the host.
+template <typename Run>
+static BenchResult best_of(u64 repeat, Run run) {
+    BenchResult best = run();
+    for (u64 i = 1; i < repeat; i++) {
+        const BenchResult result = run();
+        if (result.checksum != best.checksum) {
+            best.checksum = 0;
+        }
+        if (result.rate > best.rate) {
+            best.rate = result.rate;
+        }
+        if (result.peak_rss_kib > best.peak_rss_kib) {
+            best.peak_rss_kib = result.peak_rss_kib;
+        }
+    }
+    return best;
+}
+
+// The baseline holds rates and peak RSS, the checksums file just checksums
+static bool read_baseline(const char* filename, std::vector<BenchResult>& baseline) {
+    std::ifstream file(filename);
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    std::getline(file, line); // Header
+    while (std::getline(file, line)) {
+        char name[256];
+        BenchResult result{"", 0, 0, 0};
+        if (sscanf(line.c_str(), "%255[^,],%lf,%lu", name, &result.rate, &result.peak_rss_kib) == 3) {
+            result.name = name;
+            baseline.push_back(result);
+        }
+    }
+    return true;
+}
+
+static bool read_checksums(const char* filename, std::vector<BenchResult>& checksums) {
+    std::ifstream file(filename);
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    std::getline(file, line); // Header
+    while (std::getline(file, line)) {
+        char name[256];
+        BenchResult result{"", 0, 0, 0};
+        if (sscanf(line.c_str(), "%255[^,],%lx", name, &result.checksum) == 2) {
+            result.name = name;
+            checksums.push_back(result);
+        }
+    }
+    return true;
+}
+
+static bool write_baseline(const char* filename, const std::vector<BenchResult>& results) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "benchmark,rate,peak_rss_kib\n");
+    for (const BenchResult& result : results) {
+        fprintf(file, "%s,%.0f,%lu\n", result.name.c_str(), result.rate, result.peak_rss_kib);
+    }
+    fclose(file);
+    return true;
+}
+
+static bool write_checksums(const char* filename, const std::vector<BenchResult>& results) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "benchmark,checksum\n");
+    for (const BenchResult& result : results) {
+        fprintf(file, "%s,%016lx\n", result.name.c_str(), result.checksum);
+    }
+    fclose(file);
+    return true;
+}
+
+static const BenchResult* find_result(const std::vector<BenchResult>& results, const std::string& name) {
+    for (const BenchResult& result : results) {
+        if (result.name == name) {
+            return &result;
+        }
+    }
+    return nullptr;
+}
+
+const u64 IN_FLIGHT_CHECK_STEPS = 2000000;
+// The best of fewer runs than this swings by more than the default
+// threshold from one run to the next
+const u64 MIN_BENCH_REPEAT = 3;
+
+int bench_main(int argc, char* argv[]) {
+    const char* usage = "Usage: csim --bench [--check] [--baseline <file>] [--checksums <file>] [--update] [--threshold <percent>] [--repeat <n>] [<trace> ...]\n";
+    const char* baseline_name = nullptr;
+    const char* checksums_name = nullptr;
+    bool update = false;
+    bool check_only = false;
+    double threshold = 10;
+    u64 repeat = 5;
+    std::vector<const char*> trace_names;
+    for (int i = 2; i < argc; i++) {
+        const bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--baseline") == 0 && has_value) {
+            baseline_name = argv[++i];
+        } else if (strcmp(argv[i], "--checksums") == 0 && has_value) {
+            checksums_name = argv[++i];
+        } else if (strcmp(argv[i], "--update") == 0) {
+            update = true;
+        } else if (strcmp(argv[i], "--check") == 0) {
+            check_only = true;
+        } else if (strcmp(argv[i], "--threshold") == 0 && has_value) {
+            threshold = strtod(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--repeat") == 0 && has_value) {
+            repeat = strtoull(argv[++i], nullptr, 10);
+        } else if (argv[i][0] != '-') {
+            trace_names.push_back(argv[i]);
+        } else {
+            printf("%s", usage);
+            return -1;
+        }
+    }
+    if (threshold <= 0 || (update && !baseline_name && !checksums_name)) {
+        printf("%s", usage);
+        return -1;
+    }
+    if (repeat < MIN_BENCH_REPEAT) {
+        printf("error: --repeat must be at least %lu, the best of fewer runs is too noisy to compare\n",
+            MIN_BENCH_REPEAT);
+        return -1;
+    }
+
+    // Correctness first: timings of a broken queue mean nothing
+    std::string error;
+    if (!check_in_flight_queue(IN_FLIGHT_CHECK_STEPS, error)) {
+        printf("in_flight_queue check FAILED: %s\n", error.c_str());
+        return 1;
+    }
+    printf("in_flight_queue check: %lu steps agree with the reference\n", IN_FLIGHT_CHECK_STEPS);
+    if (check_only) {
+        return 0;
+    }
+
+    std::vector<BenchResult> results;
+    results.push_back(best_of(repeat, bench_tag_lookup));
+    results.push_back(best_of(repeat, bench_cache_fill));
+    results.push_back(best_of(repeat, bench_trace_parse));
+    results.push_back(best_of(repeat, bench_in_flight_queue));
+    for (const char* trace_name : trace_names) {
+        results.push_back(best_of(repeat, [trace_name] { return bench_trace_run(trace_name); }));
+    }
+    if (trace_names.empty()) {
+        printf("No traces given, so only the micro-benchmarks ran\n");
+    }
+
+    std::vector<BenchResult> baseline, checksums;
+    const bool has_baseline = baseline_name && !update && read_baseline(baseline_name, baseline);
+    const bool has_checksums = checksums_name && !update && read_checksums(checksums_name, checksums);
+    bool ok = true;
+    printf("Benchmark             Rate (/s)  Baseline (/s)  Change  Peak RSS (KiB)  Baseline (KiB)  Result\n");
+    for (const BenchResult& result : results) {
+        const BenchResult* base = find_result(baseline, result.name);
+        const BenchResult* expected = find_result(checksums, result.name);
+        const char* verdict = "ok";
+        if (result.checksum == 0) {
+            verdict = result.rate > 0 ? "UNSTABLE" : "FAILED";
+            ok = false;
+        } else if (expected && expected->checksum != result.checksum) {
+            verdict = "CHANGED";
+            ok = false;
+        } else if (base && result.rate < base->rate * (1 - threshold / 100)) {
+            verdict = "SLOWER";
+            ok = false;
+        } else if (base && base->peak_rss_kib && result.peak_rss_kib > base->peak_rss_kib * (1 + threshold / 100)) {
+            verdict = "BIGGER";
+            ok = false;
+        } else if (!has_baseline && !has_checksums) {
+            verdict = "recorded";
+        } else if ((has_baseline && !base) || (has_checksums && !expected)) {
+            verdict = "new";
+        }
+        char rss[32] = "-", base_rss[32] = "-";
+        if (result.peak_rss_kib) {
+            snprintf(rss, sizeof(rss), "%lu", result.peak_rss_kib);
+        }
+        if (base && base->peak_rss_kib) {
+            snprintf(base_rss, sizeof(base_rss), "%lu", base->peak_rss_kib);
+        }
+        if (base) {
+            printf("%-18s %12.0f %14.0f %6.1f%% %15s %15s  %s\n", result.name.c_str(), result.rate, base->rate,
+                base->rate > 0 ? (result.rate / base->rate - 1) * 100 : 0.0, rss, base_rss, verdict);
+        } else {
+            printf("%-18s %12.0f %14s %7s %15s %15s  %s\n", result.name.c_str(), result.rate, "-", "-", rss, base_rss,
+                verdict);
+        }
+    }
+
+    if (ok && baseline_name && !has_baseline) {
+        if (!write_baseline(baseline_name, results)) {
+            printf("error: could not write %s\n", baseline_name);
+            return -1;
+        }
+        printf("Baseline written to %s\n", baseline_name);
+    }
+    if (ok && checksums_name && !has_checksums) {
+        if (!write_checksums(checksums_name, results)) {
+            printf("error: could not write %s\n", checksums_name);
+            return -1;
+        }
+        printf("Checksums written to %s\n", checksums_name);
+    }
+    if (!ok) {
+        printf("Benchmarks failed: CHANGED means different results, SLOWER more than %.0f%% below the baseline's "
+            "rate and BIGGER more than %.0f%% above its peak RSS\n", threshold, threshold);
+        return 1;
+    }
+    return 0;
+}
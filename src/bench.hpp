@@ -0,0 +1,35 @@
+#pragma once
+#include "shortints.h"
+#include <string>
+
+// csim --bench [--check] [--baseline <file>] [--checksums <file>] [--update]
+//      [--threshold <percent>] [--repeat <n>] [<trace> ...]
+//
+// First checks the in-flight calendar queue against a simple multimap
+// reference over 2M random steps, and fails at once if they disagree.
+// --check stops there.
+//
+// Performance regression checks. Runs micro-benchmarks of the hot paths (tag
+// lookup, miss fills and evictions, trace parsing and the in-flight queue),
+// then a plain `csim -f` run of every trace given, each in a child process
+// so its peak RSS can be measured. Each benchmark is run --repeat times
+// (5 by default, at least 3) and its best rate kept.
+//
+// Every benchmark also yields a checksum of its results: hit/miss counts
+// for the micro-benchmarks, and every line of a run's output but the
+// timing and the trace's path for the traces. Checksums are the same on
+// any host, so they have a file of their own (--checksums) that can be
+// committed, while rates and peak RSS go in --baseline, which only means
+// anything on the host that wrote it. The run fails on any changed
+// checksum, on a rate more than --threshold percent (10 by default) below
+// the baseline's, or on a peak RSS more than --threshold percent above it.
+// If either file doesn't exist yet, or with --update, the results are
+// written to it instead.
+int bench_main(int argc, char* argv[]);
+
+struct BenchResult {
+    std::string name;
+    double rate;       // Operations (accesses, records, events) per second
+    u64 peak_rss_kib;  // 0 where not measured
+    u64 checksum;
+};
@@ -1,17 +1,15 @@
 #include "cache.hpp"
+#include "dram.hpp"
+#include "profile.hpp"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 #include <cstring>
 #include <new>
-#include <queue>
 #include <utility>
 #include <cassert>
 
-#ifndef NDEBUG
-static u32 evict_index = 0;
-#endif
-
 Line::Line() : metadata(0) {}
 
 void Line::set_metadata_bit(u8 pos, bool value) {
@@ -38,6 +36,10 @@ bool Line::is_in_flight() const {
     return this->get_metadata_bit(IN_FLIGHT_BIT);
 }
 
+bool Line::is_prefetched() const {
+    return this->get_metadata_bit(PREFETCHED_BIT);
+}
+
 void Line::set_valid(bool is_valid) {
     return this->set_metadata_bit(VALID_BIT, is_valid);
 }
@@ -50,6 +52,10 @@ void Line::set_in_flight(bool is_in_flight) {
     return this->set_metadata_bit(IN_FLIGHT_BIT, is_in_flight);
 }
 
+void Line::set_prefetched(bool is_prefetched) {
+    return this->set_metadata_bit(PREFETCHED_BIT, is_prefetched);
+}
+
 u64 Line::get_tag() const {
     return this->metadata & ((1UL << MAX_TAG_SIZE) - 1);
 }
@@ -71,7 +77,7 @@ void Line::set_metadata(u64 tag, bool is_valid, bool is_dirty, bool is_in_flight
 
 Cache::Cache(u64 capacity, u64 associativity, u64 block_size, Time latency,
     Watt idle_power, Watt running_power, Joule transfer_penalty,
-    CacheFlags flags, Machine& machine, Cache* parent)
+    CacheFlags flags, Machine& machine, Cache* parent, ReplacementPolicy policy)
     : capacity(capacity)
     , associativity(associativity)
     , block_size(block_size)
@@ -81,30 +87,159 @@ Cache::Cache(u64 capacity, u64 associativity, u64 block_size, Time latency,
     , assoc_bits(static_cast<u64>(log2(static_cast<double>(associativity))))
     , tag_bits(64 - block_bits - assoc_bits - set_bits)
     , lines(new Line[associativity * num_sets])
+    , tags(new u64[associativity * num_sets])
     , parent(parent)
     , flags(flags)
+    , policy(policy)
+    , policy_stride(replacement_state_bytes(policy, associativity))
+    , policy_state(policy_stride ? new u8[policy_stride * num_sets] : nullptr)
+    , owns_storage(true)
+    , rng()
+    , prefetcher(nullptr)
     , machine(machine)
-    , active_time(0)
-    , in_flight_count(0)
+    , id(0)
     , dirty_evict_count(0)
     , read_hits(0)
     , read_misses(0)
     , write_hits(0)
     , write_misses(0)
+    , prefetches_issued(0)
+    , prefetch_hits(0)
+    , late_prefetches(0)
+    , unused_prefetches(0)
+    , prefetch_reads(0)
+    , mshr_merges(0)
+    , mshr_full(0)
+    , mshr_wait_time(0)
     , transfer_penalty(transfer_penalty)
     , latency(latency)
     , idle_power(idle_power)
     , running_power(running_power)
+    , settled_active_time(0)
+    , busy_since(0)
+    , busy_count(0)
 {
+    assert(parent);
+    assert(is_replacement_policy_supported(policy, associativity));
+    std::fill(this->tags, this->tags + associativity*num_sets, INVALID_TAG);
+    for (u64 set_index = 0; set_index < this->num_sets; set_index++) {
+        u8* const state = this->policy_state + set_index*this->policy_stride;
+        switch (this->policy) {
+            case RANDOM: Replacement<RANDOM>::reset(state, associativity); break;
+            case LRU: Replacement<LRU>::reset(state, associativity); break;
+            case TREE_PLRU: Replacement<TREE_PLRU>::reset(state, associativity); break;
+            case BIT_PLRU: Replacement<BIT_PLRU>::reset(state, associativity); break;
+            case SRRIP: Replacement<SRRIP>::reset(state, associativity); break;
+            case BRRIP: Replacement<BRRIP>::reset(state, associativity); break;
+        }
+    }
     #ifndef NDEBUG
     printf("Cache b %lu a %lu s %lu t: %lu\n", block_bits, assoc_bits, 
             set_bits, tag_bits);
     #endif
 }
 
+Cache::Cache(u64 capacity, u64 associativity, u64 block_size, Time latency,
+    Watt idle_power, Watt running_power, Joule transfer_penalty, Machine& machine)
+    : capacity(capacity)
+    , associativity(associativity)
+    , block_size(block_size)
+    , num_sets(capacity / (associativity * block_size))
+    , block_bits(static_cast<u64>(log2(static_cast<double>(block_size))))
+    , set_bits(static_cast<u64>(log2(static_cast<double>(num_sets))))
+    , assoc_bits(static_cast<u64>(log2(static_cast<double>(associativity))))
+    , tag_bits(64 - block_bits - assoc_bits - set_bits)
+    , lines(nullptr)
+    , tags(nullptr)
+    , parent(nullptr)
+    , flags(0)
+    , policy(RANDOM)
+    , policy_stride(0)
+    , policy_state(nullptr)
+    , owns_storage(false)
+    , rng()
+    , prefetcher(nullptr)
+    , machine(machine)
+    , id(0)
+    , dirty_evict_count(0)
+    , read_hits(0)
+    , read_misses(0)
+    , write_hits(0)
+    , write_misses(0)
+    , prefetches_issued(0)
+    , prefetch_hits(0)
+    , late_prefetches(0)
+    , unused_prefetches(0)
+    , prefetch_reads(0)
+    , mshr_merges(0)
+    , mshr_full(0)
+    , mshr_wait_time(0)
+    , transfer_penalty(transfer_penalty)
+    , latency(latency)
+    , idle_power(idle_power)
+    , running_power(running_power)
+    , settled_active_time(0)
+    , busy_since(0)
+    , busy_count(0)
+{}
+
+Cache::Cache(u64 capacity, u64 associativity, u64 block_size, Time latency,
+    Watt idle_power, Watt running_power, Joule transfer_penalty,
+    CacheFlags flags, Machine& machine, Cache* parent, ReplacementPolicy policy,
+    Line* lines, u64* tags, u8* policy_state)
+    : capacity(capacity)
+    , associativity(associativity)
+    , block_size(block_size)
+    , num_sets(capacity / (associativity * block_size))
+    , block_bits(static_cast<u64>(log2(static_cast<double>(block_size))))
+    , set_bits(static_cast<u64>(log2(static_cast<double>(num_sets))))
+    , assoc_bits(static_cast<u64>(log2(static_cast<double>(associativity))))
+    , tag_bits(64 - block_bits - assoc_bits - set_bits)
+    , lines(lines)
+    , tags(tags)
+    , parent(parent)
+    , flags(flags)
+    , policy(policy)
+    , policy_stride(replacement_state_bytes(policy, associativity))
+    , policy_state(policy_state)
+    , owns_storage(false)
+    , rng()
+    , prefetcher(nullptr)
+    , machine(machine)
+    , id(0)
+    , dirty_evict_count(0)
+    , read_hits(0)
+    , read_misses(0)
+    , write_hits(0)
+    , write_misses(0)
+    , prefetches_issued(0)
+    , prefetch_hits(0)
+    , late_prefetches(0)
+    , unused_prefetches(0)
+    , prefetch_reads(0)
+    , mshr_merges(0)
+    , mshr_full(0)
+    , mshr_wait_time(0)
+    , transfer_penalty(transfer_penalty)
+    , latency(latency)
+    , idle_power(idle_power)
+    , running_power(running_power)
+    , settled_active_time(0)
+    , busy_since(0)
+    , busy_count(0)
+{
+    assert(parent);
+    assert(is_replacement_policy_supported(policy, associativity));
+}
+
 Cache::~Cache()
 {
-    delete[] this->lines;
+    if (this->owns_storage) {
+        delete[] this->lines;
+        delete[] this->tags;
+        delete[] this->policy_state;
+    }
+    delete this->prefetcher;
 }
 
 bool Cache::is_write_back() const {
@@ -120,88 +255,110 @@ bool Cache::is_async_write() const {
     return this->flags & ASYNC_WRITE;
 }
 
-const Line& Cache::read(const address addr)
+const Line& Cache::read_at(const address addr, const u64 set_index, const u64 tag)
 {
-    const u64 set_index = (addr >> this->block_bits) & ((1UL << (this->set_bits)) - 1);
-    const u64 tag = addr >> (this->set_bits + this->block_bits);
-
-    // Dram condition
-    const bool is_dram = !this->parent;
-    // if (is_dram) {
-    //     this->read_hits++;
-    //     this->lines[set_index].set_metadata(tag, true, false, false);
-    //     this->active_time += this->latency;
-    //     this->machine.advanceTime(this->latency);
-    //     return this->lines[set_index];
-    // }
+    PrefetchTrigger trigger;
+    const Line& line = this->demand_read(addr, set_index, tag, trigger);
+    if (this->prefetcher) {
+        this->run_prefetcher(addr, trigger);
+    }
+    return line;
+}
 
+const Line& Cache::demand_read(const address addr, const u64 set_index, const u64 tag, PrefetchTrigger& trigger)
+{
     // Hit condition
-    for (u64 i = 0; i < this->associativity; i++) {
-        Line& cur_line = this->lines[set_index*this->associativity + i];
-        const bool is_hit = (cur_line.is_valid() && cur_line.get_tag() == tag);
-        if (is_dram || is_hit) {
-            this->read_hits++;
-            // Wait for line to be ready
-            if (cur_line.is_in_flight()) {
-                this->machine.wait_for_line(this, cur_line.get_tag(), set_index);
-            } 
-            // Then perform read
-            this->machine.advance_time(this->latency, this);
-            return cur_line;
+    const s64 way = find_way(this->tags + set_index*this->associativity, this->associativity, tag);
+    if (way >= 0) {
+        Line& cur_line = this->lines[set_index*this->associativity + way];
+        this->read_hits++;
+        this->touch_way(set_index, way);
+        trigger = DEMAND_HIT;
+        if (cur_line.is_prefetched()) {
+            trigger = PREFETCH_HIT;
+            this->prefetch_hits++;
+            this->late_prefetches += cur_line.is_in_flight();
+            cur_line.set_prefetched(false);
         }
+        // Wait for line to be ready
+        if (cur_line.is_in_flight()) {
+            this->machine.wait_for_line(this, set_index*this->associativity + way);
+        } 
+        // Then perform read
+        this->machine.advance_time(this->latency, this);
+        return cur_line;
     }
 
     // Miss condition
     this->read_misses++;
+    trigger = DEMAND_MISS;
     const Line& read_line = this->parent->read(addr);
     const Line& replaced_line = this->put(read_line, addr);
     this->machine.advance_time(this->latency, this);
-    this->read(addr);
+    // Then read the new line. This isn't a re-reference as far as the
+    // replacement policy is concerned, so it doesn't go through the hit path.
+    this->read_hits++;
+    this->machine.advance_time(this->latency, this);
     return replaced_line;
 }
 
 
-const Line& Cache::write(const address addr, value val)
+const Line& Cache::write_at(const address addr, value val, const u64 set_index, const u64 tag)
 {
-    const u64 set_index = (addr >> this->block_bits) & ((1UL << (this->set_bits)) - 1);
-    const u64 tag = addr >> (this->set_bits + this->block_bits);
-
-    // Base case
-    const bool is_dram = !this->parent;
-    if (is_dram) {
-        this->write_hits++;
-        // Ensure that a DRAM line is always clean, valid, and not in flight.
-        lines[set_index].set_metadata(0, true, false, false);
-        return lines[set_index];
-    }
-
     // Tag matching to see if thre is a hit
-    for (size_t i = 0; i < this->associativity; i++) {
-        Line& cur_line = lines[set_index*associativity + i];
-        if (cur_line.is_valid() && cur_line.get_tag() == tag) {
-            // Write hit
-            this->write_hits++;
-            if (this->is_write_back()) {
-                cur_line.set_dirty(true);
-            } else if (this->is_write_through()) {
-                // TODO(Nate): This still troubles me
-                if (this->is_async_write()) { // Is this even possible?
-                    this->machine.in_flight_queue.push_line(this, set_index, cur_line, this->latency);
-                }
-                parent->write(addr, val); 
-                if (this->is_sync_write()) {
+    const s64 way = find_way(this->tags + set_index*this->associativity, this->associativity, tag);
+    if (way >= 0) {
+        Line& cur_line = lines[set_index*associativity + way];
+        // Write hit
+        this->write_hits++;
+        this->touch_way(set_index, way);
+        PrefetchTrigger trigger = DEMAND_HIT;
+        if (cur_line.is_prefetched()) {
+            trigger = PREFETCH_HIT;
+            this->prefetch_hits++;
+            this->late_prefetches += cur_line.is_in_flight();
+            cur_line.set_prefetched(false);
+        }
+        if (this->is_write_back()) {
+            cur_line.set_dirty(true);
+        } else if (this->is_write_through()) {
+            // TODO(Nate): This still troubles me
+            if (this->is_async_write()) { // Is this even possible?
+                this->machine.push_line(this, set_index*this->associativity + way, this->latency);
+            }
+            parent->write(addr, val); 
+            if (this->is_sync_write()) {
 
-                }
             }
-            return cur_line;
         }
+        if (this->prefetcher) {
+            this->run_prefetcher(addr, trigger);
+        }
+        return cur_line;
     }
     
     this->write_misses++;
     this->read_misses--; // Remove a read miss to avoid counting the read miss about to happen
     this->read_hits--; // Remove a read miss to avoid counting the read miss about to happen
-    this->read(addr); // Retrieve the correct line. This handles eviction and such.
-    return this->write(addr, val);
+    // Retrieve the correct line. This handles eviction and such.
+    PrefetchTrigger trigger;
+    Line& filled_line = const_cast<Line&>(this->demand_read(addr, set_index, tag, trigger));
+    // Then write it. As with a read miss, the write that allocated the line
+    // doesn't count as a re-reference of it.
+    this->write_hits++;
+    if (this->is_write_back()) {
+        filled_line.set_dirty(true);
+    } else if (this->is_write_through()) {
+        if (this->is_async_write()) {
+            this->machine.push_line(this, &filled_line - this->lines, this->latency);
+        }
+        parent->write(addr, val);
+    }
+    // Only now, so a prefetch can't evict the line before it is written
+    if (this->prefetcher) {
+        this->run_prefetcher(addr, trigger);
+    }
+    return filled_line;
     // for (size_t i = 0; i < this->associativity; i++) {
     //     Line& cur_line = lines[set_index*associativity + i];
     //     if (cur_line.is_valid() && cur_line.get_tag() == tag) {
@@ -222,181 +379,757 @@ const Line& Cache::write(const address addr, value val)
     // return lines[0];
 }
 
+// Pick the way in a set that a new block will replace: an invalid line if
+// there is one, otherwise a victim chosen by the replacement policy.
+u64 Cache::find_victim(const u64 set_index)
+{
+    // Attempt to find invalid block to replace
+    const s64 invalid_way = find_way(this->tags + set_index*this->associativity, this->associativity, INVALID_TAG);
+    const u64 victim_index = invalid_way >= 0 ? invalid_way : this->choose_victim(set_index);
+    this->fill_way(set_index, victim_index);
+    return victim_index;
+}
+
+// Give a line a new block, keeping the tag array in step with it.
+Line& Cache::install_line(const u64 set_index, const u64 way, const u64 tag, bool is_dirty)
+{
+    Line& line = this->lines[set_index*this->associativity + way];
+    line.set_metadata(tag, true, is_dirty, false);
+    this->tags[set_index*this->associativity + way] = tag;
+    return line;
+}
+
+// A direct mapped cache has nothing to choose between, so skips its policy.
+void Cache::touch_way(const u64 set_index, const u64 way)
+{
+    if (this->associativity == 1) {
+        return;
+    }
+    u8* const state = this->policy_state + set_index*this->policy_stride;
+    const u64 assoc = this->associativity;
+    switch (this->policy) {
+        case RANDOM: Replacement<RANDOM>::touch(state, assoc, way); break;
+        case LRU: Replacement<LRU>::touch(state, assoc, way); break;
+        case TREE_PLRU: Replacement<TREE_PLRU>::touch(state, assoc, way); break;
+        case BIT_PLRU: Replacement<BIT_PLRU>::touch(state, assoc, way); break;
+        case SRRIP: Replacement<SRRIP>::touch(state, assoc, way); break;
+        case BRRIP: Replacement<BRRIP>::touch(state, assoc, way); break;
+    }
+}
+
+void Cache::fill_way(const u64 set_index, const u64 way)
+{
+    if (this->associativity == 1) {
+        return;
+    }
+    u8* const state = this->policy_state + set_index*this->policy_stride;
+    const u64 assoc = this->associativity;
+    switch (this->policy) {
+        case RANDOM: Replacement<RANDOM>::fill(state, assoc, way, this->rng); break;
+        case LRU: Replacement<LRU>::fill(state, assoc, way, this->rng); break;
+        case TREE_PLRU: Replacement<TREE_PLRU>::fill(state, assoc, way, this->rng); break;
+        case BIT_PLRU: Replacement<BIT_PLRU>::fill(state, assoc, way, this->rng); break;
+        case SRRIP: Replacement<SRRIP>::fill(state, assoc, way, this->rng); break;
+        case BRRIP: Replacement<BRRIP>::fill(state, assoc, way, this->rng); break;
+    }
+}
+
+u64 Cache::choose_victim(const u64 set_index)
+{
+    if (this->associativity == 1) {
+        return 0;
+    }
+    u8* const state = this->policy_state + set_index*this->policy_stride;
+    const u64 assoc = this->associativity;
+    switch (this->policy) {
+        case RANDOM: return Replacement<RANDOM>::victim(state, assoc, this->rng);
+        case LRU: return Replacement<LRU>::victim(state, assoc, this->rng);
+        case TREE_PLRU: return Replacement<TREE_PLRU>::victim(state, assoc, this->rng);
+        case BIT_PLRU: return Replacement<BIT_PLRU>::victim(state, assoc, this->rng);
+        case SRRIP: return Replacement<SRRIP>::victim(state, assoc, this->rng);
+        case BRRIP: return Replacement<BRRIP>::victim(state, assoc, this->rng);
+    }
+    return 0;
+}
+
 // Place a line into the cache at a particular set index. Should the tags
 // not match AND there be no free lines in the cache, put will also cause
 // the cache to have an eviction and call put on the parent. Returns a
 // reference to the line in the cache which contains the new value.
 const Line& Cache::put(const Line& line, address addr, value val)
 {
-    const u64 set_index = (addr >> this->block_bits) & ((1UL << (this->set_bits)) - 1);
-    const u64 tag = addr >> (this->set_bits + this->block_bits);
+    PROFILE_SCOPE(PHASE_FILL);
+    const u64 set_index = address_set_index(addr, this->block_bits, this->set_bits);
+    const u64 tag = address_tag(addr, this->block_bits, this->set_bits);
 
-    // Attempt to find invalid block to replace
-    Line* victim_line = nullptr;
-    for (size_t i = 0; i < associativity; i++) {
-        Line& cur_line = this->lines[set_index*this->associativity + i];
-        if (!cur_line.is_valid()) {
-            // If line is not valid, it can be selected for replacement
-            cur_line.set_metadata(tag, true, false, false);
-            victim_line = &cur_line;
-            break;
-        } 
+    const u64 victim_way = this->find_victim(set_index);
+    const Line& victim_line = this->lines[set_index*this->associativity + victim_way];
+
+    if (victim_line.is_in_flight()) {
+        this->machine.wait_for_line(this, set_index*this->associativity + victim_way);
     }
+    if (this->is_write_back() && victim_line.is_dirty()) {
+        this->dirty_evict_count++;
+        this->parent->write(this->block_address(set_index, victim_line.get_tag()), val); // values in writes don't matter
+    }
+    if (victim_line.is_valid()) {
+        this->unused_prefetches += victim_line.is_prefetched();
+        this->parent->child_evicted(this->block_address(set_index, victim_line.get_tag()));
+    }
+
+    return this->install_line(set_index, victim_way, tag, false);
+}
 
-    bool all_lines_valid = victim_line == nullptr;
-    if (all_lines_valid) {
-        #ifdef NDEBUG 
-        u64 victim_index = rand() % associativity;
-        #else 
-        u64 victim_index = evict_index++;
-        if (evict_index >= this->associativity) {
-            evict_index = 0;
+s64 Cache::make_room(const u64 set_index, Time start)
+{
+    // As find_victim, but the policy only hears of the fill if it happens
+    const s64 invalid_way = find_way(this->tags + set_index*this->associativity, this->associativity, INVALID_TAG);
+    const u64 victim_way = invalid_way >= 0 ? invalid_way : this->choose_victim(set_index);
+    const Line& victim_line = this->lines[set_index*this->associativity + victim_way];
+    if (victim_line.is_in_flight()) {
+        return -1;
+    }
+    this->fill_way(set_index, victim_way);
+    if (victim_line.is_valid()) {
+        const address victim_addr = this->block_address(set_index, victim_line.get_tag());
+        this->unused_prefetches += victim_line.is_prefetched();
+        if (this->is_write_back() && victim_line.is_dirty()) {
+            this->dirty_evict_count++;
+            this->parent->access_from(victim_addr, true, start);
         }
-        #endif /* NDEBUG */
-        victim_line = &lines[set_index*this->associativity + victim_index];
+        this->parent->child_evicted(victim_addr);
     }
+    return victim_way;
+}
 
-    if (victim_line->is_in_flight()) {
-        this->machine.wait_for_line(this, tag, set_index);
+void Cache::set_prefetcher(Prefetcher* prefetcher)
+{
+    delete this->prefetcher;
+    this->prefetcher = prefetcher;
+}
+
+bool Cache::has_prefetcher() const
+{
+    return this->prefetcher != nullptr;
+}
+
+void Cache::run_prefetcher(const address addr, PrefetchTrigger trigger)
+{
+    this->prefetch_blocks.clear();
+    this->prefetcher->observe(addr >> this->block_bits, trigger, this->prefetch_blocks);
+    for (u64 block : this->prefetch_blocks) {
+        this->issue_prefetch(block << this->block_bits);
+    }
+}
+
+// The block arrives in the background, in flight for as long as the levels
+// below take to supply it, so a demand access that catches up with it waits
+// only for the rest.
+void Cache::issue_prefetch(const address addr)
+{
+    const u64 set_index = address_set_index(addr, this->block_bits, this->set_bits);
+    const u64 tag = address_tag(addr, this->block_bits, this->set_bits);
+    if (find_way(this->tags + set_index*this->associativity, this->associativity, tag) >= 0) {
+        return;
+    }
+    const s64 way = this->make_room(set_index, this->machine.time);
+    if (way < 0) {
+        return;
     }
-    if (this->is_write_back() && victim_line->is_dirty()) {
+    const Time latency = this->parent->fill_latency(addr);
+    this->install_line(set_index, way, tag, false).set_prefetched(true);
+    this->prefetches_issued++;
+    this->machine.push_line(this, set_index*this->associativity + way, latency);
+}
+
+Time Cache::fill_latency(const address addr)
+{
+    const u64 set_index = address_set_index(addr, this->block_bits, this->set_bits);
+    const u64 tag = address_tag(addr, this->block_bits, this->set_bits);
+    this->prefetch_reads++;
+    if (find_way(this->tags + set_index*this->associativity, this->associativity, tag) >= 0) {
+        return this->latency;
+    }
+    // The victim goes before the fill is read, as on a demand miss
+    const s64 way = this->make_room(set_index, this->machine.time);
+    const Time latency = this->latency + this->parent->fill_latency(addr);
+    if (way >= 0) {
+        this->install_line(set_index, way, tag, false);
+    }
+    return latency;
+}
+
+void Cache::set_mshrs(const u64 count)
+{
+    this->mshrs.assign(count, 0);
+}
+
+bool Cache::is_non_blocking() const
+{
+    return !this->mshrs.empty();
+}
+
+Time Cache::issue_at(const address addr, bool is_write, const u64 set_index, const u64 tag)
+{
+    return this->nonblocking_access(addr, set_index, tag, is_write, this->machine.time, true);
+}
+
+Time Cache::access_from(const address addr, bool is_write, Time start)
+{
+    return this->nonblocking_access(addr, this->set_index_of(addr), this->tag_of(addr), is_write, start, false);
+}
+
+// Counts and costs follow read_at and write_at, but as times rather than by
+// advancing the machine: a read takes this level's latency once the line is
+// ready, a miss takes it twice after the parent's data arrives, and a write
+// to a line that is ready is free.
+Time Cache::nonblocking_access(const address addr, const u64 set_index, const u64 tag, bool is_write,
+    Time start, bool may_stall)
+{
+    const s64 way = find_way(this->tags + set_index*this->associativity, this->associativity, tag);
+    if (way >= 0) {
+        const u64 line_index = set_index*this->associativity + way;
+        Line& cur_line = this->lines[line_index];
+        if (is_write) {
+            this->write_hits++;
+        } else {
+            this->read_hits++;
+        }
+        this->touch_way(set_index, way);
+        // The line can be in flight at the machine's time yet have arrived
+        // by start
+        Time ready = start;
+        Time finish_time;
+        if (cur_line.is_in_flight() && this->machine.in_flight_queue.line_finish_time(this->id, line_index, finish_time)) {
+            ready = std::max(ready, finish_time);
+        }
+        PrefetchTrigger trigger = DEMAND_HIT;
+        if (cur_line.is_prefetched()) {
+            trigger = PREFETCH_HIT;
+            this->prefetch_hits++;
+            this->late_prefetches += ready > start;
+            cur_line.set_prefetched(false);
+        } else if (ready > start) {
+            this->mshr_merges++;
+        }
+        Time done = ready;
+        if (!is_write) {
+            done += this->latency;
+            this->machine.push_busy(this, done);
+        } else if (this->is_write_back()) {
+            cur_line.set_dirty(true);
+        } else {
+            done = std::max(done, this->parent->access_from(addr, true, start));
+        }
+        if (this->prefetcher) {
+            this->run_prefetcher(addr, trigger);
+        }
+        return done;
+    }
+
+    // The fill that allocates the line isn't a re-reference of it, but is
+    // counted as a hit like on the blocking path
+    if (is_write) {
+        this->write_misses++;
+        this->write_hits++;
+    } else {
+        this->read_misses++;
+        this->read_hits++;
+    }
+    // Without MSHRs there's no limit on misses outstanding
+    const auto mshr = std::min_element(this->mshrs.begin(), this->mshrs.end());
+    if (mshr != this->mshrs.end() && *mshr > start) {
+        this->mshr_full++;
+        this->mshr_wait_time += *mshr - start;
+        if (may_stall) {
+            this->machine.advance_time(*mshr - this->machine.time);
+        }
+        start = *mshr;
+    }
+
+    // A victim still being filled is replaced once its data has arrived
+    const u64 victim_way = this->find_victim(set_index);
+    const u64 line_index = set_index*this->associativity + victim_way;
+    const Line& victim_line = this->lines[line_index];
+    Time finish_time;
+    if (victim_line.is_in_flight() && this->machine.in_flight_queue.line_finish_time(this->id, line_index, finish_time)) {
+        start = std::max(start, finish_time);
+    }
+    if (victim_line.is_valid()) {
+        const address victim_addr = this->block_address(set_index, victim_line.get_tag());
+        this->unused_prefetches += victim_line.is_prefetched();
+        if (this->is_write_back() && victim_line.is_dirty()) {
+            this->dirty_evict_count++;
+            this->parent->access_from(victim_addr, true, start);
+        }
+        this->parent->child_evicted(victim_addr);
+    }
+
+    Time done = this->parent->access_from(addr, false, start) + 2*this->latency;
+    this->install_line(set_index, victim_way, tag, is_write && this->is_write_back());
+    if (is_write && this->is_write_through()) {
+        done = std::max(done, this->parent->access_from(addr, true, done));
+    }
+    this->machine.push_line(this, line_index, done - this->machine.time);
+    if (mshr != this->mshrs.end()) {
+        *mshr = done;
+    }
+    if (this->prefetcher) {
+        this->run_prefetcher(addr, DEMAND_MISS);
+    }
+    return done;
+}
+
+bool Cache::invalidate(const address addr)
+{
+    const u64 set_index = address_set_index(addr, this->block_bits, this->set_bits);
+    const u64 tag = address_tag(addr, this->block_bits, this->set_bits);
+
+    const s64 way = find_way(this->tags + set_index*this->associativity, this->associativity, tag);
+    if (way < 0) {
+        return false;
+    }
+    Line& line = this->lines[set_index*this->associativity + way];
+    if (line.is_in_flight()) {
+        this->machine.wait_for_line(this, set_index*this->associativity + way);
+    }
+    if (this->is_write_back() && line.is_dirty()) {
         this->dirty_evict_count++;
-        this->parent->write(addr, val); // values in writes don't matter
+        this->parent->write(addr, 0);
+    }
+    this->unused_prefetches += line.is_prefetched();
+    line.set_metadata(0, false, false, false);
+    this->tags[set_index*this->associativity + way] = INVALID_TAG;
+    return true;
+}
+
+void Cache::warm(const address addr, bool is_write)
+{
+    const u64 set_index = address_set_index(addr, this->block_bits, this->set_bits);
+    const u64 tag = address_tag(addr, this->block_bits, this->set_bits);
+
+    const s64 way = find_way(this->tags + set_index*this->associativity, this->associativity, tag);
+    if (way >= 0) {
+        this->touch_way(set_index, way);
+        if (is_write && this->is_write_back()) {
+            this->lines[set_index*this->associativity + way].set_dirty(true);
+        } else if (is_write) {
+            this->parent->warm(addr, true);
+        }
+        return;
     }
 
-    victim_line->set_metadata(tag, true, false, false);
+    // Miss: fill from the parent, writing back a dirty victim, then apply
+    // the write to the new line as the write path would.
+    this->parent->warm(addr, false);
+    const u64 victim_way = this->find_victim(set_index);
+    const Line& victim_line = this->lines[set_index*this->associativity + victim_way];
+    if (this->is_write_back() && victim_line.is_dirty()) {
+        this->parent->warm(this->block_address(set_index, victim_line.get_tag()), true);
+    }
+    this->install_line(set_index, victim_way, tag, is_write && this->is_write_back());
+    if (is_write && this->is_write_through()) {
+        this->parent->warm(addr, true);
+    }
+}
 
-    return *victim_line;
+MainMemory::MainMemory(u64 capacity, u64 block_size, Time latency, Watt idle_power,
+    Watt running_power, Joule transfer_penalty, Machine& machine)
+    : Cache(capacity, 1, block_size, latency, idle_power, running_power,
+        transfer_penalty, machine)
+    , line()
+    , model(nullptr)
+{
+    this->line.set_metadata(0, true, false, false);
+}
+
+MainMemory::~MainMemory()
+{
+    delete this->model;
+}
+
+void MainMemory::set_dram_model(DramModel* model)
+{
+    delete this->model;
+    this->model = model;
+}
+
+DramModel* MainMemory::dram_model() const
+{
+    return this->model;
+}
+
+void MainMemory::flush()
+{
+    if (!this->model) {
+        return;
+    }
+    const Time last = this->model->flush(this->machine.time);
+    if (last > this->machine.time) {
+        this->machine.push_busy(this, last);
+    }
+}
+
+// Memory always hits
+const Line& MainMemory::read_at(const address addr, u64 set_index, u64 tag)
+{
+    this->read_hits++;
+    if (this->model) {
+        this->machine.advance_time(this->model->read(addr, this->machine.time) - this->machine.time, this);
+    } else {
+        this->machine.advance_time(this->latency, this);
+    }
+    return this->line;
+}
+
+// Nobody waits for a write to memory
+const Line& MainMemory::write_at(const address addr, value val, u64 set_index, u64 tag)
+{
+    this->write_hits++;
+    if (this->model) {
+        this->model->write(addr, this->machine.time);
+    }
+    return this->line;
+}
+
+Line& Cache::line_at(const u64 line_index) {
+    return this->lines[line_index];
+}
+
+Line& MainMemory::line_at(const u64 line_index) {
+    return this->line;
+}
+
+// Memory holds every block already
+void MainMemory::warm(const address addr, bool is_write) {}
+
+Time MainMemory::fill_latency(const address addr) {
+    this->prefetch_reads++;
+    if (this->model) {
+        return this->model->read(addr, this->machine.time) - this->machine.time;
+    }
+    return this->latency;
+}
+
+Time MainMemory::access_from(const address addr, bool is_write, Time start) {
+    if (is_write) {
+        this->write_hits++;
+        if (this->model) {
+            this->model->write(addr, start);
+        }
+        return start;
+    }
+    this->read_hits++;
+    const Time done = this->model ? this->model->read(addr, start) : start + this->latency;
+    this->machine.push_busy(this, done);
+    return done;
+}
+
+// The model's energy per operation stands in for the flat transfer energy
+Joule MainMemory::calc_energy() {
+    if (!this->model) {
+        return Cache::calc_energy();
+    }
+    this->model->settle(this->machine.time);
+    Joule static_energy = this->machine.time * this->idle_power;
+    Joule active_energy = this->active_time() * this->running_power;
+    return static_energy + active_energy + this->model->energy();
 }
 
 // Returns energy in femtoJoules. (due to picoseconds * milliwatts
 Joule Cache::calc_energy() {
     Joule static_energy = this->machine.time * this->idle_power;
-    Joule active_energy = this->active_time * this->running_power;
-    u64 total_accesses = this->read_hits + this->read_misses + this->write_hits + this->write_misses;
+    Joule active_energy = this->active_time() * this->running_power;
+    // Prefetch fills move a block like any other access, both into the
+    // cache that asked and out of each level that supplied it
+    u64 total_accesses = this->read_hits + this->read_misses + this->write_hits + this->write_misses +
+        this->prefetches_issued + this->prefetch_reads;
     Joule transfer_energy = total_accesses * this->transfer_penalty * 1000; // convert to femtoJoules
     return static_energy + active_energy + transfer_energy;
 }
 
 
-InFlightQueue::InFlightQueue(Time& machine_time) 
-    : std::priority_queue<InFlightData, std::vector<InFlightData>, std::greater<InFlightData>>()
-    , machine_time(machine_time)
-{}
+std::vector<u64*> Cache::state_words() {
+    return {&this->dirty_evict_count, &this->read_hits, &this->read_misses, &this->write_hits,
+        &this->write_misses, &this->prefetches_issued, &this->prefetch_hits, &this->late_prefetches,
+        &this->unused_prefetches, &this->prefetch_reads, &this->mshr_merges, &this->mshr_full,
+        &this->mshr_wait_time, &this->settled_active_time, &this->busy_since, &this->busy_count,
+        &this->rng.state};
+}
 
-void InFlightQueue::push_line(Cache* parent_cache, u64 set_index, Line& dst_line, Time latency) {
-    InFlightData data = InFlightData{
-        parent_cache,
-        dst_line,
-        set_index,
-        this->machine_time + latency
-    };
-    this->push(data);
-}
-
-void InFlightQueue::flush() {
-    while (this->size() > 0) {
-        const InFlightData& top = this->top();
-        if (this->machine_time < top.finish_time) {
-            this->machine_time = top.finish_time;
-        }
-        top.dst_line.set_in_flight(false);
+void Cache::save_counters(std::string& out) const {
+    for (const u64* word : const_cast<Cache*>(this)->state_words()) {
+        out.append(reinterpret_cast<const char*>(word), sizeof(u64));
+    }
+}
 
-        this->pop();
+const u8* Cache::restore_counters(const u8* in) {
+    for (u64* word : this->state_words()) {
+        memcpy(word, in, sizeof(u64));
+        in += sizeof(u64);
     }
+    return in;
 }
 
-bool InFlightData::operator>(const InFlightData& rhs) const {
-    return this->finish_time > rhs.finish_time;
+// Lines are kept as their metadata alone; levels without lines of their own
+// (MainMemory) keep only their counters.
+void Cache::save_state(std::string& out) const {
+    this->save_counters(out);
+    if (!this->lines) {
+        return;
+    }
+    const u64 num_lines = this->num_sets * this->associativity;
+    for (u64 i = 0; i < num_lines; i++) {
+        out.append(reinterpret_cast<const char*>(&this->lines[i].metadata), sizeof(u64));
+    }
+    out.append(reinterpret_cast<const char*>(this->tags), num_lines * sizeof(u64));
+    if (this->policy_state) {
+        out.append(reinterpret_cast<const char*>(this->policy_state), this->policy_stride * this->num_sets);
+    }
+}
+
+const u8* Cache::restore_state(const u8* in) {
+    in = this->restore_counters(in);
+    if (!this->lines) {
+        return in;
+    }
+    const u64 num_lines = this->num_sets * this->associativity;
+    for (u64 i = 0; i < num_lines; i++) {
+        memcpy(&this->lines[i].metadata, in, sizeof(u64));
+        in += sizeof(u64);
+    }
+    memcpy(this->tags, in, num_lines * sizeof(u64));
+    in += num_lines * sizeof(u64);
+    if (this->policy_state) {
+        memcpy(this->policy_state, in, this->policy_stride * this->num_sets);
+        in += this->policy_stride * this->num_sets;
+    }
+    return in;
 }
 
-InFlightData& InFlightData::operator=(const InFlightData& other) noexcept {
-    if (this != &other) {
-        // Copy member variables from 'other' to 'this'
-        // Be sure to handle any dynamic memory allocation appropriately
+Time Cache::active_time() const {
+    if (this->busy_count > 0) {
+        return this->settled_active_time + (this->machine.time - this->busy_since);
     }
-    return *this;
+    return this->settled_active_time;
 }
 
-// Move constructor
-InFlightData::InFlightData(InFlightData&& rhs)
-    : parent_cache(rhs.parent_cache)
-    , dst_line(rhs.dst_line)
-    , dst_set_index(rhs.dst_set_index)
-    , finish_time(rhs.finish_time) {}
+void Cache::begin_busy(Time now) {
+    if (this->busy_count++ == 0) {
+        this->busy_since = now;
+    }
+}
 
-// Copy constructor
-InFlightData::InFlightData(const InFlightData& rhs)
-    : parent_cache(rhs.parent_cache)
-    , dst_line(rhs.dst_line)
-    , dst_set_index(rhs.dst_set_index)
-    , finish_time(rhs.finish_time) {}
+void Cache::end_busy(Time now) {
+    assert(this->busy_count > 0);
+    if (--this->busy_count == 0) {
+        this->settled_active_time += now - this->busy_since;
+    }
+}
 
-Machine::Machine() : time(0), in_flight_queue(time), caches(), waited_this_access(false) {}
+InFlightQueue::InFlightQueue()
+    : overflow()
+    , cursor(0)
+    , wheel_count(0)
+    , line_events()
+{}
 
-// Advance the time of the machine, while updating the active times of any
-// caches which are currently waiting on a writeback
-void Machine::advance_time(const Time duration, Cache* active_cache) {
-    const Time advanced_time = this->time + duration;
-    while (!this->in_flight_queue.empty() && this->in_flight_queue.top().finish_time <= advanced_time) {
-        const InFlightData& next = this->in_flight_queue.top();
-        const Time delta = next.finish_time - this->time;
-        assert(delta >= 0);
-        // Advance active time for all active caches
-        for (Cache* cache : this->caches) {
-            if (cache->in_flight_count > 0) {
-                cache->active_time += delta;
+static bool finishes_later(const InFlightEvent& lhs, const InFlightEvent& rhs) {
+    return lhs.finish_time > rhs.finish_time;
+}
+
+bool InFlightQueue::empty() const {
+    return this->wheel_count == 0 && this->overflow.empty();
+}
+
+u64 InFlightQueue::size() const {
+    return this->wheel_count + this->overflow.size();
+}
+
+u64 InFlightQueue::line_key(u32 cache_id, u64 line_index) {
+    return (static_cast<u64>(cache_id) << 48) | line_index;
+}
+
+std::vector<InFlightEvent>& InFlightQueue::slot_of(Time time) {
+    return this->slots[(time >> SLOT_BITS) % NUM_SLOTS];
+}
+
+void InFlightQueue::insert(const InFlightEvent& event) {
+    if (event.finish_time < this->cursor + HORIZON) {
+        this->slot_of(event.finish_time).push_back(event);
+        this->wheel_count++;
+    } else {
+        this->overflow.push_back(event);
+        std::push_heap(this->overflow.begin(), this->overflow.end(), finishes_later);
+    }
+}
+
+// Move the wheel on to the slot starting at slot_start, bringing in any
+// overflow events that are now within reach.
+void InFlightQueue::advance_cursor(Time slot_start) {
+    this->cursor = slot_start;
+    while (!this->overflow.empty() && this->overflow.front().finish_time < this->cursor + HORIZON) {
+        std::pop_heap(this->overflow.begin(), this->overflow.end(), finishes_later);
+        const InFlightEvent event = this->overflow.back();
+        this->overflow.pop_back();
+        this->slot_of(event.finish_time).push_back(event);
+        this->wheel_count++;
+    }
+}
+
+void InFlightQueue::push(const InFlightEvent& event, Time now) {
+    assert(event.finish_time >= now);
+    if (this->empty()) {
+        // Nothing pending, so the wheel can jump straight to now
+        this->cursor = now & ~(SLOT_LEN - 1);
+    }
+    this->insert(event);
+    LineEvents& line = this->line_events[line_key(event.cache_id, event.line_index)];
+    line.finish_time = std::max(line.finish_time, event.finish_time);
+    line.count++;
+}
+
+bool InFlightQueue::pop_until(Time limit, InFlightEvent& event, bool& is_last_for_line) {
+    while (!this->empty()) {
+        if (this->wheel_count == 0) {
+            // Skip the empty wheel ahead to the next overflow event
+            const Time next = this->overflow.front().finish_time;
+            if (next > limit) {
+                return false;
             }
+            this->advance_cursor(next & ~(SLOT_LEN - 1));
         }
-        if (active_cache) {
-            const bool active_time_updated_already = active_cache->in_flight_count > 0;
-            if (!active_time_updated_already) {
-                active_cache->active_time += delta;
+        std::vector<InFlightEvent>& slot = this->slot_of(this->cursor);
+        if (!slot.empty()) {
+            size_t earliest = 0;
+            for (size_t i = 1; i < slot.size(); i++) {
+                if (slot[i].finish_time < slot[earliest].finish_time) {
+                    earliest = i;
+                }
+            }
+            if (slot[earliest].finish_time > limit) {
+                return false;
+            }
+            event = slot[earliest];
+            slot[earliest] = slot.back();
+            slot.pop_back();
+            this->wheel_count--;
+
+            auto line = this->line_events.find(line_key(event.cache_id, event.line_index));
+            is_last_for_line = --line->second.count == 0;
+            if (is_last_for_line) {
+                this->line_events.erase(line);
             }
+            return true;
         }
-        this->time += delta;
-        // Update metadata for cache line
-        next.dst_line.set_in_flight(false);
-        next.parent_cache->in_flight_count -= 1;
+        // Everything left finishes after this slot
+        if (this->cursor + SLOT_LEN > limit) {
+            return false;
+        }
+        this->advance_cursor(this->cursor + SLOT_LEN);
+    }
+    return false;
+}
 
-        this->in_flight_queue.pop();
+bool InFlightQueue::line_finish_time(u32 cache_id, u64 line_index, Time& finish_time) const {
+    auto line = this->line_events.find(line_key(cache_id, line_index));
+    if (line == this->line_events.end()) {
+        return false;
     }
+    finish_time = line->second.finish_time;
+    return true;
+}
 
-    // Update all active caches, even though this may not result in new data
-    const Time delta = advanced_time - this->time;
-    assert(delta >= 0);
-    for (Cache* cache : this->caches) {
-        if (cache->in_flight_count > 0) {
-            cache->active_time += delta; 
-        }
+Time InFlightQueue::last_finish_time() const {
+    Time last = 0;
+    for (const auto& line : this->line_events) {
+        last = std::max(last, line.second.finish_time);
+    }
+    return last;
+}
+
+// The wheel from the cursor round, then the overflow in finish order, so
+// each slot's events go back in the order they are in now
+void InFlightQueue::pending(std::vector<InFlightEvent>& events) const {
+    const u64 first = (this->cursor >> SLOT_BITS) % NUM_SLOTS;
+    for (u64 i = 0; i < NUM_SLOTS; i++) {
+        const std::vector<InFlightEvent>& slot = this->slots[(first + i) % NUM_SLOTS];
+        events.insert(events.end(), slot.begin(), slot.end());
     }
+    std::vector<InFlightEvent> overflow = this->overflow;
+    // Sorted latest first, by the heap's ordering
+    std::sort_heap(overflow.begin(), overflow.end(), finishes_later);
+    events.insert(events.end(), overflow.rbegin(), overflow.rend());
+}
+
+Machine::Machine()
+    : time(0)
+    , in_flight_queue()
+    , caches()
+    , waited_this_access(false)
+{}
+
+void Machine::add_cache(Cache* cache) {
+    cache->id = this->caches.size();
+    this->caches.push_back(cache);
+}
+
+void Machine::push_line(Cache* cache, u64 line_index, Time latency) {
+    cache->line_at(line_index).set_in_flight(true);
+    cache->begin_busy(this->time);
+    this->in_flight_queue.push(InFlightEvent{this->time + latency, line_index, cache->id}, this->time);
+}
+
+void Machine::push_busy(Cache* cache, Time finish_time) {
+    cache->begin_busy(this->time);
+    this->in_flight_queue.push(InFlightEvent{finish_time, NO_LINE, cache->id}, this->time);
+}
+
+// Advance the time of the machine, completing any in-flight lines on the
+// way. active_cache, if given, is busy for the whole duration.
+void Machine::advance_time(const Time duration, Cache* active_cache) {
+    PROFILE_SCOPE(PHASE_ADVANCE_TIME);
+    PROFILE_DEPTH(this->in_flight_queue.size());
+    const Time advanced_time = this->time + duration;
     if (active_cache) {
-        const bool active_time_updated_already = active_cache->in_flight_count > 0;
-        if (!active_time_updated_already) {
-            active_cache->active_time += delta;
+        active_cache->begin_busy(this->time);
+    }
+    InFlightEvent next;
+    bool is_last_for_line;
+    while (this->in_flight_queue.pop_until(advanced_time, next, is_last_for_line)) {
+        assert(next.finish_time >= this->time);
+        this->time = next.finish_time;
+        // Update metadata for cache line
+        Cache* const cache = this->caches[next.cache_id];
+        if (next.line_index != NO_LINE && is_last_for_line) {
+            cache->line_at(next.line_index).set_in_flight(false);
         }
+        cache->end_busy(this->time);
+        PROFILE_COUNT(COUNTER_EVENTS_COMPLETED, 1);
+    }
+    this->time = advanced_time;
+    if (active_cache) {
+        active_cache->end_busy(this->time);
     }
-    this->time += delta;
-
-    return;
 }
 
-// Advances time until a line is available. A line can be uniquely identified by
-// its tag, set_index, and parent cache
-void Machine::wait_for_line(Cache* cache, u64 tag, u64 set_index) {
+// Advances time until a line is no longer in flight
+void Machine::wait_for_line(Cache* cache, u64 line_index) {
+    Time finish_time;
+    if (!this->in_flight_queue.line_finish_time(cache->id, line_index, finish_time)) {
+        return;
+    }
+    PROFILE_SCOPE(PHASE_WAIT_FOR_LINE);
     this->waited_this_access = true;
-    u64 last_tag;
-    u64 last_set_index;
-    Cache* last_cache;
-
-    do {
-        const InFlightData& top = this->in_flight_queue.top();
-        last_tag = top.dst_line.get_tag();
-        last_set_index = top.dst_set_index;
-        last_cache = top.parent_cache;
-
-        this->advance_time(top.finish_time - this->time);
-    } while (tag != last_tag || set_index != last_set_index || cache != last_cache);
+    const u64 pending = this->in_flight_queue.size();
+    this->advance_time(finish_time - this->time);
+    PROFILE_COUNT(COUNTER_WAIT_EVENTS, pending - this->in_flight_queue.size());
+}
+
+void Machine::drain() {
+    if (!this->in_flight_queue.empty()) {
+        this->advance_time(this->in_flight_queue.last_finish_time() - this->time);
+    }
 }
 
 char calc_prefix(s8 exponent) {
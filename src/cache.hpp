@@ -1,10 +1,17 @@
 #pragma once
+#include "prefetch.hpp"
+#include "replacement.hpp"
 #include "shortints.h"
-#include <functional>
+#include <algorithm>
+#include <cstdlib>
+#ifdef __SSE4_1__
+#include <immintrin.h>
+#endif
 #include <list>
 #include <ratio>
-#include <queue>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 // Time has a resolution of 1 picosecond, and should be set via a macro.
 using Time = u64; 
@@ -29,12 +36,64 @@ using Joule = u64;
 
 struct Machine;
 
+// Split an address into the set index and tag of a cache with 2^block_bits
+// byte blocks and 2^set_bits sets. Shared by everything that models a cache
+// so that they all agree on where a block lives.
+inline u64 address_set_index(u64 addr, u64 block_bits, u64 set_bits) {
+    return (addr >> block_bits) & ((1UL << set_bits) - 1);
+}
+
+inline u64 address_tag(u64 addr, u64 block_bits, u64 set_bits) {
+    return addr >> (set_bits + block_bits);
+}
+
+// Tag stored for a line that holds nothing. Tags are at most 60 bits, so no
+// address can match it.
+const u64 INVALID_TAG = ~0UL;
+// Smallest capacity per way a level can have. Set index and block offset
+// then take at least 4 address bits, which keeps tags to 60.
+const u64 MIN_WAY_SIZE = 16;
+
+// Find tag among the assoc tags of a set, returning its way or -1. Compares
+// four ways per instruction with AVX2 and two with SSE4.1, so searching a
+// 16 or 32 way set costs a handful of compares rather than a loop per way.
+inline s64 find_way(const u64* tags, u64 assoc, u64 tag) {
+    u64 way = 0;
+#if defined(__AVX2__)
+    const __m256i needle = _mm256_set1_epi64x(tag);
+    for (; way + 4 <= assoc; way += 4) {
+        const __m256i ways = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tags + way));
+        const int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(ways, needle)));
+        if (mask) {
+            return way + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__SSE4_1__)
+    const __m128i needle = _mm_set1_epi64x(tag);
+    for (; way + 2 <= assoc; way += 2) {
+        const __m128i ways = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags + way));
+        const int mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpeq_epi64(ways, needle)));
+        if (mask) {
+            return way + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; way < assoc; way++) {
+        if (tags[way] == tag) {
+            return way;
+        }
+    }
+    return -1;
+}
+
 // A single cache line. The smallest unit of the cache.
 struct Line {
     // A packed data store of a cache line.
-    // Assumes tag is always <= 61 bits
-    //      [valid : dirty : in_flight : tag  ]
-    // bits: 63    , 62    , 61        , 60..0
+    // Assumes tag is always <= 60 bits
+    //      [valid : dirty : in_flight : prefetched : tag  ]
+    // bits: 63    , 62    , 61        , 60         , 59..0
+    // prefetched is set on a line filled by a prefetch until its first
+    // demand access.
     using LineMetadata = u64;
     LineMetadata metadata;
 
@@ -42,18 +101,21 @@ struct Line {
     bool is_valid() const;
     bool is_dirty() const;
     bool is_in_flight() const;
+    bool is_prefetched() const;
     u64 get_tag() const;
 
     void set_valid(bool is_valid);
     void set_dirty(bool is_dirty);
     void set_in_flight(bool is_in_flight);
+    void set_prefetched(bool is_prefetched);
     void set_tag(u64 tag);
     void set_metadata(u64 tag, bool is_valid, bool is_dirty, bool is_in_flight);
 private:
     const u8 VALID_BIT = 63;
     const u8 DIRTY_BIT = 62;
     const u8 IN_FLIGHT_BIT = 61;
-    const u8 MAX_TAG_SIZE = 61;
+    const u8 PREFETCHED_BIT = 60;
+    const u8 MAX_TAG_SIZE = 60;
     void set_metadata_bit(u8 pos, bool value);
     bool get_metadata_bit(u8 pos) const;
 };
@@ -74,23 +136,53 @@ struct Set {
     Line* lines;
 };
 
-// The Cache itself. DRAM can also be represented as a direct mapped cache.
+// The Cache itself. Every cache has a parent it misses to; the bottom of the
+// hierarchy is a MainMemory.
 struct Cache {
-private:
+protected:
     // Cache construction. A cache is simply a collection of lines. Determined
     // at creation.
     const u64 capacity, associativity, block_size, num_sets;
     const u64 block_bits, set_bits, assoc_bits, tag_bits; 
     Line* const lines;
+    // The tag of every line, laid out like lines (INVALID_TAG when the line
+    // is invalid), so a lookup compares one contiguous run of tags instead
+    // of unpacking each line's metadata. Kept in step with lines by
+    // install_line and invalidate, the only places a line changes tag.
+    u64* const tags;
     Cache* const parent;
     CacheFlags flags;
+    // Replacement policy. Its per-set state is kept in one array beside
+    // lines, policy_stride bytes per set, so a set's state is a few
+    // contiguous bytes rather than spread across its lines.
+    const ReplacementPolicy policy;
+    const u64 policy_stride;
+    u8* const policy_state;
+    // Whether lines, tags and policy_state were allocated here, and so are
+    // freed with the cache, rather than lent by a subclass (see CacheLevel)
+    const bool owns_storage;
+    FastRandom rng;
+    Prefetcher* prefetcher;
+    std::vector<u64> prefetch_blocks; // Scratch space for the prefetcher
+    // When each MSHR frees up; empty for a blocking cache (see set_mshrs)
+    std::vector<Time> mshrs;
 public:
     // Modified during runtime and used to evaluate cache performance.
     Machine& machine;
-    Time active_time;
-    u64 in_flight_count, dirty_evict_count;
+    u32 id; // Index in machine.caches
+    u64 dirty_evict_count;
     u64 read_hits, read_misses, write_hits, write_misses;
-private:
+    // Prefetches this cache made, how many were then used by a demand access
+    // (late if they were still in flight), and how many were evicted unused.
+    // prefetch_reads counts prefetches of caches below that this one served.
+    u64 prefetches_issued, prefetch_hits, late_prefetches, unused_prefetches;
+    u64 prefetch_reads;
+    // Non-blocking accesses that found their block still being filled by
+    // an earlier miss, misses that found every MSHR busy, and how long
+    // those misses waited for one
+    u64 mshr_merges, mshr_full;
+    Time mshr_wait_time;
+protected:
     // Used for calculations at the end of the sim
     const Joule transfer_penalty;
     const Time latency;
@@ -100,8 +192,9 @@ public:
 
     Cache(u64 capacity, u64 associativity, u64 block_size, Time latency,
         Watt idle_power, Watt running_power, Joule transfer_penalty,
-        CacheFlags flags, Machine& machine, Cache* parent = nullptr);
-    ~Cache();
+        CacheFlags flags, Machine& machine, Cache* parent,
+        ReplacementPolicy policy = RANDOM);
+    virtual ~Cache();
     
     // Note(Nate): Though these are addresses we are simulating, we gain no
     // benefit from passing them around as pointers. It may be more practical to
@@ -109,8 +202,95 @@ public:
     using address = u64;
     using value = u64;
 
-    const Line& read(address addr);
-    const Line& write(address addr, value val);
+    const Line& read(address addr) {
+        return this->read_at(addr, this->set_index_of(addr), this->tag_of(addr));
+    }
+    const Line& write(address addr, value val) {
+        return this->write_at(addr, val, this->set_index_of(addr), this->tag_of(addr));
+    }
+    // The same accesses with the set and tag of addr already worked out, for
+    // callers that decode many addresses up front (see
+    // BasicHierarchy::access_batch).
+    virtual const Line& read_at(address addr, u64 set_index, u64 tag);
+    virtual const Line& write_at(address addr, value val, u64 set_index, u64 tag);
+    u64 set_index_of(address addr) const {
+        return address_set_index(addr, this->block_bits, this->set_bits);
+    }
+    u64 tag_of(address addr) const {
+        return address_tag(addr, this->block_bits, this->set_bits);
+    }
+    // Start pulling the tags and lines of a set into the host's caches
+    // ahead of an access to it
+    void prefetch_set(u64 set_index) const {
+        __builtin_prefetch(this->tags + set_index*this->associativity);
+        __builtin_prefetch(this->lines + set_index*this->associativity);
+    }
+    // Bytes of host memory the tags and lines take up
+    u64 footprint() const {
+        return (this->num_sets*this->associativity) * (sizeof(Line) + sizeof(u64));
+    }
+    // Functional access: update the tags and dirty bits of this cache and its
+    // parents as read/write would, without advancing time or counting the
+    // access. Keeps cache state warm while fast forwarding through a trace.
+    virtual void warm(address addr, bool is_write);
+    // The line with index set_index*associativity + way
+    virtual Line& line_at(u64 line_index);
+    // First address of the block with this set index and tag
+    address block_address(u64 set_index, u64 tag) const {
+        return (tag << (this->set_bits + this->block_bits)) | (set_index << this->block_bits);
+    }
+    // Called by a cache whose parent this is when it evicts the block holding
+    // addr. Nothing below the L1s needs to know; see CoherencePort.
+    virtual void child_evicted(address addr) {}
+    // Drop the block holding addr, if present, writing it back first if it
+    // is dirty. Returns whether it was present. Used by coherence to take a
+    // block away from a private cache.
+    bool invalidate(address addr);
+    // Have prefetcher (which the cache then owns) suggest blocks to fill
+    // after each demand access
+    void set_prefetcher(Prefetcher* prefetcher);
+    bool has_prefetcher() const;
+    // Functional read for a prefetch from a cache above: fill the block
+    // without advancing time, returning how long it would take to arrive.
+    virtual Time fill_latency(address addr);
+    // Make the cache non-blocking with count miss status holding registers.
+    // A miss installs its block at once, in flight until the data arrives,
+    // and holds an MSHR until then. Later accesses to the block merge into
+    // it and wait only for the rest, and a miss needs a free MSHR.
+    void set_mshrs(u64 count);
+    bool is_non_blocking() const;
+    // A non-blocking access from the core at the machine's time. Returns
+    // when its data is ready, or for a write when it is done. Only stalls
+    // the machine when a miss finds every MSHR busy.
+    Time issue_at(address addr, bool is_write, u64 set_index, u64 tag);
+    // A non-blocking access from a cache or write buffer above, starting at
+    // start. A miss that finds every MSHR busy waits for one to free up,
+    // rather than stalling the machine. A cache without MSHRs takes these
+    // too, with no limit on the misses outstanding.
+    virtual Time access_from(address addr, bool is_write, Time start);
+    // Append the lines, replacement state and counters to out, for a
+    // checkpoint (see checkpoint.hpp)
+    void save_state(std::string& out) const;
+    // Read back what save_state wrote for a cache of the same geometry and
+    // policy, returning the end of it
+    const u8* restore_state(const u8* in);
+    // The same for just the counters and active time, which any cache can
+    // take from any other
+    void save_counters(std::string& out) const;
+    const u8* restore_counters(const u8* in);
+
+protected:
+    // For levels that keep no lines at all (see MainMemory)
+    Cache(u64 capacity, u64 associativity, u64 block_size, Time latency,
+        Watt idle_power, Watt running_power, Joule transfer_penalty, Machine& machine);
+    // For levels that keep their lines in arrays of their own (see
+    // CacheLevel). lines and tags hold associativity * num_sets entries and
+    // policy_state policy_stride bytes per set; the subclass initialises them
+    // and they outlive the cache, which only borrows them.
+    Cache(u64 capacity, u64 associativity, u64 block_size, Time latency,
+        Watt idle_power, Watt running_power, Joule transfer_penalty,
+        CacheFlags flags, Machine& machine, Cache* parent,
+        ReplacementPolicy policy, Line* lines, u64* tags, u8* policy_state);
 
     // Replace a line in the cache
 private:
@@ -119,38 +299,136 @@ private:
     bool is_async_write() const;
     bool is_sync_write() const;
     const Line& put(const Line& line, address addr, value val = 0);
+    u64 find_victim(u64 set_index);
+    // Make room in a set for a fill nobody waits on: a dirty victim is
+    // written back through the parent at start, as a demand eviction's
+    // would be, and -1 is returned rather than wait for a victim still in
+    // flight.
+    s64 make_room(u64 set_index, Time start);
+    // A read as read_at does it, minus the prefetcher
+    const Line& demand_read(address addr, u64 set_index, u64 tag, PrefetchTrigger& trigger);
+    void run_prefetcher(address addr, PrefetchTrigger trigger);
+    void issue_prefetch(address addr);
+    // What issue_at and access_from share. may_stall says whether a miss
+    // waiting for an MSHR holds up the machine or just starts later.
+    Time nonblocking_access(address addr, u64 set_index, u64 tag, bool is_write, Time start, bool may_stall);
+    Line& install_line(u64 set_index, u64 way, u64 tag, bool is_dirty);
+    // The counters and bookkeeping a checkpoint keeps, in the order it keeps
+    // them
+    std::vector<u64*> state_words();
+    // Replacement policy hooks, dispatched on this->policy
+    void touch_way(u64 set_index, u64 way);
+    void fill_way(u64 set_index, u64 way);
+    u64 choose_victim(u64 set_index);
 
 public:
-    Time calc_energy();
+    virtual Joule calc_energy();
+
+    // Time spent active: accessing, or with lines in flight. Tracked as
+    // intervals, so it costs nothing for idle levels as time advances. The
+    // level is busy while busy_count (lines in flight plus any access in
+    // progress) is above zero.
+    Time active_time() const;
+    void begin_busy(Time now);
+    void end_busy(Time now);
+private:
+    Time settled_active_time; // Active time up to busy_since
+    Time busy_since;
+    u64 busy_count;
 };
 
-struct InFlightData {
-    InFlightData(Cache* parent_cache, Line &dst_line, u64 dst_set_index, Time finish_time)
-        : parent_cache(parent_cache)
-        , dst_line(dst_line)
-        , dst_set_index(dst_set_index)
-        , finish_time(finish_time) {}
-    Cache* parent_cache;
-    Line &dst_line;
-    u64 dst_set_index;
-    Time finish_time;
+struct DramModel;
+
+// Backing memory at the bottom of the hierarchy. Memory always hits, so unlike
+// a Cache it keeps no per-line state at all (modelling 8 GiB of DRAM as a
+// direct mapped Cache meant allocating a Line for every 64 byte block). It
+// only counts accesses and accounts for their time and energy: a flat
+// latency and transfer energy per access, or those of a DramModel's banks
+// once it has one.
+struct MainMemory final : public Cache {
+    MainMemory(u64 capacity, u64 block_size, Time latency, Watt idle_power,
+        Watt running_power, Joule transfer_penalty, Machine& machine);
+    ~MainMemory() override;
+
+    // Time accesses with model (which memory then owns) instead
+    void set_dram_model(DramModel* model);
+    DramModel* dram_model() const;
+    // Drain any writes the model still holds, for the end of a run
+    void flush();
+    Joule calc_energy() override;
+
+    const Line& read_at(address addr, u64 set_index, u64 tag) override;
+    const Line& write_at(address addr, value val, u64 set_index, u64 tag) override;
+    void warm(address addr, bool is_write) override;
+    Line& line_at(u64 line_index) override;
+    Time fill_latency(address addr) override;
+    Time access_from(address addr, bool is_write, Time start) override;
+
+private:
+    // Handed back for every access: valid, clean and never in flight.
+    Line line;
+    DramModel* model;
+};
 
-    InFlightData(InFlightData&& rhs);
-    InFlightData(const InFlightData& rhs);
-    bool operator>(const InFlightData& rhs) const;
-    Time operator-(const InFlightData& rhs) const;
-    InFlightData& operator=(const InFlightData& other) noexcept;
+// A pending completion: line line_index of the cache with id cache_id (its
+// index in Machine::caches) stops being in flight at finish_time. With
+// line_index NO_LINE the cache is only busy until then (see push_busy).
+const u64 NO_LINE = (1UL << 48) - 1;
+struct InFlightEvent {
+    Time finish_time;
+    u64 line_index;
+    u32 cache_id;
 };
 
-// An InFlightQueue is an extension of a regular queue.
-struct InFlightQueue : public std::priority_queue<InFlightData, std::vector<InFlightData>, std::greater<InFlightData>> {
-    InFlightQueue(Time &machine_time);
+// The pending completions, as a calendar queue. Time is cut into slots of
+// 2^SLOT_BITS ps and the next NUM_SLOTS slots form a wheel, each slot an
+// unordered handful of events; events further out wait in an overflow heap
+// until the wheel comes round to them. Pushing is O(1), and popping walks
+// forward to the next non-empty slot. Completions are mostly a few ns
+// away, so nearly every event goes straight into the wheel.
+//
+// It also keeps the latest pending finish time of every in-flight line, so
+// waiting on a line doesn't have to search for its event.
+struct InFlightQueue {
+    InFlightQueue();
 
-    Time& machine_time;
+    bool empty() const;
+    u64 size() const;
+    // now is the machine's time, which events never finish before
+    void push(const InFlightEvent& event, Time now);
+    // Remove the earliest event if it finishes by limit. is_last_for_line is
+    // set when the line has nothing else pending.
+    bool pop_until(Time limit, InFlightEvent& event, bool& is_last_for_line);
+    // When the line's last pending event finishes. Returns false if there
+    // is none.
+    bool line_finish_time(u32 cache_id, u64 line_index, Time& finish_time) const;
+    // When the last pending event finishes
+    Time last_finish_time() const;
+    // Every pending event, in an order that pushing them back in again
+    // keeps
+    void pending(std::vector<InFlightEvent>& events) const;
 
-    void push_line(Cache* parent_cache, u64 set_index, Line& dst_line, Time latency);
-    void flush();
+private:
+    static const u64 SLOT_BITS = 8;
+    static const u64 SLOT_LEN = 1UL << SLOT_BITS;
+    static const u64 NUM_SLOTS = 1024;
+    static const u64 HORIZON = NUM_SLOTS * SLOT_LEN;
+
+    std::vector<InFlightEvent> slots[NUM_SLOTS];
+    std::vector<InFlightEvent> overflow; // Min heap on finish_time
+    Time cursor; // Start of the slot the wheel is at
+    u64 wheel_count;
+    // Events pending for each in-flight line, and when the last finishes
+    struct LineEvents {
+        Time finish_time;
+        u64 count;
+    };
+    std::unordered_map<u64, LineEvents> line_events; // By line_key()
 
+    static u64 line_key(u32 cache_id, u64 line_index);
+    std::vector<InFlightEvent>& slot_of(Time time);
+    void insert(const InFlightEvent& event);
+    void advance_cursor(Time slot_start);
 };
 
 struct Machine {
@@ -160,8 +438,18 @@ struct Machine {
     bool waited_this_access;
 
     Machine();
+    Machine(const Machine&) = delete;
+    // Every level must be added before the simulation starts
+    void add_cache(Cache* cache);
     void advance_time(Time duration, Cache* active_cache = nullptr);
-    void wait_for_line(Cache* cache, u64 tag, u64 set_index);
+    // Put a line of a cache in flight for latency from now
+    void push_line(Cache* cache, u64 line_index, Time latency);
+    // Keep a cache busy from now until finish_time, for an access that
+    // doesn't hold up the machine
+    void push_busy(Cache* cache, Time finish_time);
+    void wait_for_line(Cache* cache, u64 line_index);
+    // Let everything still in flight finish
+    void drain();
 };
 
 std::string unit_to_string(u64 value, char unit, s8 initial_exponent);
\ No newline at end of file
@@ -0,0 +1,214 @@
+#pragma once
+#include "cache.hpp"
+#include "profile.hpp"
+
+constexpr u64 const_log2(u64 value) {
+    return value <= 1 ? 0 : 1 + const_log2(value >> 1);
+}
+
+// A cache level with its geometry, write policy, replacement policy and
+// parent all fixed at compile time. It simulates exactly what a Cache built
+// with the same parameters would, but shifts and masks are constants, the
+// tag search is over a constant number of ways, flag checks fold away, and
+// the calls into Parent (a MainMemory or another final level) are direct, so
+// a whole hierarchy of them can be inlined from L1 down to memory. Use Cache
+// for anything only known at runtime.
+//
+// Its lines, tags and replacement state live in the arrays below, which the
+// Cache base is given as its own, along with the same geometry, flags,
+// policy and parent. The Cache methods it doesn't override (save_state,
+// invalidate, fill_latency, the MSHR paths, ...) so work on the same lines,
+// only without the constants. The one exception is prefetching: read_at and
+// write_at never run a prefetcher, so set_prefetcher is deleted.
+template <u64 Capacity, u64 Assoc, u64 BlockSize, CacheFlags WritePolicy,
+    typename Parent, ReplacementPolicy Policy = RANDOM>
+struct CacheLevel final : public Cache {
+    static constexpr u64 NUM_SETS = Capacity / (Assoc * BlockSize);
+    static constexpr u64 NUM_LINES = NUM_SETS * Assoc;
+    static constexpr u64 BLOCK_BITS = const_log2(BlockSize);
+    static constexpr u64 SET_BITS = const_log2(NUM_SETS);
+    static constexpr u64 POLICY_STRIDE = Replacement<Policy>::state_bytes(Assoc);
+    static constexpr bool IS_WRITE_BACK = !(WritePolicy & WRITE_THROUGH);
+    static constexpr bool IS_ASYNC_WRITE = (WritePolicy & ASYNC_WRITE) != 0;
+
+    static_assert((BlockSize & (BlockSize - 1)) == 0, "block size must be a power of two");
+    static_assert(NUM_SETS > 0 && (NUM_SETS & (NUM_SETS - 1)) == 0,
+        "capacity / (associativity * block size) must be a power of two");
+
+    CacheLevel(Time latency, Watt idle_power, Watt running_power,
+        Joule transfer_penalty, Machine& machine, Parent& parent)
+        : Cache(Capacity, Assoc, BlockSize, latency, idle_power, running_power,
+            transfer_penalty, WritePolicy, machine, &parent, Policy,
+            this->way_lines, this->way_tags, this->set_state)
+        , parent_level(parent)
+    {
+        std::fill(this->way_tags, this->way_tags + NUM_LINES, INVALID_TAG);
+        for (u64 set_index = 0; set_index < NUM_SETS; set_index++) {
+            Replacement<Policy>::reset(this->set_state + set_index*POLICY_STRIDE, Assoc);
+        }
+    }
+
+    void set_prefetcher(Prefetcher* prefetcher) = delete;
+
+    // These hide Cache's versions, which use the runtime geometry
+    const Line& read(address addr) {
+        return this->read_at(addr, this->set_index_of(addr), this->tag_of(addr));
+    }
+    const Line& write(address addr, value val) {
+        return this->write_at(addr, val, this->set_index_of(addr), this->tag_of(addr));
+    }
+    u64 set_index_of(address addr) const {
+        return address_set_index(addr, BLOCK_BITS, SET_BITS);
+    }
+    u64 tag_of(address addr) const {
+        return address_tag(addr, BLOCK_BITS, SET_BITS);
+    }
+    void prefetch_set(u64 set_index) const {
+        __builtin_prefetch(this->way_tags + set_index*Assoc);
+        __builtin_prefetch(this->way_lines + set_index*Assoc);
+    }
+    u64 footprint() const {
+        return (NUM_LINES) * (sizeof(Line) + sizeof(u64));
+    }
+
+    const Line& read_at(address addr, u64 set_index, u64 tag) override {
+        const s64 way = find_way(this->way_tags + set_index*Assoc, Assoc, tag);
+        if (way >= 0) {
+            Line& cur_line = this->way_lines[set_index*Assoc + way];
+            this->read_hits++;
+            this->touch_way(set_index, way);
+            if (cur_line.is_in_flight()) {
+                this->machine.wait_for_line(this, set_index*Assoc + way);
+            }
+            this->machine.advance_time(this->latency, this);
+            return cur_line;
+        }
+
+        // Miss: fill from the parent, then read the new line (as Cache::read)
+        this->read_misses++;
+        this->parent_level.read(addr);
+        const Line& replaced_line = this->put(set_index, tag);
+        this->machine.advance_time(this->latency, this);
+        this->read_hits++;
+        this->machine.advance_time(this->latency, this);
+        return replaced_line;
+    }
+
+    const Line& write_at(address addr, value val, u64 set_index, u64 tag) override {
+        const s64 way = find_way(this->way_tags + set_index*Assoc, Assoc, tag);
+        if (way >= 0) {
+            Line& cur_line = this->way_lines[set_index*Assoc + way];
+            this->write_hits++;
+            this->touch_way(set_index, way);
+            this->write_line(set_index*Assoc + way, addr, val);
+            return cur_line;
+        }
+
+        // Miss: allocate the line with a read, then write it (as Cache::write)
+        this->write_misses++;
+        this->read_misses--;
+        this->read_hits--;
+        Line& filled_line = const_cast<Line&>(this->read_at(addr, set_index, tag));
+        this->write_hits++;
+        this->write_line(&filled_line - this->way_lines, addr, val);
+        return filled_line;
+    }
+
+    void warm(address addr, bool is_write) override {
+        const u64 set_index = address_set_index(addr, BLOCK_BITS, SET_BITS);
+        const u64 tag = address_tag(addr, BLOCK_BITS, SET_BITS);
+
+        const s64 way = find_way(this->way_tags + set_index*Assoc, Assoc, tag);
+        if (way >= 0) {
+            this->touch_way(set_index, way);
+            if (is_write && IS_WRITE_BACK) {
+                this->way_lines[set_index*Assoc + way].set_dirty(true);
+            } else if (is_write) {
+                this->parent_level.warm(addr, true);
+            }
+            return;
+        }
+
+        this->parent_level.warm(addr, false);
+        const u64 victim_way = this->find_victim(set_index);
+        const Line& victim_line = this->way_lines[set_index*Assoc + victim_way];
+        if (IS_WRITE_BACK && victim_line.is_dirty()) {
+            this->parent_level.warm(this->block_address(set_index, victim_line.get_tag()), true);
+        }
+        this->install_line(set_index, victim_way, tag, is_write && IS_WRITE_BACK);
+        if (is_write && !IS_WRITE_BACK) {
+            this->parent_level.warm(addr, true);
+        }
+    }
+
+    Line& line_at(u64 line_index) override {
+        return this->way_lines[line_index];
+    }
+
+    // Hides Cache's version, which uses the runtime geometry
+    address block_address(u64 set_index, u64 tag) const {
+        return (tag << (SET_BITS + BLOCK_BITS)) | (set_index << BLOCK_BITS);
+    }
+
+private:
+    Parent& parent_level;
+    Line way_lines[NUM_LINES];
+    u64 way_tags[NUM_LINES];
+    u8 set_state[POLICY_STRIDE ? NUM_SETS*POLICY_STRIDE : 1];
+
+    void write_line(u64 line_index, address addr, value val) {
+        if (IS_WRITE_BACK) {
+            this->way_lines[line_index].set_dirty(true);
+        } else {
+            if (IS_ASYNC_WRITE) {
+                this->machine.push_line(this, line_index, this->latency);
+            }
+            this->parent_level.write(addr, val);
+        }
+    }
+
+    const Line& put(u64 set_index, u64 tag) {
+        PROFILE_SCOPE(PHASE_FILL);
+        const u64 victim_way = this->find_victim(set_index);
+        const Line& victim_line = this->way_lines[set_index*Assoc + victim_way];
+        if (victim_line.is_in_flight()) {
+            this->machine.wait_for_line(this, set_index*Assoc + victim_way);
+        }
+        if (IS_WRITE_BACK && victim_line.is_dirty()) {
+            this->dirty_evict_count++;
+            this->parent_level.write(this->block_address(set_index, victim_line.get_tag()), 0);
+        }
+        if (victim_line.is_valid()) {
+            this->unused_prefetches += victim_line.is_prefetched();
+            this->parent_level.child_evicted(this->block_address(set_index, victim_line.get_tag()));
+        }
+        return this->install_line(set_index, victim_way, tag, false);
+    }
+
+    u64 find_victim(u64 set_index) {
+        const s64 invalid_way = find_way(this->way_tags + set_index*Assoc, Assoc, INVALID_TAG);
+        u64 victim_way = 0;
+        if (invalid_way >= 0) {
+            victim_way = invalid_way;
+        } else if (Assoc > 1) {
+            victim_way = Replacement<Policy>::victim(this->set_state + set_index*POLICY_STRIDE, Assoc, this->rng);
+        }
+        if (Assoc > 1) {
+            Replacement<Policy>::fill(this->set_state + set_index*POLICY_STRIDE, Assoc, victim_way, this->rng);
+        }
+        return victim_way;
+    }
+
+    void touch_way(u64 set_index, u64 way) {
+        if (Assoc > 1) {
+            Replacement<Policy>::touch(this->set_state + set_index*POLICY_STRIDE, Assoc, way);
+        }
+    }
+
+    Line& install_line(u64 set_index, u64 way, u64 tag, bool is_dirty) {
+        Line& line = this->way_lines[set_index*Assoc + way];
+        line.set_metadata(tag, true, is_dirty, false);
+        this->way_tags[set_index*Assoc + way] = tag;
+        return line;
+    }
+};
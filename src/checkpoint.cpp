@@ -0,0 +1,135 @@
+#include "checkpoint.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool parse_checkpoint_spec(const char* spec, u64& records, const char*& filename) {
+    char* end;
+    records = strtoull(spec, &end, 10);
+    if (end == spec || *end != ':' || end[1] == '\0' || records == 0) {
+        return false;
+    }
+    filename = end + 1;
+    return true;
+}
+
+bool can_checkpoint(const SimConfig& config) {
+    return config.l1_prefetcher == NO_PREFETCHER && config.l2_prefetcher == NO_PREFETCHER &&
+        config.l1_mshrs == 0 && config.l2_mshrs == 0 && config.write_buffer_depth == 0 && config.dram.channels == 0;
+}
+
+static void append_u64(std::string& out, u64 value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+bool write_checkpoint(const char* filename, const char* trace_name, const Hierarchy& hierarchy,
+    const TracePosition& position) {
+    std::vector<InFlightEvent> events;
+    hierarchy.machine.in_flight_queue.pending(events);
+
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    if (!stat_trace(trace_name, header.trace_size, header.trace_mtime)) {
+        return false;
+    }
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.l2_capacity = hierarchy.config.l2_capacity;
+    header.l2_associativity = hierarchy.config.l2_associativity;
+    header.block_size = hierarchy.config.block_size;
+    header.policy = hierarchy.config.policy;
+    header.position = position;
+    header.time = hierarchy.machine.time;
+    header.waited_this_access = hierarchy.machine.waited_this_access;
+    header.num_events = events.size();
+
+    std::string body;
+    for (const InFlightEvent& event : events) {
+        append_u64(body, event.finish_time);
+        append_u64(body, event.line_index);
+        append_u64(body, event.cache_id);
+    }
+    hierarchy.dram.save_state(body);
+    hierarchy.l2.save_state(body);
+    hierarchy.l1d.save_state(body);
+    hierarchy.l1i.save_state(body);
+    header.size = sizeof(header) + body.size();
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+    const bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(body.data(), 1, body.size(), file) == body.size();
+    return fclose(file) == 0 && ok;
+}
+
+static u64 read_u64(const u8*& in) {
+    u64 value;
+    memcpy(&value, in, sizeof(value));
+    in += sizeof(value);
+    return value;
+}
+
+bool restore_checkpoint(const char* filename, const char* trace_name, Hierarchy& hierarchy, TracePosition& position) {
+    const int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        printf("error: can't read checkpoint %s\n", filename);
+        if (fd != -1) {
+            close(fd);
+        }
+        return false;
+    }
+    const size_t size = st.st_size;
+    void* base = size >= sizeof(CheckpointHeader) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("error: %s is not a checkpoint\n", filename);
+        return false;
+    }
+
+    CheckpointHeader header;
+    memcpy(&header, base, sizeof(header));
+    u64 trace_size = 0, trace_mtime = 0;
+    stat_trace(trace_name, trace_size, trace_mtime);
+    bool ok = true;
+    if (memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 || header.size != size) {
+        printf("error: %s is not a checkpoint\n", filename);
+        ok = false;
+    } else if (header.trace_size != trace_size || header.trace_mtime != trace_mtime) {
+        printf("error: checkpoint %s was taken from a %lu byte trace, and %s is another trace or has changed since\n",
+            filename, header.trace_size, trace_name);
+        ok = false;
+    } else if (header.l2_capacity != hierarchy.config.l2_capacity ||
+        header.l2_associativity != hierarchy.config.l2_associativity ||
+        header.block_size != hierarchy.config.block_size || header.policy != hierarchy.config.policy) {
+        printf("error: checkpoint %s is of a %lu byte, %lu-way L2 with %lu byte blocks and %s replacement\n",
+            filename, header.l2_capacity, header.l2_associativity, header.block_size,
+            replacement_policy_name(static_cast<ReplacementPolicy>(header.policy)));
+        ok = false;
+    }
+    if (ok) {
+        Machine& machine = hierarchy.machine;
+        machine.time = header.time;
+        machine.waited_this_access = header.waited_this_access;
+        const u8* in = static_cast<const u8*>(base) + sizeof(header);
+        for (u64 i = 0; i < header.num_events; i++) {
+            InFlightEvent event;
+            event.finish_time = read_u64(in);
+            event.line_index = read_u64(in);
+            event.cache_id = read_u64(in);
+            machine.in_flight_queue.push(event, machine.time);
+        }
+        in = hierarchy.dram.restore_state(in);
+        in = hierarchy.l2.restore_state(in);
+        in = hierarchy.l1d.restore_state(in);
+        hierarchy.l1i.restore_state(in);
+        position = header.position;
+    }
+    munmap(base, size);
+    return ok;
+}
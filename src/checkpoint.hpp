@@ -0,0 +1,45 @@
+#pragma once
+#include "simulator.hpp"
+
+// Checkpoints of a hierarchy part way through a trace, so every experiment
+// run after the same warmup can start from it rather than simulate it again.
+//
+// A checkpoint holds the state of the levels (their lines, replacement state
+// and counters), the machine's time and pending in-flight events, and where
+// the trace had got to. It also keeps the trace's size and modification
+// time, and is only restored into a run of the same, unchanged trace. Only
+// the base model can be checkpointed: prefetcher tables, MSHRs, write buffer
+// entries and DRAM bank state aren't kept. A checkpoint can be restored
+// into any configuration with the same L2 size, associativity, block size
+// and replacement policy; prefetchers, MSHRs, a write buffer or a DRAM model
+// there start out cold.
+//
+// Layout, in host byte order: a CheckpointHeader, num_events events of three
+// u64s (finish time, line index, cache id), then the state of the DRAM, L2,
+// L1d and L1i in turn as Cache::save_state writes it.
+struct CheckpointHeader {
+    char magic[8];
+    u64 l2_capacity, l2_associativity, block_size, policy;
+    u64 trace_size, trace_mtime; // Of the trace it was taken from, mtime in ns
+    TracePosition position;
+    Time time;
+    u64 waited_this_access;
+    u64 num_events;
+    u64 size; // Of the whole file
+};
+
+const char CHECKPOINT_MAGIC[8] = {'C', 'S', 'I', 'M', 'C', 'K', 'P', '3'};
+
+// Parse "<records>:<file>"
+bool parse_checkpoint_spec(const char* spec, u64& records, const char*& filename);
+// Whether config keeps all its state where a checkpoint can get at it
+bool can_checkpoint(const SimConfig& config);
+// Write hierarchy's state, with trace_name at position, to filename. Returns
+// false if the file couldn't be written.
+bool write_checkpoint(const char* filename, const char* trace_name, const Hierarchy& hierarchy,
+    const TracePosition& position);
+// Map filename and load it into hierarchy, setting position to where
+// trace_name is to carry on from. Prints what is wrong and returns false if
+// the file is unreadable, isn't a checkpoint, was taken from another trace
+// or doesn't fit hierarchy.
+bool restore_checkpoint(const char* filename, const char* trace_name, Hierarchy& hierarchy, TracePosition& position);
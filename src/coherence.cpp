@@ -0,0 +1,165 @@
+#include "coherence.hpp"
+#include <cassert>
+#include <cmath>
+#include <thread>
+
+Directory::Directory(u64 block_size)
+    : messages(0)
+    , defer_invalidations(false)
+    , block_bits(static_cast<u64>(log2(static_cast<double>(block_size))))
+{}
+
+u32 Directory::add_agent(Cache* cache) {
+    assert(this->agents.size() < MAX_AGENTS);
+    this->agents.push_back(cache);
+    this->stats.push_back(CoherenceStats{0, 0, 0, 0});
+    this->taken.emplace_back();
+    this->pending.emplace_back();
+    return this->agents.size() - 1;
+}
+
+void Directory::read(u32 agent, u64 addr) {
+    const u64 block = addr >> this->block_bits;
+    const u64 agent_bit = 1UL << agent;
+    this->messages++;
+    if (this->taken[agent].erase(block)) {
+        this->stats[agent].coherence_misses++;
+    }
+
+    Entry& entry = this->entries[block];
+    assert(this->defer_invalidations || !(entry.holders & agent_bit));
+    const u64 others = entry.holders & ~agent_bit;
+    if (others == 0) {
+        entry.state = EXCLUSIVE;
+    } else {
+        if (entry.state == EXCLUSIVE || entry.state == MODIFIED) {
+            // The owner is the only holder; it keeps a shared copy
+            this->stats[__builtin_ctzl(others)].downgrades++;
+            this->messages += 2;
+        }
+        entry.state = SHARED;
+    }
+    entry.holders |= agent_bit;
+}
+
+void Directory::write(u32 agent, u64 addr) {
+    const u64 block = addr >> this->block_bits;
+    const u64 agent_bit = 1UL << agent;
+    Entry& entry = this->entries[block];
+    assert(this->defer_invalidations || (entry.holders & agent_bit));
+    if (entry.holders == agent_bit && entry.state != SHARED) {
+        // Already the only holder, so nobody needs telling
+        entry.state = MODIFIED;
+        return;
+    }
+
+    this->stats[agent].upgrades++;
+    this->messages++;
+    for (u64 others = entry.holders & ~agent_bit; others; others &= others - 1) {
+        const u32 other = __builtin_ctzl(others);
+        if (this->defer_invalidations) {
+            this->pending[other].push_back(addr);
+        } else {
+            this->agents[other]->invalidate(addr);
+        }
+        this->stats[other].invalidations++;
+        this->taken[other].insert(block);
+        this->messages += 2;
+    }
+    entry.state = MODIFIED;
+    entry.holders = agent_bit;
+}
+
+void Directory::evicted(u32 agent, u64 addr) {
+    const u64 block = addr >> this->block_bits;
+    this->messages++;
+    auto entry = this->entries.find(block);
+    assert(this->defer_invalidations || entry != this->entries.end());
+    if (entry == this->entries.end()) {
+        return;
+    }
+    entry->second.holders &= ~(1UL << agent);
+    if (entry->second.holders == 0) {
+        this->entries.erase(entry);
+    }
+}
+
+void Directory::deliver_invalidations() {
+    for (size_t agent = 0; agent < this->agents.size(); agent++) {
+        for (u64 addr : this->pending[agent]) {
+            this->agents[agent]->invalidate(addr);
+        }
+        this->pending[agent].clear();
+    }
+}
+
+CoherencePort::CoherencePort(Cache& shared, Directory& directory, Machine& machine,
+    SharedRequestQueue* requests, Time latency_estimate)
+    // The port keeps no lines, so its geometry is never used
+    : Cache(1, 1, 1, latency_estimate, 0, 0, 0, machine)
+    , shared(shared)
+    , directory(directory)
+    , requests(requests)
+    , agent_id(0)
+{
+    this->line.set_valid(true);
+}
+
+void CoherencePort::attach(Cache* cache) {
+    this->agent_id = this->directory.add_agent(cache);
+}
+
+u32 CoherencePort::agent() const {
+    return this->agent_id;
+}
+
+void CoherencePort::push(const address addr, SharedRequestKind kind) {
+    const SharedRequest request = {this->machine.time, addr, this->agent_id, kind};
+    // The owner never blocks on a core, so a full queue soon drains
+    while (!this->requests->try_push(request)) {
+        std::this_thread::yield();
+    }
+}
+
+const Line& CoherencePort::read_at(const address addr, u64 set_index, u64 tag) {
+    if (this->requests) {
+        this->push(addr, SHARED_READ);
+        this->machine.advance_time(this->latency);
+        return this->line;
+    }
+    this->directory.read(this->agent_id, addr);
+    return this->shared.read(addr);
+}
+
+const Line& CoherencePort::write_at(const address addr, value val, u64 set_index, u64 tag) {
+    if (this->requests) {
+        this->push(addr, SHARED_WRITE);
+        return this->line;
+    }
+    this->directory.write(this->agent_id, addr);
+    return this->shared.write(addr, val);
+}
+
+// Sampling isn't supported with several cores, so warming leaves the
+// directory alone.
+void CoherencePort::warm(const address addr, bool is_write) {
+    this->shared.warm(addr, is_write);
+}
+
+// Nothing is ever in flight in the port itself
+Line& CoherencePort::line_at(const u64 line_index) {
+    return this->line;
+}
+
+void CoherencePort::child_evicted(const address addr) {
+    if (this->requests) {
+        this->push(addr, SHARED_EVICT);
+        return;
+    }
+    this->directory.evicted(this->agent_id, addr);
+}
+
+// Multi-core runs don't prefetch, so this only keeps the port complete
+Time CoherencePort::fill_latency(const address addr) {
+    return this->shared.fill_latency(addr);
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include "cache.hpp"
+#include "spsc_queue.hpp"
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// MESI states of a block, as the directory sees it
+enum CoherenceState : u8 {
+    INVALID,
+    SHARED,
+    EXCLUSIVE,
+    MODIFIED,
+};
+
+// What coherence cost one private cache
+struct CoherenceStats {
+    u64 invalidations;    // Blocks taken away by another cache's write
+    u64 coherence_misses; // Misses on blocks taken away like that
+    u64 downgrades;       // Exclusive blocks demoted to shared by another cache's read
+    u64 upgrades;         // Writes to a block that was shared
+};
+
+// A directory beside the shared level that keeps the private caches above it
+// (its agents) coherent with MESI. For every block some agent holds it keeps
+// the block's state and a bitmask of the agents holding it; blocks nobody
+// holds have no entry. Agents tell it about every miss, write and eviction
+// through their CoherencePort, so the holders are exact and invalidations
+// only go to caches that really have the block.
+//
+// With defer_invalidations set, invalidations are queued per agent until
+// deliver_invalidations() instead of being applied to the agent's cache at
+// once, for when the agents run on other threads. An agent may then refetch
+// a block before an invalidation of it arrives, so the holders become a
+// superset of the true ones and every operation tolerates that.
+//
+// The private caches are write-through, so the shared level always has the
+// current data and MODIFIED only means the owner may write without asking
+// anyone. Message counts follow a directory protocol: one request per miss,
+// upgrade or eviction notice, and a request and an acknowledgement per
+// invalidation or downgrade.
+struct Directory {
+    static const u32 MAX_AGENTS = 64;
+
+    Directory(u64 block_size);
+
+    // Register a private cache, returning its agent id
+    u32 add_agent(Cache* cache);
+    // agent missed on addr and is about to fill it
+    void read(u32 agent, u64 addr);
+    // agent is writing addr (and already holds it)
+    void write(u32 agent, u64 addr);
+    // agent evicted addr
+    void evicted(u32 agent, u64 addr);
+    // Apply every queued invalidation (see defer_invalidations)
+    void deliver_invalidations();
+
+    std::vector<CoherenceStats> stats; // By agent
+    u64 messages;
+    bool defer_invalidations;
+
+private:
+    struct Entry {
+        CoherenceState state;
+        u64 holders; // Bit i set when agent i holds the block
+    };
+    const u64 block_bits;
+    std::vector<Cache*> agents;
+    std::unordered_map<u64, Entry> entries; // By block number
+    // Per agent, blocks invalidated from it that it hasn't missed on since
+    std::vector<std::unordered_set<u64>> taken;
+    // Per agent, addresses still to be invalidated
+    std::vector<std::vector<u64>> pending;
+};
+
+// An access a core's private cache makes to the shared levels, sent to their
+// owner in a parallel multi-core run
+enum SharedRequestKind : u8 {
+    SHARED_READ,
+    SHARED_WRITE,
+    SHARED_EVICT,
+};
+
+struct SharedRequest {
+    Time time; // On the clock of the core making it
+    u64 addr;
+    u32 agent;
+    SharedRequestKind kind;
+};
+
+using SharedRequestQueue = SpscQueue<SharedRequest>;
+
+// Where a private cache meets the shared level. It is the private cache's
+// parent, so every miss, write-through and eviction of that cache passes
+// through it. Holds no lines.
+//
+// Without a request queue it tells the directory and forwards accesses on to
+// the shared level, taking the shared level's time. With one, it pushes each
+// access onto the queue for the shared level's owner thread instead, and
+// charges the requesting cache's machine a fixed estimate (the shared level's
+// hit latency) for a read; the owner works out the real latency later.
+struct CoherencePort final : public Cache {
+    CoherencePort(Cache& shared, Directory& directory, Machine& machine,
+        SharedRequestQueue* requests = nullptr, Time latency_estimate = 0);
+
+    // Make cache (whose parent must be this port) one of the directory's agents
+    void attach(Cache* cache);
+    u32 agent() const;
+
+    const Line& read_at(address addr, u64 set_index, u64 tag) override;
+    const Line& write_at(address addr, value val, u64 set_index, u64 tag) override;
+    void warm(address addr, bool is_write) override;
+    Line& line_at(u64 line_index) override;
+    void child_evicted(address addr) override;
+    Time fill_latency(address addr) override;
+
+private:
+    Cache& shared;
+    Directory& directory;
+    SharedRequestQueue* const requests;
+    u32 agent_id;
+    // Handed back for queued reads: valid, clean and never in flight.
+    Line line;
+
+    void push(address addr, SharedRequestKind kind);
+};
@@ -0,0 +1,224 @@
+#include "dram.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+const char* row_policy_name(RowPolicy policy) {
+    switch (policy) {
+        case OPEN_ROW: return "open";
+        case CLOSED_ROW: return "closed";
+    }
+    return "?";
+}
+
+bool parse_row_policy(const char* name, RowPolicy& policy) {
+    if (strcmp(name, "open") == 0) {
+        policy = OPEN_ROW;
+    } else if (strcmp(name, "closed") == 0) {
+        policy = CLOSED_ROW;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool is_power_of_two(u64 value) {
+    return value && !(value & (value - 1));
+}
+
+bool parse_dram_spec(const char* spec, DramConfig& config) {
+    DramConfig parsed = {1, 1, 8, OPEN_ROW};
+    const char* colon = strchr(spec, ':');
+    const std::string policy_name = colon ? std::string(spec, colon - spec) : std::string(spec);
+    if (!parse_row_policy(policy_name.c_str(), parsed.row_policy)) {
+        return false;
+    }
+    if (colon) {
+        char* end;
+        parsed.channels = strtoull(colon + 1, &end, 10);
+        if (*end != ':') {
+            return false;
+        }
+        parsed.ranks = strtoull(end + 1, &end, 10);
+        if (*end != ':') {
+            return false;
+        }
+        parsed.banks = strtoull(end + 1, &end, 10);
+        if (*end != '\0') {
+            return false;
+        }
+    }
+    if (!is_power_of_two(parsed.channels) || !is_power_of_two(parsed.ranks) || !is_power_of_two(parsed.banks)) {
+        return false;
+    }
+    config = parsed;
+    return true;
+}
+
+static u64 log2_of(u64 value) {
+    return 63 - __builtin_clzl(value);
+}
+
+DramModel::DramModel(const DramConfig& config, u64 block_size)
+    : config(config)
+    , row_hits(0)
+    , row_misses(0)
+    , row_conflicts(0)
+    , activations(0)
+    , reads(0)
+    , writes(0)
+    , refreshes(0)
+    , forwarded_reads(0)
+    , write_drains(0)
+    , block_bits(log2_of(block_size))
+    , column_bits(block_size < DRAM_ROW_SIZE ? log2_of(DRAM_ROW_SIZE / block_size) : 0)
+    , channel_bits(log2_of(config.channels))
+    , bank_bits(log2_of(config.banks))
+    , rank_bits(log2_of(config.ranks))
+    , banks(config.channels * config.ranks * config.banks, Bank{~0UL, 0, 0})
+    , ranks(config.channels * config.ranks, Rank{DRAM_T_REFI})
+    , bus_free(config.channels, 0)
+    , write_queue()
+{}
+
+// Address bits, from the bottom: block offset, column, channel, bank, rank
+// and row
+DramModel::Location DramModel::locate(u64 addr) const {
+    u64 bits = addr >> (this->block_bits + this->column_bits);
+    Location location;
+    location.channel = bits & ((1UL << this->channel_bits) - 1);
+    bits >>= this->channel_bits;
+    location.bank = bits & ((1UL << this->bank_bits) - 1);
+    bits >>= this->bank_bits;
+    location.rank = bits & ((1UL << this->rank_bits) - 1);
+    location.row = bits >> this->rank_bits;
+    return location;
+}
+
+DramModel::Bank& DramModel::bank_of(const Location& location) {
+    return this->banks[(location.channel*this->config.ranks + location.rank)*this->config.banks + location.bank];
+}
+
+void DramModel::refresh_until(u64 channel, u64 rank_index, Time now) {
+    Rank& rank = this->ranks[channel*this->config.ranks + rank_index];
+    while (rank.next_refresh <= now) {
+        Bank* const rank_banks = &this->banks[(channel*this->config.ranks + rank_index)*this->config.banks];
+        // Every row has to be closed first
+        Time start = rank.next_refresh;
+        for (u64 i = 0; i < this->config.banks; i++) {
+            start = std::max(start, rank_banks[i].ready_time);
+            if (rank_banks[i].open_row != ~0UL) {
+                start = std::max(start, rank_banks[i].precharge_time + DRAM_T_RP);
+            }
+        }
+        for (u64 i = 0; i < this->config.banks; i++) {
+            rank_banks[i].open_row = ~0UL;
+            rank_banks[i].ready_time = start + DRAM_T_RFC;
+        }
+        this->refreshes++;
+        rank.next_refresh += DRAM_T_REFI;
+    }
+}
+
+Time DramModel::serve(u64 addr, bool is_write, Time start) {
+    const Location location = this->locate(addr);
+    this->refresh_until(location.channel, location.rank, start);
+    Bank& bank = this->bank_of(location);
+    Time issue = std::max(start, bank.ready_time);
+    if (bank.open_row == location.row) {
+        this->row_hits++;
+    } else {
+        if (bank.open_row == ~0UL) {
+            this->row_misses++;
+        } else {
+            this->row_conflicts++;
+            issue = std::max(issue, bank.precharge_time) + DRAM_T_RP;
+        }
+        this->activations++;
+        bank.precharge_time = issue + DRAM_T_RAS;
+        issue += DRAM_T_RCD;
+    }
+    Time& bus_free = this->bus_free[location.channel];
+    const Time data = std::max(issue + DRAM_T_CAS, bus_free);
+    const Time done = data + DRAM_T_BURST;
+    bus_free = done;
+    if (is_write) {
+        this->writes++;
+        bank.precharge_time = std::max(bank.precharge_time, done + DRAM_T_WR);
+    } else {
+        this->reads++;
+    }
+    if (this->config.row_policy == CLOSED_ROW) {
+        bank.open_row = ~0UL;
+        bank.ready_time = std::max(bank.precharge_time, done) + DRAM_T_RP;
+    } else {
+        bank.open_row = location.row;
+        // The next column command can follow once this burst is under way
+        bank.ready_time = data - DRAM_T_CAS + DRAM_T_BURST;
+    }
+    return done;
+}
+
+void DramModel::drain_writes(u64 until_len, Time now) {
+    this->write_drains++;
+    while (this->write_queue.size() > until_len) {
+        // First ready: the oldest write to a row that is open, if any
+        size_t next = 0;
+        for (size_t i = 0; i < this->write_queue.size(); i++) {
+            const Location location = this->locate(this->write_queue[i].addr);
+            if (this->bank_of(location).open_row == location.row) {
+                next = i;
+                break;
+            }
+        }
+        const Request request = this->write_queue[next];
+        this->write_queue.erase(this->write_queue.begin() + next);
+        this->serve(request.addr, true, std::max(now, request.arrival));
+    }
+}
+
+Time DramModel::read(u64 addr, Time arrival) {
+    const Time start = arrival + DRAM_CONTROLLER_LATENCY;
+    const u64 block = addr >> this->block_bits;
+    for (const Request& request : this->write_queue) {
+        if (request.addr >> this->block_bits == block) {
+            this->forwarded_reads++;
+            return start;
+        }
+    }
+    return this->serve(addr, false, start);
+}
+
+void DramModel::write(u64 addr, Time arrival) {
+    this->write_queue.push_back(Request{addr, arrival + DRAM_CONTROLLER_LATENCY});
+    if (this->write_queue.size() >= DRAM_WRITE_QUEUE_HIGH) {
+        this->drain_writes(DRAM_WRITE_QUEUE_LOW, arrival + DRAM_CONTROLLER_LATENCY);
+    }
+}
+
+Time DramModel::flush(Time now) {
+    Time last = now;
+    if (!this->write_queue.empty()) {
+        this->drain_writes(0, now);
+    }
+    for (Time bus_free : this->bus_free) {
+        last = std::max(last, bus_free);
+    }
+    return last;
+}
+
+void DramModel::settle(Time now) {
+    for (u64 channel = 0; channel < this->config.channels; channel++) {
+        for (u64 rank = 0; rank < this->config.ranks; rank++) {
+            this->refresh_until(channel, rank, now);
+        }
+    }
+}
+
+Joule DramModel::energy() const {
+    const Joule energy = this->activations*DRAM_ACTIVATE_ENERGY + this->reads*DRAM_READ_ENERGY +
+        this->writes*DRAM_WRITE_ENERGY + this->refreshes*DRAM_REFRESH_ENERGY;
+    return energy * 1000; // convert to femtoJoules
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include "cache.hpp"
+#include <vector>
+
+// What a bank does with its row once an access is done
+enum RowPolicy : u8 {
+    OPEN_ROW,   // Leave it open, betting the next access hits it
+    CLOSED_ROW, // Precharge at once, so the next access needn't wait for it
+};
+
+const char* row_policy_name(RowPolicy policy);
+// Returns false if name is not a row policy
+bool parse_row_policy(const char* name, RowPolicy& policy);
+
+// The organisation of the DRAM behind the controller. Every count must be a
+// power of two.
+struct DramConfig {
+    u64 channels;
+    u64 ranks;    // Per channel
+    u64 banks;    // Per rank
+    RowPolicy row_policy;
+};
+
+// Parse "<open|closed>[:<channels>:<ranks>:<banks>]", e.g. "open" or
+// "closed:2:1:16". Without the counts, one channel of one rank of 8 banks.
+bool parse_dram_spec(const char* spec, DramConfig& config);
+
+// Bytes in a row of one rank
+const u64 DRAM_ROW_SIZE = 8192;
+
+// Timings, roughly those of DDR4-2400 (a 833 ps clock)
+const Time DRAM_CONTROLLER_LATENCY = ns(10); // Getting a request to the controller
+const Time DRAM_T_RCD = ps(14160); // Activate to column command
+const Time DRAM_T_CAS = ps(14160); // Column command to data
+const Time DRAM_T_RP = ps(14160);  // Precharge to activate
+const Time DRAM_T_RAS = ns(32);    // Activate to precharge
+const Time DRAM_T_WR = ns(15);     // End of a write burst to precharge
+const Time DRAM_T_BURST = ps(3332); // One block over the data bus
+const Time DRAM_T_RFC = ns(350);   // A refresh, during which the rank does nothing else
+const Time DRAM_T_REFI = ns(7800); // Between refreshes of a rank
+
+// Energy per operation, roughly that of a rank of eight x8 DDR4 chips
+const Joule DRAM_ACTIVATE_ENERGY = pJ(1500); // An activate and its precharge
+const Joule DRAM_READ_ENERGY = pJ(1100);     // A block burst, I/O included
+const Joule DRAM_WRITE_ENERGY = pJ(1200);
+const Joule DRAM_REFRESH_ENERGY = nJ(40);    // Refreshing every bank of a rank
+
+// Writes the controller holds back, draining them once HIGH are waiting
+// until only LOW are
+const u64 DRAM_WRITE_QUEUE_HIGH = 24;
+const u64 DRAM_WRITE_QUEUE_LOW = 8;
+
+// A DRAM controller over channels of ranks of banks. Consecutive blocks
+// fall in the same row, and rows are spread over channels, then banks, then
+// ranks, so streams get row hits and neighbouring rows land in different
+// banks. Each bank keeps the row it last opened (unless closed-row) and
+// when it is free for its next command; each channel when its data bus is.
+//
+// Reads go first and are scheduled as they arrive, since whoever sent them
+// waits for their data. A read of a block with a write still queued is
+// served from the queue. Writes are posted into a queue and drained in
+// bursts once it fills, first-ready first-come-first-served: the oldest
+// write to an open row, otherwise the oldest write.
+//
+// Every rank is refreshed every tREFI, closing its rows and holding off its
+// banks for tRFC.
+struct DramModel {
+    DramModel(const DramConfig& config, u64 block_size);
+
+    // A read arriving at arrival, returning when its data is back
+    Time read(u64 addr, Time arrival);
+    // A write arriving at arrival. Nobody waits for it.
+    void write(u64 addr, Time arrival);
+    // Drain every queued write, returning when the last is done
+    Time flush(Time now);
+    // Catch refreshes up to now
+    void settle(Time now);
+    // Energy of every operation so far, in femtojoules
+    Joule energy() const;
+
+    const DramConfig config;
+    u64 row_hits, row_misses, row_conflicts; // Row open, no row open, another row open
+    u64 activations, reads, writes, refreshes;
+    u64 forwarded_reads; // Served from the write queue
+    u64 write_drains;    // Bursts of queued writes
+
+private:
+    struct Bank {
+        u64 open_row;
+        Time ready_time;     // For its next command
+        Time precharge_time; // Earliest it may precharge the open row
+    };
+    struct Rank {
+        Time next_refresh;
+    };
+    struct Location {
+        u64 channel, rank, bank, row;
+    };
+    struct Request {
+        u64 addr;
+        Time arrival;
+    };
+    const u64 block_bits, column_bits, channel_bits, bank_bits, rank_bits;
+    std::vector<Bank> banks;    // By (channel, rank, bank)
+    std::vector<Rank> ranks;    // By (channel, rank)
+    std::vector<Time> bus_free; // By channel
+    std::vector<Request> write_queue; // Oldest first
+
+    Location locate(u64 addr) const;
+    Bank& bank_of(const Location& location);
+    void refresh_until(u64 channel, u64 rank, Time now);
+    // Carry out one access no earlier than start, returning when its data
+    // burst ends
+    Time serve(u64 addr, bool is_write, Time start);
+    void drain_writes(u64 until_len, Time now);
+};
@@ -0,0 +1,162 @@
+#include "interval.hpp"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+// Samples the ring holds, how many the writer waits for before writing, and
+// how long it waits for them
+const size_t INTERVAL_RING_LEN = 1 << 12;
+const u64 INTERVAL_CHUNK_LEN = 256;
+const auto INTERVAL_WRITE_DELAY = std::chrono::milliseconds(10);
+
+bool parse_interval_spec(const char* spec, IntervalSpec& interval) {
+    char* end;
+    interval.period = strtoull(spec, &end, 10);
+    interval.is_time = true;
+    if (strncmp(end, "ps", 2) == 0) {
+        end += 2;
+    } else if (strncmp(end, "ns", 2) == 0) {
+        interval.period = ns(interval.period);
+        end += 2;
+    } else if (strncmp(end, "us", 2) == 0) {
+        interval.period = us(interval.period);
+        end += 2;
+    } else if (strncmp(end, "ms", 2) == 0) {
+        interval.period = us(interval.period * 1000);
+        end += 2;
+    } else {
+        interval.is_time = false;
+    }
+    interval.filename = "intervals.csv";
+    if (*end == ':' && end[1] != '\0') {
+        interval.filename = end + 1;
+    } else if (*end != '\0') {
+        return false;
+    }
+    return end != spec && interval.period > 0;
+}
+
+IntervalLog::IntervalLog(const IntervalSpec& spec, size_t num_configs)
+    : spec(spec)
+    , file(fopen(spec.filename, "wb"))
+    , is_binary(strlen(spec.filename) >= 4 && strcmp(spec.filename + strlen(spec.filename) - 4, ".bin") == 0)
+    , next_time(num_configs, spec.period)
+    , ring(INTERVAL_RING_LEN)
+    , head(0)
+    , tail(0)
+    , closing(false)
+{
+    if (!this->file) {
+        return;
+    }
+    if (this->is_binary) {
+        IntervalFileHeader header;
+        memcpy(header.magic, INTERVAL_MAGIC, sizeof(header.magic));
+        header.num_levels = Hierarchy::NUM_ROWS;
+        header.num_columns = INTERVAL_COLUMNS;
+        fwrite(&header, sizeof(header), 1, this->file);
+    } else {
+        fputs("Config, Records, Time, Cache, RHits, RMiss, WHits, WMiss, Dirty_Evicts, Time_Active, Energy_Used\n",
+            this->file);
+    }
+    this->writer = std::thread([this] { this->write_loop(); });
+}
+
+IntervalLog::~IntervalLog() {
+    if (!this->file) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->closing = true;
+    }
+    this->ready.notify_one();
+    this->writer.join();
+    fclose(this->file);
+}
+
+IntervalSample& IntervalLog::claim() {
+    const u64 head = this->head.load(std::memory_order_relaxed);
+    if (head - this->tail.load(std::memory_order_acquire) == this->ring.size()) {
+        this->ready.notify_one();
+        std::unique_lock<std::mutex> guard(this->lock);
+        this->space.wait(guard, [this, head] {
+            return head - this->tail.load(std::memory_order_acquire) < this->ring.size();
+        });
+    }
+    return this->ring[head % this->ring.size()];
+}
+
+void IntervalLog::publish() {
+    const u64 head = this->head.load(std::memory_order_relaxed) + 1;
+    this->head.store(head, std::memory_order_release);
+    if (head % INTERVAL_CHUNK_LEN == 0) {
+        this->ready.notify_one();
+    }
+}
+
+void IntervalLog::write_loop() {
+    std::unique_lock<std::mutex> guard(this->lock);
+    for (;;) {
+        // The simulation doesn't take the lock to say a chunk is ready, so
+        // the wait also gives up after a while in case it was missed
+        this->ready.wait_for(guard, INTERVAL_WRITE_DELAY, [this] {
+            return this->closing ||
+                this->head.load(std::memory_order_acquire) - this->tail.load(std::memory_order_relaxed) >=
+                    INTERVAL_CHUNK_LEN;
+        });
+        const bool is_last = this->closing;
+        const u64 from = this->tail.load(std::memory_order_relaxed);
+        const u64 to = this->head.load(std::memory_order_acquire);
+        if (to > from) {
+            guard.unlock();
+            this->write_samples(from, to);
+            guard.lock();
+            this->tail.store(to, std::memory_order_release);
+            this->space.notify_one();
+        }
+        if (is_last) {
+            return;
+        }
+    }
+}
+
+void IntervalLog::write_samples(u64 from, u64 to) {
+    if (!this->is_binary) {
+        for (u64 n = from; n < to; n++) {
+            const IntervalSample& sample = this->ring[n % this->ring.size()];
+            for (size_t i = 0; i < Hierarchy::NUM_ROWS; i++) {
+                static const char* const names[Hierarchy::NUM_ROWS] = {"L1d", "L1i", "L2", "DRAM"};
+                const LevelSample& level = sample.levels[i];
+                fprintf(this->file, "%lu,%lu,%lu,%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", sample.config, sample.records,
+                    sample.time, names[i], level.read_hits, level.read_misses, level.write_hits, level.write_misses,
+                    level.dirty_evicts, level.active_time, level.energy);
+            }
+        }
+        return;
+    }
+    const u64 count = to - from;
+    this->columns.resize(count * INTERVAL_COLUMNS);
+    for (u64 n = 0; n < count; n++) {
+        const IntervalSample& sample = this->ring[(from + n) % this->ring.size()];
+        u64* column = &this->columns[n];
+        const auto put = [&column, count](u64 value) {
+            *column = value;
+            column += count;
+        };
+        put(sample.config);
+        put(sample.records);
+        put(sample.time);
+        for (const LevelSample& level : sample.levels) {
+            put(level.read_hits);
+            put(level.read_misses);
+            put(level.write_hits);
+            put(level.write_misses);
+            put(level.dirty_evicts);
+            put(level.active_time);
+            put(level.energy);
+        }
+    }
+    fwrite(&count, sizeof(count), 1, this->file);
+    fwrite(this->columns.data(), sizeof(u64), this->columns.size(), this->file);
+}
@@ -0,0 +1,126 @@
+#pragma once
+#include "simulator.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+// csim -f <trace> --interval <period>[:<file>]
+//
+// A time series of each level's counters over the run, for finding phases
+// in a trace and lining bursts of DRAM traffic up with energy. Every
+// hierarchy is sampled each <period> records, or each <period> of simulated
+// time when it ends in ps, ns, us or ms, and once more at the end of the
+// trace after everything in flight has drained. A trace whose length is a
+// multiple of a record period gets just that last sample at its end, not a
+// second row with the same record count. Counters are cumulative from the
+// start of the trace, so an interval's own counts are the difference
+// between two samples.
+//
+// Record periods cost nothing between samples: simulate() just ends its
+// batches on period boundaries. Time periods are checked after every
+// record, so the sample lands on the first record boundary at or past each
+// multiple of the period, and the batch is stepped a record at a time.
+//
+// Samples go into a preallocated ring that a writer thread drains, so the
+// simulation only stops for the file if the ring fills. The file is csv,
+// one row per level per sample, or columnar binary if its name ends in
+// .bin: an IntervalFileHeader, then chunks of a u64 count followed by each
+// column in turn as count u64s. The columns are config, records and time,
+// then for each level in report order (L1d, L1i, L2, DRAM) read hits, read
+// misses, write hits, write misses, dirty evictions, active time in ps and
+// energy in fJ. config is the configuration's index on the command line.
+struct IntervalSpec {
+    u64 period;
+    bool is_time; // period is in ps rather than records
+    const char* filename;
+};
+
+// Parse "<period>[ps|ns|us|ms][:<file>]"
+bool parse_interval_spec(const char* spec, IntervalSpec& interval);
+
+struct LevelSample {
+    u64 read_hits, read_misses, write_hits, write_misses, dirty_evicts;
+    Time active_time;
+    Joule energy;
+};
+
+struct IntervalSample {
+    u64 config;
+    u64 records;
+    Time time;
+    LevelSample levels[Hierarchy::NUM_ROWS];
+};
+
+const u64 INTERVAL_COLUMNS = 3 + Hierarchy::NUM_ROWS*7;
+
+struct IntervalFileHeader {
+    char magic[8];
+    u64 num_levels;
+    u64 num_columns;
+};
+
+const char INTERVAL_MAGIC[8] = {'C', 'S', 'I', 'M', 'I', 'V', 'L', '1'};
+
+struct IntervalLog {
+    // Open spec.filename and start the writer for num_configs hierarchies
+    IntervalLog(const IntervalSpec& spec, size_t num_configs);
+    // Waits for every sample to be written
+    ~IntervalLog();
+
+    const IntervalSpec spec;
+
+    bool is_open() const {
+        return this->file != nullptr;
+    }
+    // Records to simulate from records before the next sample is due
+    u64 records_until_sample(u64 records) const {
+        return this->spec.is_time ? ~0UL : this->spec.period - records % this->spec.period;
+    }
+    bool is_sample_due(size_t config, u64 records, Time time) const {
+        return this->spec.is_time ? time >= this->next_time[config] : records % this->spec.period == 0;
+    }
+    // Take a sample of hierarchy, which is configuration number config
+    template <typename H>
+    void sample(size_t config, u64 records, H& hierarchy) {
+        IntervalSample& sample = this->claim();
+        sample.config = config;
+        sample.records = records;
+        sample.time = hierarchy.machine.time;
+        size_t i = 0;
+        for (const typename H::Row& row : hierarchy.rows()) {
+            LevelSample& level = sample.levels[i++];
+            level.read_hits = row.cache.read_hits;
+            level.read_misses = row.cache.read_misses;
+            level.write_hits = row.cache.write_hits;
+            level.write_misses = row.cache.write_misses;
+            level.dirty_evicts = row.cache.dirty_evict_count;
+            level.active_time = row.cache.active_time();
+            level.energy = row.cache.calc_energy();
+        }
+        if (this->spec.is_time) {
+            this->next_time[config] = (sample.time / this->spec.period + 1) * this->spec.period;
+        }
+        this->publish();
+    }
+
+private:
+    // The next free slot in the ring, once the writer has made room
+    IntervalSample& claim();
+    void publish();
+    void write_loop();
+    void write_samples(u64 from, u64 to);
+
+    FILE* file;
+    bool is_binary;
+    std::vector<Time> next_time;
+    std::vector<IntervalSample> ring;
+    // Samples taken and written so far; slot n % ring.size() holds sample n
+    std::atomic<u64> head, tail;
+    std::mutex lock;
+    std::condition_variable ready, space;
+    bool closing;
+    std::vector<u64> columns;
+    std::thread writer;
+};
@@ -0,0 +1,207 @@
+#include "missstream.hpp"
+#include "varint.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+// Stands in for the L2 while the L1s are recorded: takes no time, so the
+// machine's time is the L1s' alone, and writes down every request.
+struct RequestRecorder final : public Cache {
+    RequestRecorder(u64 block_size, Machine& machine, std::string& requests)
+        : Cache(block_size, 1, block_size, 0, 0, 0, 0, machine)
+        , num_requests(0)
+        , requests(requests)
+        , last_time(0)
+        , last_block(0)
+        , line()
+    {
+        this->line.set_metadata(0, true, false, false);
+    }
+
+    u64 num_requests;
+
+    void record(address addr, bool is_write) {
+        const u64 block = addr >> this->block_bits;
+        u8 encoded[20];
+        size_t len = put_varint(encoded, this->machine.time - this->last_time);
+        len += put_varint(encoded + len, (zigzag_encode(block - this->last_block) << 1) | is_write);
+        this->requests.append(reinterpret_cast<const char*>(encoded), len);
+        this->num_requests++;
+        this->last_time = this->machine.time;
+        this->last_block = block;
+    }
+
+    Time time_since_last() const {
+        return this->machine.time - this->last_time;
+    }
+
+    const Line& read_at(address addr, u64 set_index, u64 tag) override {
+        this->record(addr, false);
+        return this->line;
+    }
+    const Line& write_at(address addr, value val, u64 set_index, u64 tag) override {
+        this->record(addr, true);
+        return this->line;
+    }
+    void warm(address addr, bool is_write) override {}
+    Line& line_at(u64 line_index) override {
+        return this->line;
+    }
+    Time fill_latency(address addr) override {
+        return 0;
+    }
+    Time access_from(address addr, bool is_write, Time start) override {
+        return start;
+    }
+
+private:
+    std::string& requests;
+    Time last_time;
+    u64 last_block;
+    Line line;
+};
+
+bool can_replay_l1_stream(const SimConfig& config) {
+    return config.l1_prefetcher == NO_PREFETCHER && config.l1_mshrs == 0 && config.write_buffer_depth == 0;
+}
+
+bool load_l1_stream(const char* filename, const char* trace_name, u64 block_size, L1Stream& stream) {
+    u64 trace_size, trace_mtime;
+    FILE* file = fopen(filename, "rb");
+    if (!file || !stat_trace(trace_name, trace_size, trace_mtime)) {
+        if (file) {
+            fclose(file);
+        }
+        return false;
+    }
+    char buf[1 << 16];
+    size_t len;
+    stream.data.clear();
+    while ((len = fread(buf, 1, sizeof(buf), file)) > 0) {
+        stream.data.append(buf, len);
+    }
+    fclose(file);
+
+    L1StreamHeader& header = stream.header;
+    if (stream.data.size() < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, stream.data.data(), sizeof(header));
+    return memcmp(header.magic, L1_STREAM_MAGIC, sizeof(header.magic)) == 0 &&
+        header.size == stream.data.size() &&
+        header.size == sizeof(header) + header.requests_len + 2*header.counters_len &&
+        header.block_size == block_size && header.trace_size == trace_size && header.trace_mtime == trace_mtime;
+}
+
+bool record_l1_stream(char* trace_name, u64 block_size, L1Stream& stream) {
+    L1StreamHeader& header = stream.header;
+    memset(&header, 0, sizeof(header));
+    Trace trace(trace_name);
+    if (trace.trace_fd == -1 || !stat_trace(trace_name, header.trace_size, header.trace_mtime)) {
+        printf("error: invalid filename\n");
+        return false;
+    }
+
+    // The L1s as BasicHierarchy builds them, over the recorder
+    std::string requests;
+    Machine machine;
+    RequestRecorder recorder(block_size, machine, requests);
+    Cache l1d(L1_CAPACITY, L1_ASSOCIATIVITY, block_size, l1_time_penalty, mW(500), W(1), l1_transfer_penalty, L1_FLAGS,
+        machine, &recorder);
+    Cache l1i(L1_CAPACITY, L1_ASSOCIATIVITY, block_size, l1_time_penalty, mW(500), W(1), l1_transfer_penalty, L1_FLAGS,
+        machine, &recorder);
+    machine.add_cache(&recorder);
+    machine.add_cache(&l1d);
+    machine.add_cache(&l1i);
+    // As BasicHierarchy::step does it
+    for (trace.next_instr(); trace.has_next_instr; trace.next_instr()) {
+        const Instruction& ins = trace.instruction;
+        switch (ins.op) {
+            case READ: l1d.read(ins.address); break;
+            case WRITE: l1d.write(ins.address, ins.value); break;
+            case FETCH: l1i.read(ins.address); break;
+            default: break;
+        }
+        machine.advance_time(CYCLE_TIME);
+    }
+    // The trace has said what went wrong. A stream of the part before
+    // would be replayed as if it were the whole trace, so there is none.
+    if (!trace.read_error.empty()) {
+        return false;
+    }
+
+    std::string counters;
+    l1d.save_counters(counters);
+    l1i.save_counters(counters);
+    memcpy(header.magic, L1_STREAM_MAGIC, sizeof(header.magic));
+    header.block_size = block_size;
+    header.records = trace.last_ins;
+    header.num_requests = recorder.num_requests;
+    header.end_delta = recorder.time_since_last();
+    header.requests_len = requests.size();
+    header.counters_len = counters.size() / 2;
+    header.size = sizeof(header) + requests.size() + counters.size();
+    stream.data.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+    stream.data += requests;
+    stream.data += counters;
+    return true;
+}
+
+bool write_l1_stream(const char* filename, const L1Stream& stream) {
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+    const bool ok = fwrite(stream.data.data(), 1, stream.data.size(), file) == stream.data.size();
+    return fclose(file) == 0 && ok;
+}
+
+// Requests decoded at a time and fed to every hierarchy in turn, as
+// simulate() does with records
+const size_t REPLAY_BATCH_LEN = 4096;
+
+struct L1Request {
+    Time delta;
+    u64 addr;
+    bool is_write;
+};
+
+double replay_l1_stream(const L1Stream& stream, const std::vector<Hierarchy*>& hierarchies) {
+    const L1StreamHeader& header = stream.header;
+    const u64 block_bits = __builtin_ctzl(header.block_size);
+    const char* p = stream.data.data() + sizeof(header);
+    const char* const end = p + header.requests_len;
+    std::vector<L1Request> batch(REPLAY_BATCH_LEN);
+    u64 block = 0;
+    u64 decoded = 0;
+    const auto run_start = std::chrono::steady_clock::now();
+    while (decoded < header.num_requests) {
+        size_t batch_len = 0;
+        for (; batch_len < REPLAY_BATCH_LEN && decoded < header.num_requests; batch_len++, decoded++) {
+            u64 delta, key;
+            get_varint(p, end, delta);
+            get_varint(p, end, key);
+            block += zigzag_decode(key >> 1);
+            batch[batch_len] = L1Request{delta, block << block_bits, (key & 1) != 0};
+        }
+        for (Hierarchy* hierarchy : hierarchies) {
+            for (size_t i = 0; i < batch_len; i++) {
+                const L1Request& request = batch[i];
+                hierarchy->machine.advance_time(request.delta);
+                if (request.is_write) {
+                    hierarchy->l2.write(request.addr, 0);
+                } else {
+                    hierarchy->l2.read(request.addr);
+                }
+            }
+        }
+    }
+    const u8* const counters = reinterpret_cast<const u8*>(end);
+    for (Hierarchy* hierarchy : hierarchies) {
+        hierarchy->machine.advance_time(header.end_delta);
+        hierarchy->l1d.restore_counters(counters);
+        hierarchy->l1i.restore_counters(counters + header.counters_len);
+        hierarchy->finish();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include "simulator.hpp"
+#include <string>
+#include <vector>
+
+// csim -f <trace> --l1-stream <file> [...]
+//
+// Sweeps over the L2 and DRAM spend nearly all their time simulating L1
+// hits that never reach them. The L1s are the same in every configuration
+// but for the block size, so the requests they make of the L2 (a read for
+// every miss, a write for every store, as they are write-through) can be
+// recorded once and replayed into any number of L2/DRAM configurations.
+//
+// In the blocking model an L1 and the levels below take turns: each request
+// to the L2 waits for the L2 to finish, and the L1 adds its own time around
+// it, the same whatever the L2 does. So the stream keeps, for each request,
+// the L1 time since the previous one finished, and a replay that advances
+// the machine by that much before each request reaches the L2 at the same
+// times a full simulation would. The L1s' own counters and active time come
+// from the recording, so reports match a full simulation's exactly.
+//
+// The stream is recorded on the first run and kept in the file; later runs
+// of the same trace (same size and modification time) and block size
+// replay it without reading the trace at all. Only configurations without
+// L1 prefetchers, MSHRs or a write buffer can be replayed, since those make
+// the L1s depend on the levels below. L2 prefetchers and the DRAM model
+// are fine.
+//
+// Layout, in host byte order: an L1StreamHeader, the requests, then the
+// L1d's and the L1i's counters as Cache::save_counters writes them. Each
+// request is varint(L1 time since the previous one in ps) followed by
+// varint((zigzag(block - previous block) << 1) | is_write).
+struct L1StreamHeader {
+    char magic[8];
+    u64 block_size;
+    u64 trace_size, trace_mtime; // Of the trace it was recorded from, mtime in ns
+    u64 records;      // In the trace
+    u64 num_requests;
+    Time end_delta;   // L1 time after the last request
+    u64 requests_len; // Bytes
+    u64 counters_len; // Bytes of each L1's counters
+    u64 size;         // Of the whole file
+};
+
+const char L1_STREAM_MAGIC[8] = {'C', 'S', 'I', 'M', 'L', '1', 'S', '2'};
+
+// A recorded stream, read into memory whole
+struct L1Stream {
+    L1StreamHeader header;
+    std::string data; // The whole file
+};
+
+// Whether config's L1s behave the same whatever is below them
+bool can_replay_l1_stream(const SimConfig& config);
+// Read filename if it was recorded from trace_name with this block size.
+// Returns false if it doesn't exist, can't be read or is out of date.
+bool load_l1_stream(const char* filename, const char* trace_name, u64 block_size, L1Stream& stream);
+// Run the L1s alone over trace_name and record their requests. Prints what
+// is wrong and returns false if the trace can't be opened or ends early.
+bool record_l1_stream(char* trace_name, u64 block_size, L1Stream& stream);
+bool write_l1_stream(const char* filename, const L1Stream& stream);
+// Replay stream into every hierarchy, all of which must have its block
+// size, and finish them. Returns the time taken in seconds.
+double replay_l1_stream(const L1Stream& stream, const std::vector<Hierarchy*>& hierarchies);
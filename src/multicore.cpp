@@ -0,0 +1,476 @@
+#include "multicore.hpp"
+#include "profile.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <thread>
+
+// Requests a core can have queued before it waits for the owner
+const size_t REQUEST_QUEUE_LEN = 1 << 14;
+
+Core::Core(const SimConfig& config, Cache& l2, Directory& directory, Machine* machine)
+    : own_machine()
+    , machine(machine ? *machine : own_machine)
+    , requests(machine ? 1 : REQUEST_QUEUE_LEN)
+    , l1d_port(l2, directory, this->machine, machine ? nullptr : &requests, l2_time_penalty)
+    , l1i_port(l2, directory, this->machine, machine ? nullptr : &requests, l2_time_penalty)
+    , l1d(L1_CAPACITY, L1_ASSOCIATIVITY, config.block_size, l1_time_penalty, mW(500), W(1), l1_transfer_penalty, L1_FLAGS, this->machine, &l1d_port, config.policy)
+    , l1i(L1_CAPACITY, L1_ASSOCIATIVITY, config.block_size, l1_time_penalty, mW(500), W(1), l1_transfer_penalty, L1_FLAGS, this->machine, &l1i_port, config.policy)
+    , published_time(0)
+    , stall(0)
+{
+    this->l1d_port.attach(&this->l1d);
+    this->l1i_port.attach(&this->l1i);
+    this->machine.add_cache(&this->l1d);
+    this->machine.add_cache(&this->l1i);
+}
+
+// Times a waiter checks the barrier before blocking on it
+const u64 BARRIER_SPINS = 256;
+
+QuantumBarrier::QuantumBarrier(size_t num_cores)
+    : running(num_cores)
+    , waiting(0)
+    , generation(0)
+    // The owner needs a CPU too
+    , spin_limit(std::thread::hardware_concurrency() > num_cores ? BARRIER_SPINS : 0)
+{}
+
+void QuantumBarrier::arrive_and_wait() {
+    std::unique_lock<std::mutex> guard(this->lock);
+    const u64 arrived_in = this->generation;
+    if (++this->waiting == this->running) {
+        this->arrived.notify_one();
+    }
+    guard.unlock();
+    for (u64 i = 0; i < this->spin_limit; i++) {
+        if (this->generation.load(std::memory_order_acquire) != arrived_in) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+    guard.lock();
+    this->released.wait(guard, [this, arrived_in] { return this->generation != arrived_in; });
+}
+
+void QuantumBarrier::leave() {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (--this->running == this->waiting) {
+        this->arrived.notify_one();
+    }
+}
+
+void QuantumBarrier::wait_for_cores(std::chrono::microseconds timeout) {
+    for (u64 i = 0; i < this->spin_limit; i++) {
+        if (this->waiting.load(std::memory_order_acquire) == this->running.load(std::memory_order_acquire)) {
+            return;
+        }
+        std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> guard(this->lock);
+    this->arrived.wait_for(guard, timeout, [this] { return this->waiting == this->running; });
+}
+
+bool QuantumBarrier::all_waiting(size_t& num_running) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    num_running = this->running;
+    return this->waiting == this->running;
+}
+
+void QuantumBarrier::release() {
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->waiting = 0;
+        this->generation.fetch_add(1, std::memory_order_release);
+    }
+    this->released.notify_all();
+}
+
+MultiCoreHierarchy::MultiCoreHierarchy(const SimConfig& config, size_t num_cores, bool is_parallel)
+    : config(config)
+    , machine()
+    , dram(GiB(8), config.block_size, dram_time_penalty, mW(800), W(4), dram_transfer_penalty, machine)
+    , l2(config.l2_capacity, config.l2_associativity, config.block_size, l2_time_penalty, mW(800), W(2), l2_transfer_penalty, L2_FLAGS, machine, &dram, config.policy)
+    , directory(config.block_size)
+{
+    this->machine.add_cache(&this->dram);
+    this->machine.add_cache(&this->l2);
+    this->directory.defer_invalidations = is_parallel;
+    for (size_t i = 0; i < num_cores; i++) {
+        this->cores.push_back(new Core(config, this->l2, this->directory, is_parallel ? nullptr : &this->machine));
+    }
+}
+
+MultiCoreHierarchy::~MultiCoreHierarchy() {
+    for (Core* core : this->cores) {
+        delete core;
+    }
+}
+
+void MultiCoreHierarchy::step(size_t core, const Instruction& ins) {
+    PROFILE_SCOPE(PHASE_ACCESS);
+    switch (ins.op) {
+        case READ: this->cores[core]->l1d.read(ins.address); break;
+        case WRITE: this->cores[core]->l1d.write(ins.address, ins.value); break;
+        case FETCH: this->cores[core]->l1i.read(ins.address); break;
+        case IGNORE: break;
+        case FLUSH:
+            printf("This is a flush! This case should never be tested!. \
+                something has gone horribly wrong!\n");
+            break;
+    }
+}
+
+double MultiCoreHierarchy::run(const std::vector<Trace*>& traces) {
+    const auto run_start = std::chrono::steady_clock::now();
+    for (bool is_running = true; is_running;) {
+        is_running = false;
+        for (size_t core = 0; core < traces.size(); core++) {
+            if (traces[core]->has_next_instr) {
+                this->step(core, traces[core]->instruction);
+                traces[core]->next_instr();
+                is_running = true;
+            }
+        }
+        if (is_running) {
+            this->machine.advance_time(CYCLE_TIME);
+        }
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+}
+
+const Time END_OF_TIME = ~0UL;
+// Smallest --quantum accepted (see multicore_main)
+const Time MIN_QUANTUM = 10 * CYCLE_TIME;
+// How long the owner of the shared levels sleeps when it has nothing to apply
+const std::chrono::microseconds OWNER_IDLE_WAIT(50);
+
+void MultiCoreHierarchy::run_core(size_t index, Trace& trace, Time quantum, QuantumBarrier& barrier) {
+    Core& core = *this->cores[index];
+    Time quantum_end = quantum;
+    while (trace.has_next_instr) {
+        if (core.machine.time >= quantum_end) {
+            barrier.arrive_and_wait();
+            quantum_end += quantum;
+            continue;
+        }
+        this->step(index, trace.instruction);
+        core.machine.advance_time(CYCLE_TIME);
+        core.published_time.store(core.machine.time, std::memory_order_release);
+        trace.next_instr();
+    }
+    core.published_time.store(END_OF_TIME, std::memory_order_release);
+    barrier.leave();
+}
+
+void MultiCoreHierarchy::apply(const SharedRequest& request) {
+    Core& core = *this->cores[request.agent / 2];
+    // When the core would have made the request, had it been charged the
+    // real latency of its earlier ones
+    const Time time = request.time + core.stall;
+    if (time > this->machine.time) {
+        this->machine.advance_time(time - this->machine.time);
+    }
+    switch (request.kind) {
+        case SHARED_READ:
+            this->directory.read(request.agent, request.addr);
+            this->l2.read(request.addr);
+            core.stall += this->machine.time - time - l2_time_penalty;
+            break;
+        case SHARED_WRITE:
+            this->directory.write(request.agent, request.addr);
+            this->l2.write(request.addr, 0);
+            core.stall += this->machine.time - time;
+            break;
+        case SHARED_EVICT:
+            this->directory.evicted(request.agent, request.addr);
+            break;
+    }
+}
+
+double MultiCoreHierarchy::run_parallel(const std::vector<Trace*>& traces, Time quantum) {
+    const auto run_start = std::chrono::steady_clock::now();
+    QuantumBarrier barrier(traces.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < traces.size(); i++) {
+        threads.emplace_back([this, i, &traces, quantum, &barrier] {
+            this->run_core(i, *traces[i], quantum, barrier);
+        });
+    }
+
+    // Requests taken off the cores' queues but not yet safe to apply
+    std::vector<std::deque<SharedRequest>> staged(traces.size());
+    std::vector<Time> published(this->cores.size());
+    for (;;) {
+        // Checked first, so that everything the cores did before arriving
+        // is seen below
+        size_t num_running;
+        const bool is_quantum_over = barrier.all_waiting(num_running);
+
+        // A request is safe once no core can still push an earlier one. Each
+        // core's requests are in time order and no earlier than its
+        // published time, which is read before its queue for the same reason.
+        for (size_t i = 0; i < this->cores.size(); i++) {
+            published[i] = this->cores[i]->published_time.load(std::memory_order_acquire);
+        }
+        for (size_t i = 0; i < this->cores.size(); i++) {
+            SharedRequest request;
+            while (this->cores[i]->requests.try_pop(request)) {
+                staged[i].push_back(request);
+            }
+        }
+        // Times here all include the stall each core is owed (see apply).
+        // Applying a request adds to its core's stall, which can make more
+        // requests safe, so the horizon is worked out afresh each time. That
+        // way what has been applied by the end of a quantum doesn't depend
+        // on how often the owner happened to look.
+        bool is_idle = true;
+        for (;;) {
+            Time horizon = END_OF_TIME;
+            size_t earliest = staged.size(); // The lowest core first on a tie
+            for (size_t i = 0; i < staged.size(); i++) {
+                const Time stall = this->cores[i]->stall;
+                if (published[i] != END_OF_TIME) {
+                    horizon = std::min(horizon, published[i] + stall);
+                }
+                if (!staged[i].empty() && (earliest == staged.size() ||
+                    staged[i].front().time + stall < staged[earliest].front().time + this->cores[earliest]->stall)) {
+                    earliest = i;
+                }
+            }
+            if (earliest == staged.size() ||
+                staged[earliest].front().time + this->cores[earliest]->stall >= horizon) {
+                break;
+            }
+            this->apply(staged[earliest].front());
+            staged[earliest].pop_front();
+            is_idle = false;
+        }
+
+        if (is_quantum_over) {
+            // Hand the stalls over. Requests still staged were made before
+            // the core's clock moves on, so they move with it.
+            this->directory.deliver_invalidations();
+            for (size_t i = 0; i < this->cores.size(); i++) {
+                Core& core = *this->cores[i];
+                for (SharedRequest& request : staged[i]) {
+                    request.time += core.stall;
+                }
+                core.machine.advance_time(core.stall);
+                core.stall = 0;
+                if (core.published_time.load(std::memory_order_relaxed) != END_OF_TIME) {
+                    core.published_time.store(core.machine.time, std::memory_order_relaxed);
+                }
+            }
+            if (num_running == 0) {
+                break;
+            }
+            barrier.release();
+        } else if (is_idle) {
+            barrier.wait_for_cores(OWNER_IDLE_WAIT);
+        }
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+}
+
+void MultiCoreHierarchy::finish() {
+    // In a parallel run every core has a clock of its own, and the run ends
+    // with the last of them
+    Time end_time = 0;
+    std::vector<Machine*> machines = {&this->machine};
+    for (Core* core : this->cores) {
+        if (&core->machine != &this->machine) {
+            machines.push_back(&core->machine);
+        }
+    }
+    for (Machine* machine : machines) {
+        machine->drain();
+        end_time = std::max(end_time, machine->time);
+    }
+    for (Machine* machine : machines) {
+        machine->advance_time(end_time - machine->time);
+    }
+}
+
+Joule MultiCoreHierarchy::total_energy() {
+    Joule total_energy = 0;
+    for (const Row& row : this->rows()) {
+        total_energy += row.cache.calc_energy();
+    }
+    return total_energy;
+}
+
+std::vector<MultiCoreHierarchy::Row> MultiCoreHierarchy::rows() {
+    std::vector<Row> rows;
+    for (size_t i = 0; i < this->cores.size(); i++) {
+        rows.push_back({"C" + std::to_string(i) + " L1d", this->cores[i]->l1d});
+        rows.push_back({"C" + std::to_string(i) + " L1i", this->cores[i]->l1i});
+    }
+    rows.push_back({"L2", this->l2});
+    rows.push_back({"DRAM", this->dram});
+    return rows;
+}
+
+std::string MultiCoreHierarchy::csv_results(const std::vector<const char*>& trace_names) {
+    std::string csv = "File: ";
+    for (size_t i = 0; i < trace_names.size(); i++) {
+        appendf(csv, "%s%s", i ? "," : "", trace_names[i]);
+    }
+    appendf(csv, " cores: %zu assoc: %lu", this->cores.size(), this->config.l2_associativity);
+    if (this->config.l2_capacity != DEFAULT_CONFIG.l2_capacity || this->config.block_size != DEFAULT_CONFIG.block_size) {
+        appendf(csv, " l2_size: %lu block_size: %lu", this->config.l2_capacity, this->config.block_size);
+    }
+    if (this->config.policy != DEFAULT_CONFIG.policy) {
+        appendf(csv, " policy: %s", replacement_policy_name(this->config.policy));
+    }
+    appendf(csv, "\nTime: %s\nEnergy: %s\n",
+        unit_to_string(this->machine.time, 's', -12).c_str(),
+        unit_to_string(this->total_energy(), 'J', -15).c_str());
+    csv += CSV_HEADER;
+    for (const Row& row : this->rows()) {
+        append_csv_row(csv, row.name.c_str(), row.cache);
+    }
+    appendf(csv, "Coherence_Messages: %lu\n", this->directory.messages);
+    csv += "Cache, Invalidations, Coherence_Misses, Downgrades, Upgrades\n";
+    for (const Core* core : this->cores) {
+        for (const CoherencePort* port : {&core->l1d_port, &core->l1i_port}) {
+            const CoherenceStats& stats = this->directory.stats[port->agent()];
+            appendf(csv, "C%zu %s,%lu,%lu,%lu,%lu\n", port->agent() / 2, port == &core->l1d_port ? "L1d" : "L1i",
+                stats.invalidations, stats.coherence_misses, stats.downgrades, stats.upgrades);
+        }
+    }
+    return csv;
+}
+
+std::string MultiCoreHierarchy::table_results(const std::vector<const char*>& trace_names) {
+    std::string table;
+    appendf(table, "\nRun complete!\nTime: %s\nEnergy: %s\n\n",
+        unit_to_string(this->machine.time, 's', -12).c_str(),
+        unit_to_string(this->total_energy(), 'J', -15).c_str());
+    for (size_t i = 0; i < trace_names.size(); i++) {
+        appendf(table, "Core %zu: %s\n", i, trace_names[i]);
+    }
+    appendf(table, "L2 associativity: %lu\n", this->config.l2_associativity);
+    if (this->config.l2_capacity != DEFAULT_CONFIG.l2_capacity || this->config.block_size != DEFAULT_CONFIG.block_size) {
+        appendf(table, "L2 size: %lu\nBlock size: %lu\n", this->config.l2_capacity, this->config.block_size);
+    }
+    if (this->config.policy != DEFAULT_CONFIG.policy) {
+        appendf(table, "Replacement: %s\n", replacement_policy_name(this->config.policy));
+    }
+    table += TABLE_HEADER;
+    for (const Row& row : this->rows()) {
+        append_table_row(table, row.name.c_str(), row.cache);
+    }
+    appendf(table, "\nCoherence messages: %lu\n", this->directory.messages);
+    table += "Cache  Invalidations Coherence_Misses Downgrades Upgrades\n";
+    for (const Core* core : this->cores) {
+        for (const CoherencePort* port : {&core->l1d_port, &core->l1i_port}) {
+            const CoherenceStats& stats = this->directory.stats[port->agent()];
+            appendf(table, "C%-2zu%s %13lu %16lu %10lu %8lu\n", port->agent() / 2, port == &core->l1d_port ? "L1d" : "L1i",
+                stats.invalidations, stats.coherence_misses, stats.downgrades, stats.upgrades);
+        }
+    }
+    return table;
+}
+
+void MultiCoreHierarchy::report(const std::vector<const char*>& trace_names) {
+    std::ofstream result_csv("results.csv", std::ios::app);
+    result_csv << this->csv_results(trace_names);
+    fputs(this->table_results(trace_names).c_str(), stdout);
+}
+
+int multicore_main(int argc, char* argv[]) {
+    const char* usage = "Usage: csim --multicore -f <trace> -f <trace> [...] [-r <policy>] [--config <L2 size>:<L2 associativity>[:<block size>][:<policy>]] [--quantum <cycles>]\n";
+    std::vector<const char*> trace_names;
+    ReplacementPolicy policy = DEFAULT_CONFIG.policy;
+    const char* config_spec = nullptr;
+    Time quantum = 0;
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 == argc) {
+            printf("%s", usage);
+            return -1;
+        }
+        if (strcmp(argv[i], "-f") == 0) {
+            trace_names.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            if (!parse_replacement_policy(argv[++i], policy)) {
+                printf("error: unknown replacement policy '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--config") == 0) {
+            config_spec = argv[++i];
+        } else if (strcmp(argv[i], "--quantum") == 0) {
+            quantum = strtoull(argv[++i], nullptr, 10) * CYCLE_TIME;
+            if (quantum < MIN_QUANTUM) {
+                printf("error: --quantum must be at least %lu cycles. Every quantum ends in a barrier, which costs "
+                    "far more than a few cycles of simulation; leave --quantum out for exact one-clock runs.\n",
+                    MIN_QUANTUM / CYCLE_TIME);
+                return -1;
+            }
+        } else {
+            printf("%s", usage);
+            return -1;
+        }
+    }
+    if (trace_names.empty()) {
+        printf("%s", usage);
+        return -1;
+    }
+    if (trace_names.size() > MultiCoreHierarchy::MAX_CORES) {
+        printf("error: at most %zu cores are supported\n", MultiCoreHierarchy::MAX_CORES);
+        return -1;
+    }
+    SimConfig config = DEFAULT_CONFIG;
+    config.policy = policy;
+    if (config_spec && !parse_config_spec(config_spec, config, policy)) {
+        printf("error: bad configuration '%s'\n", config_spec);
+        return -1;
+    }
+    if (!is_replacement_policy_supported(config.policy, config.l2_associativity)) {
+        printf("error: the %s policy needs a power of two associativity\n", replacement_policy_name(config.policy));
+        return -1;
+    }
+
+    profile_start();
+    std::vector<Trace*> traces;
+    for (const char* trace_name : trace_names) {
+        traces.push_back(new Trace(const_cast<char*>(trace_name)));
+        if (traces.back()->trace_fd == -1) {
+            printf("error: invalid filename %s\n", trace_name);
+            return -1;
+        }
+        traces.back()->next_instr();
+    }
+
+    MultiCoreHierarchy* hierarchy = new MultiCoreHierarchy(config, traces.size(), quantum > 0);
+    const double run_seconds = quantum > 0 ? hierarchy->run_parallel(traces, quantum) : hierarchy->run(traces);
+    hierarchy->finish();
+    // Each trace that ended early has said so; the results would pass for
+    // the whole traces'
+    for (Trace* trace : traces) {
+        if (!trace->read_error.empty()) {
+            return -1;
+        }
+    }
+
+    {
+        PROFILE_SCOPE(PHASE_REPORT);
+        hierarchy->report(trace_names);
+    }
+    delete hierarchy;
+    u64 total_records = 0;
+    for (Trace* trace : traces) {
+        total_records += trace->last_ins;
+        delete trace;
+    }
+    profile_report("multicore", total_records, total_records);
+    printf("Records: %lu on %zu cores in %.3f s (%.0f records/s)\n", total_records, trace_names.size(),
+        run_seconds, run_seconds > 0 ? total_records / run_seconds : 0.0);
+    return 0;
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include "coherence.hpp"
+#include "simulator.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// csim --multicore -f <trace> -f <trace> [...] [-r <policy>] [--config <spec>]
+//      [--quantum <cycles>]
+//
+// Runs one trace per core. Every core has its own L1d and L1i; the L2 and DRAM
+// are shared, and a MESI directory keeps the L1s coherent.
+//
+// By default the cores take turns one record at a time on a single clock, a
+// cycle per round, so their accesses to the shared levels are serialised as
+// if over one bus. With --quantum every core runs on its own host thread with
+// its own clock instead (see MultiCoreHierarchy::run_parallel).
+int multicore_main(int argc, char* argv[]);
+
+// A core's private caches, each with its own port onto the shared L2. The
+// L1d is agent 2i of the directory and the L1i agent 2i + 1 for core i.
+struct Core {
+    // With machine null the core keeps its own clock, and its ports queue
+    // their accesses for the owner of the shared levels
+    Core(const SimConfig& config, Cache& l2, Directory& directory, Machine* machine);
+
+    Machine own_machine;
+    Machine& machine;
+    SharedRequestQueue requests;
+    CoherencePort l1d_port;
+    CoherencePort l1i_port;
+    Cache l1d;
+    Cache l1i;
+
+    // Parallel runs only. Requests the core pushes from now on are no
+    // earlier than published_time; stall is shared level latency beyond the
+    // estimate the core was charged, not yet added to its clock.
+    std::atomic<Time> published_time;
+    Time stall;
+};
+
+// The cores of a parallel run wait here at the end of every quantum until
+// the owner of the shared levels has caught up with them and lets them go.
+// With small quanta a round trip through the condition variables costs more
+// than the quantum itself, so when the host has a CPU to spare for every
+// thread, waiters spin for a while before they block.
+struct QuantumBarrier {
+    QuantumBarrier(size_t num_cores);
+
+    // Core: wait for the owner to release this quantum
+    void arrive_and_wait();
+    // Core: stop taking part, as the core's trace is done
+    void leave();
+    // Owner: whether every core still running is waiting, and how many are
+    bool all_waiting(size_t& num_running);
+    // Owner: sleep until every core still running is waiting, or for at most
+    // timeout, rather than spin while it has nothing to apply
+    void wait_for_cores(std::chrono::microseconds timeout);
+    // Owner: let the waiting cores go
+    void release();
+
+private:
+    std::mutex lock;
+    std::condition_variable released;
+    std::condition_variable arrived;
+    // Written under lock, read without it while spinning
+    std::atomic<size_t> running, waiting;
+    std::atomic<u64> generation;
+    u64 spin_limit; // 0 when spinning would only take CPU from the others
+};
+
+// Like Hierarchy, but with num_cores pairs of L1s over the L2
+struct MultiCoreHierarchy {
+    static const size_t MAX_CORES = Directory::MAX_AGENTS / 2;
+
+    MultiCoreHierarchy(const SimConfig& config, size_t num_cores, bool is_parallel);
+    ~MultiCoreHierarchy();
+
+    const SimConfig config;
+    Machine machine;
+    MainMemory dram;
+    Cache l2;
+    Directory directory;
+    std::vector<Core*> cores;
+
+    // Simulate one record of a core's trace. Unlike Hierarchy::step the
+    // cycle isn't included, since every core issues in the same cycle.
+    void step(size_t core, const Instruction& ins);
+    // Run every core over its trace, one record each per cycle. Returns the
+    // time taken in seconds.
+    double run(const std::vector<Trace*>& traces);
+    // Run every core over its trace on a thread of its own, with the shared
+    // levels owned by the calling thread. Returns the time taken in seconds.
+    //
+    // A core charges its L2 reads the L2 hit latency and carries on, pushing
+    // the access onto its request queue. The owner applies the queued
+    // accesses of all cores in timestamp order, as far as the slowest core
+    // has got, so the L2 and DRAM see them in the same order they would with
+    // one clock, queueing included. What the owner learns is handed back at
+    // the end of each quantum, when every core has reached the same time and
+    // waits: invalidations are applied to the L1s, and each core's clock is
+    // moved on by the L2 and DRAM latency it wasn't charged.
+    //
+    // So the quantum bounds the error: a core may hit on a block another core
+    // invalidated up to a quantum earlier, and sees misses' full latency up to
+    // a quantum late. Shorter quanta are more accurate and longer ones run
+    // faster. Results don't depend on how the threads are scheduled.
+    double run_parallel(const std::vector<Trace*>& traces, Time quantum);
+    // Drain anything in flight and bring every clock to the end of the run
+    void finish();
+    void report(const std::vector<const char*>& trace_names);
+    std::string csv_results(const std::vector<const char*>& trace_names);
+    std::string table_results(const std::vector<const char*>& trace_names);
+    Joule total_energy();
+
+    struct Row {
+        std::string name;
+        Cache& cache;
+    };
+    std::vector<Row> rows();
+
+private:
+    void run_core(size_t index, Trace& trace, Time quantum, QuantumBarrier& barrier);
+    // Apply a queued access to the directory and shared levels
+    void apply(const SharedRequest& request);
+};
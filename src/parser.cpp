@@ -1,56 +1,728 @@
 #include "parser.hpp"
+#include "profile.hpp"
+#include "varint.hpp"
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <cstdio>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <zlib.h>
 
 
+// Returns the value of a hex digit, or -1 if c is not one.
+static inline int hex_digit(unsigned char c) {
+    if (static_cast<unsigned>(c - '0') < 10u) {
+        return c - '0';
+    }
+    c |= 0x20; // fold to lowercase
+    if (static_cast<unsigned>(c - 'a') < 6u) {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+static inline bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+struct ByteSource {
+    virtual ~ByteSource() {}
+    // Read up to len bytes into dst. Returns the number of bytes read, 0 at
+    // the end of the stream.
+    virtual size_t read(char* dst, size_t len) = 0;
+    // Once read() has returned 0: why the stream broke off, or empty if it
+    // just ended
+    virtual std::string error() {
+        return std::string();
+    }
+};
+
+// Bytes straight from the trace file
+struct FdSource : public ByteSource {
+    int fd;
+    FdSource(int fd) : fd(fd) {}
+    size_t read(char* dst, size_t len) {
+        ssize_t bytes_read = ::read(this->fd, dst, len);
+        return bytes_read > 0 ? bytes_read : 0;
+    }
+};
+
+// gzip via zlib
+struct GzipSource : public ByteSource {
+    gzFile file;
+    GzipSource(int fd) : file(gzdopen(dup(fd), "rb")) {
+        if (this->file) {
+            gzbuffer(this->file, 1 << 17);
+        }
+    }
+    ~GzipSource() {
+        if (this->file) {
+            gzclose(this->file);
+        }
+    }
+    size_t read(char* dst, size_t len) {
+        int bytes_read = this->file ? gzread(this->file, dst, len) : 0;
+        return bytes_read > 0 ? bytes_read : 0;
+    }
+    std::string error() override {
+        if (!this->file) {
+            return "can't open the gzip stream";
+        }
+        int errnum;
+        const char* message = gzerror(this->file, &errnum);
+        return errnum == Z_OK ? std::string() : std::string("gzip: ") + message;
+    }
+};
+
+// zstd. libzstd is not something we can count on being installed, so the
+// zstd binary does the decoding and we read its output from a pipe.
+struct ZstdSource : public ByteSource {
+    pid_t child;
+    int pipe_fd;
+    ZstdSource(int fd) : child(-1), pipe_fd(-1) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            return;
+        }
+        this->child = fork();
+        if (this->child == 0) {
+            dup2(fd, STDIN_FILENO);
+            dup2(fds[1], STDOUT_FILENO);
+            close(fds[0]);
+            close(fds[1]);
+            execlp("zstd", "zstd", "-dcq", (char*)nullptr);
+            _exit(127);
+        }
+        close(fds[1]);
+        this->pipe_fd = this->child > 0 ? fds[0] : -1;
+        if (this->child < 0) {
+            close(fds[0]);
+        }
+    }
+    ~ZstdSource() {
+        if (this->pipe_fd != -1) {
+            close(this->pipe_fd);
+        }
+        if (this->child > 0) {
+            waitpid(this->child, nullptr, 0);
+        }
+    }
+    // The pipe only closes once zstd is done, so this reaps it and turns a
+    // missing binary or a corrupt trace into an error rather than a short
+    // trace
+    std::string error() override {
+        if (this->child <= 0) {
+            return this->child == 0 ? std::string() : "can't start zstd";
+        }
+        int status;
+        const pid_t reaped = waitpid(this->child, &status, 0);
+        this->child = 0;
+        char message[64];
+        if (reaped == -1) {
+            snprintf(message, sizeof(message), "can't wait for zstd: %s", strerror(errno));
+        } else if (WIFSIGNALED(status)) {
+            snprintf(message, sizeof(message), "zstd was killed by signal %d", WTERMSIG(status));
+        } else if (WEXITSTATUS(status) == 127) {
+            snprintf(message, sizeof(message), "can't run zstd, is it on the PATH?");
+        } else if (WEXITSTATUS(status) != 0) {
+            snprintf(message, sizeof(message), "zstd exited with status %d", WEXITSTATUS(status));
+        } else {
+            return std::string();
+        }
+        return message;
+    }
+    size_t read(char* dst, size_t len) {
+        if (this->pipe_fd == -1) {
+            return 0;
+        }
+        ssize_t bytes_read = ::read(this->pipe_fd, dst, len);
+        return bytes_read > 0 ? bytes_read : 0;
+    }
+};
+
+// compress(1) LZW, as the bundled traces ship. Codes start at 9 bits and grow
+// to at most 16; in block mode code 256 resets the dictionary. Whenever the
+// code width changes, compress pads the input out to a whole group of eight
+// codes, which is why the bit position gets rounded up below.
+struct LzwSource : public ByteSource {
+    static const u32 INIT_BITS = 9;
+    static const u32 CLEAR = 256;
+    static const u32 FIRST = 257;
+    static const size_t IN_BUF_SIZE = 1 << 16;
+
+    int fd;
+    bool input_eof;
+    bool finished;
+    u8 in_buf[IN_BUF_SIZE + 8];
+    size_t in_len;
+    u64 in_base_bit; // Bit offset of in_buf[0] in the code stream
+    u64 pos_bit;     // Bit offset of the next code in the code stream
+    u64 group_base;  // Bit offset where the current code width started
+
+    u32 max_bits, n_bits, max_code, max_max_code;
+    bool block_mode;
+    u32 free_ent;
+    s32 old_code;
+    u8 fin_char;
+
+    std::vector<u16> prefix;
+    std::vector<u8> suffix;
+    std::vector<u8> stack;
+    size_t stack_pos; // Pending output is stack[stack_pos, stack.size())
+
+    LzwSource(int fd)
+        : fd(fd), input_eof(false), finished(false), in_len(0), in_base_bit(0)
+        , pos_bit(0), group_base(0), max_bits(16), n_bits(INIT_BITS), max_code((1 << INIT_BITS) - 1)
+        , max_max_code(1 << 16), block_mode(true), free_ent(FIRST), old_code(-1)
+        , fin_char(0), prefix(1 << 16), suffix(1 << 16), stack(1 << 16)
+        , stack_pos(1 << 16)
+    {
+        u8 header[3];
+        if (this->fill(header, sizeof(header)) != sizeof(header) ||
+            header[0] != 0x1f || header[1] != 0x9d) {
+            this->finished = true;
+            return;
+        }
+        this->max_bits = header[2] & 0x1f;
+        this->block_mode = header[2] & 0x80;
+        if (this->max_bits < INIT_BITS || this->max_bits > 16) {
+            this->finished = true;
+            return;
+        }
+        this->max_max_code = 1 << this->max_bits;
+        this->free_ent = this->block_mode ? FIRST : 256;
+        for (u32 i = 0; i < 256; i++) {
+            this->suffix[i] = static_cast<u8>(i);
+        }
+    }
+
+    size_t fill(u8* dst, size_t len) {
+        size_t filled = 0;
+        while (filled < len) {
+            ssize_t bytes_read = ::read(this->fd, dst + filled, len - filled);
+            if (bytes_read <= 0) {
+                this->input_eof = true;
+                break;
+            }
+            filled += bytes_read;
+        }
+        return filled;
+    }
+
+    // Round the bit position up to the next group of eight n_bits codes,
+    // counted from where the current code width started.
+    void align_to_group() {
+        const u64 group = this->n_bits << 3;
+        const u64 offset = (this->pos_bit - this->group_base) % group;
+        if (offset) {
+            this->pos_bit += group - offset;
+        }
+        this->group_base = this->pos_bit;
+    }
+
+    // Read the next n_bits code, or return false at the end of the input.
+    bool next_code(u32& code) {
+        const u64 need_bits = this->pos_bit + this->n_bits - this->in_base_bit;
+        if (need_bits > this->in_len * 8) {
+            // Slide the unread bytes to the front and top up the buffer
+            const size_t drop = (this->pos_bit - this->in_base_bit) / 8;
+            const size_t keep = drop < this->in_len ? this->in_len - drop : 0;
+            memmove(this->in_buf, this->in_buf + (this->in_len - keep), keep);
+            this->in_base_bit += (this->in_len - keep) * 8;
+            this->in_len = keep;
+            if (!this->input_eof) {
+                this->in_len += this->fill(this->in_buf + keep, IN_BUF_SIZE - keep);
+            }
+            if (this->pos_bit + this->n_bits - this->in_base_bit > this->in_len * 8) {
+                return false;
+            }
+        }
+        const u64 bit = this->pos_bit - this->in_base_bit;
+        const u8* p = this->in_buf + bit / 8;
+        u32 window = p[0] | (p[1] << 8) | (p[2] << 16);
+        code = (window >> (bit % 8)) & ((1u << this->n_bits) - 1);
+        this->pos_bit += this->n_bits;
+        return true;
+    }
+
+    // Decode the next code onto the stack. Returns false at the end of input.
+    bool decode() {
+        for (;;) {
+            if (this->free_ent > this->max_code && this->n_bits < this->max_bits) {
+                this->align_to_group();
+                this->n_bits++;
+                this->max_code = this->n_bits == this->max_bits
+                    ? this->max_max_code : (1u << this->n_bits) - 1;
+            }
+            u32 code;
+            if (!this->next_code(code)) {
+                return false;
+            }
+            if (this->old_code == -1) {
+                if (code >= 256) {
+                    return false;
+                }
+                this->old_code = code;
+                this->fin_char = static_cast<u8>(code);
+                this->stack[--this->stack_pos] = this->fin_char;
+                return true;
+            }
+            if (code == CLEAR && this->block_mode) {
+                this->free_ent = FIRST - 1;
+                this->align_to_group();
+                this->n_bits = INIT_BITS;
+                this->max_code = (1u << INIT_BITS) - 1;
+                continue;
+            }
+
+            const u32 in_code = code;
+            if (code >= this->free_ent) {
+                // KwKwK: the code being defined is the one being used
+                if (code > this->free_ent) {
+                    return false;
+                }
+                this->stack[--this->stack_pos] = this->fin_char;
+                code = this->old_code;
+            }
+            while (code >= 256) {
+                this->stack[--this->stack_pos] = this->suffix[code];
+                code = this->prefix[code];
+            }
+            this->fin_char = static_cast<u8>(code);
+            this->stack[--this->stack_pos] = this->fin_char;
+
+            if (this->free_ent < this->max_max_code) {
+                this->prefix[this->free_ent] = static_cast<u16>(this->old_code);
+                this->suffix[this->free_ent] = this->fin_char;
+                this->free_ent++;
+            }
+            this->old_code = in_code;
+            return true;
+        }
+    }
 
+    size_t read(char* dst, size_t len) {
+        size_t produced = 0;
+        while (produced < len) {
+            if (this->stack_pos == this->stack.size()) {
+                if (this->finished || !this->decode()) {
+                    this->finished = true;
+                    break;
+                }
+            }
+            size_t n = this->stack.size() - this->stack_pos;
+            if (n > len - produced) {
+                n = len - produced;
+            }
+            memcpy(dst + produced, &this->stack[this->stack_pos], n);
+            this->stack_pos += n;
+            produced += n;
+        }
+        return produced;
+    }
+};
+
+InstructionRing::InstructionRing()
+    : head(0), tail(0), done(false), stopping(false) {}
 
 // Trace constructor
-Trace::Trace(char* filename) {
-    this->has_next_instr = true; 
+Trace::Trace(char* filename)
+    : trace_fd(-1)
+    , last_ins(0)
+    , instruction()
+    , has_next_instr(true)
+    , format(DINERO_TEXT)
+    , compression(UNCOMPRESSED)
+    , has_values(true)
+    , cursor(nullptr)
+    , end(nullptr)
+    , map_base(nullptr)
+    , map_len(0)
+    , stream_buf(nullptr)
+    , stream_eof(false)
+    , source(nullptr)
+    , last_address()
+    , ring(nullptr)
+    , producer()
+    , ring_cursor(nullptr)
+    , ring_end(nullptr)
+{
     // Open a file descriptor for the provided file
-    
-    this->trace_fd = open(filename, O_RDWR);   
-    this->last_ins = 0;
+    this->trace_fd = open(filename, O_RDONLY);
+    if (this->trace_fd == -1) {
+        this->has_next_instr = false;
+        return;
+    }
+
+    // Sniff the magic bytes of regular files for a compression format
+    struct stat st;
+    const bool is_regular = fstat(this->trace_fd, &st) == 0 && S_ISREG(st.st_mode);
+    u8 magic[4] = {0};
+    if (is_regular && pread(this->trace_fd, magic, sizeof(magic), 0) == sizeof(magic)) {
+        if (magic[0] == 0x1f && magic[1] == 0x9d) {
+            this->compression = LZW_COMPRESS;
+        } else if (magic[0] == 0x1f && magic[1] == 0x8b) {
+            this->compression = GZIP;
+        } else if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) {
+            this->compression = ZSTD;
+        }
+    }
+
+    // Uncompressed regular files are mapped in their entirety and parsed in
+    // place. Anything else (pipes, character devices, compressed traces) or a
+    // failed mapping falls back to streaming through a large block buffer.
+    if (is_regular && this->compression == UNCOMPRESSED) {
+        if (st.st_size == 0) {
+            this->has_next_instr = false;
+            return;
+        }
+        void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, this->trace_fd, 0);
+        if (base != MAP_FAILED) {
+            madvise(base, st.st_size, MADV_SEQUENTIAL);
+            this->map_base = static_cast<char*>(base);
+            this->map_len = st.st_size;
+            this->cursor = this->map_base;
+            this->end = this->map_base + this->map_len;
+            this->stream_eof = true;
+            this->detect_format();
+            return;
+        }
+    }
+
+    switch (this->compression) {
+        case LZW_COMPRESS: this->source = new LzwSource(this->trace_fd); break;
+        case GZIP: this->source = new GzipSource(this->trace_fd); break;
+        case ZSTD: this->source = new ZstdSource(this->trace_fd); break;
+        case UNCOMPRESSED: this->source = new FdSource(this->trace_fd); break;
+    }
+    this->stream_buf = static_cast<char*>(malloc(STREAM_BLOCK_SIZE));
+    this->cursor = this->stream_buf;
+    this->end = this->stream_buf;
+    this->refill();
+    this->detect_format();
+
+    // Decompression is the expensive part of reading a compressed trace, so
+    // hand it to a producer thread and let the simulation consume blocks of
+    // decoded instructions as they become ready.
+    if (this->compression != UNCOMPRESSED) {
+        this->ring = new InstructionRing();
+        this->producer = std::thread(&Trace::produce, this);
+    }
+}
+
+Trace::~Trace() {
+    if (this->ring) {
+        {
+            std::lock_guard<std::mutex> guard(this->ring->lock);
+            this->ring->stopping = true;
+        }
+        this->ring->not_full.notify_all();
+        this->producer.join();
+        delete this->ring;
+    }
+    delete this->source;
+    if (this->map_base) {
+        munmap(this->map_base, this->map_len);
+    }
+    free(this->stream_buf);
+    if (this->trace_fd != -1) {
+        close(this->trace_fd);
+    }
 }
 
+// Move the unparsed tail of the stream buffer to the front and fill the rest
+// of the buffer from the file.
+void Trace::refill() {
+    const size_t remaining = this->end - this->cursor;
+    memmove(this->stream_buf, this->cursor, remaining);
+    size_t filled = remaining;
+    while (filled < STREAM_BLOCK_SIZE) {
+        size_t bytes_read = this->source->read(this->stream_buf + filled, STREAM_BLOCK_SIZE - filled);
+        if (bytes_read == 0) {
+            this->stream_eof = true;
+            this->read_error = this->source->error();
+            break;
+        }
+        filled += bytes_read;
+    }
+    this->cursor = this->stream_buf;
+    this->end = this->stream_buf + filled;
+}
 
+// Check for a PACKED_BINARY header at the start of the trace, and skip past
+// it if there is one. Anything else is treated as Dinero text.
+void Trace::detect_format() {
+    if (static_cast<size_t>(this->end - this->cursor) < BINARY_TRACE_HEADER_LEN ||
+        memcmp(this->cursor, BINARY_TRACE_MAGIC, sizeof(BINARY_TRACE_MAGIC)) != 0) {
+        return;
+    }
+    u32 flags;
+    memcpy(&flags, this->cursor + sizeof(BINARY_TRACE_MAGIC), sizeof(flags));
+    this->format = PACKED_BINARY;
+    this->has_values = flags & TRACE_HAS_VALUES;
+    this->cursor += BINARY_TRACE_HEADER_LEN;
+}
 
-void Trace::next_instr() {
-    this->last_ins++;
-    if (this->trace_fd != 0) {
-        // todo: memory management
-        char *read_buf = (char*)malloc(18);
-        char *read_char = (char*)calloc(1, 1);
-        char* end;
-        int pos = 0;
-        // Walk each line of input until it ends.
-        while(read_char[0] != '\n') {
-            size_t bytes_read = read(this->trace_fd, read_char, 1);
-            // We have reached EOF
-            if (read_char[0] == '\0' || bytes_read != 1) {
-                this->has_next_instr = false;
+// Parse one "<op> <address> <value>" record starting at the cursor. Blank
+// lines are skipped. Returns false once the trace is exhausted.
+bool Trace::parse_record(Instruction& ins) {
+    const char* p = this->cursor;
+    const char* const end = this->end;
+
+    // Skip blank lines and leading whitespace
+    while (p < end && (is_blank(*p) || *p == '\n')) {
+        p++;
+    }
+    if (p == end || *p == '\0') {
+        this->cursor = p;
+        return false;
+    }
+
+    u64 op = 0;
+    while (p < end && static_cast<unsigned>(*p - '0') < 10u) {
+        op = op * 10 + (*p++ - '0');
+    }
+
+    u64 fields[2] = {0, 0};
+    for (int f = 0; f < 2; f++) {
+        while (p < end && is_blank(*p)) {
+            p++;
+        }
+        if (p + 1 < end && p[0] == '0' && (p[1] | 0x20) == 'x') {
+            p += 2;
+        }
+        int digit;
+        while (p < end && (digit = hex_digit(*p)) >= 0) {
+            fields[f] = (fields[f] << 4) | digit;
+            p++;
+        }
+    }
+
+    // Drop anything else up to and including the end of the line
+    while (p < end && *p != '\n') {
+        p++;
+    }
+    if (p < end) {
+        p++;
+    }
+
+    ins.op = static_cast<Op>(op);
+    ins.address = fields[0];
+    ins.value = fields[1];
+    this->cursor = p;
+    return true;
+}
+
+// Decode one PACKED_BINARY record starting at the cursor. Returns false once
+// the trace is exhausted (or ends in a truncated record).
+bool Trace::decode_record(Instruction& ins) {
+    const char* p = this->cursor;
+    u64 key;
+    if (!get_varint(p, this->end, key)) {
+        this->cursor = this->end;
+        return false;
+    }
+    const u8 op = key & 0x7;
+    u64 value = 0;
+    if (this->has_values && !get_varint(p, this->end, value)) {
+        this->cursor = this->end;
+        return false;
+    }
+    const u64 address = this->last_address[op] + zigzag_decode(key >> 3);
+    this->last_address[op] = address;
+
+    ins.op = static_cast<Op>(op);
+    ins.address = address;
+    ins.value = value;
+    this->cursor = p;
+    return true;
+}
+
+// Read the next record out of the mapped or streamed buffer, topping the
+// buffer up first if a record might straddle its end.
+bool Trace::read_record(Instruction& ins) {
+    if (!this->stream_eof && static_cast<size_t>(this->end - this->cursor) < MAX_RECORD_LEN) {
+        this->refill();
+    }
+    return this->format == PACKED_BINARY
+        ? this->decode_record(ins)
+        : this->parse_record(ins);
+}
+
+// Producer thread body: decode blocks of instructions into the ring until the
+// trace runs out or the consumer goes away.
+void Trace::produce() {
+    InstructionRing& ring = *this->ring;
+    bool has_record = true;
+    while (has_record) {
+        u64 block;
+        {
+            std::unique_lock<std::mutex> guard(ring.lock);
+            ring.not_full.wait(guard, [&ring] {
+                return ring.stopping || ring.tail - ring.head < InstructionRing::NUM_BLOCKS;
+            });
+            if (ring.stopping) {
                 return;
             }
-            read_buf[pos++] = read_char[0];
+            block = ring.tail % InstructionRing::NUM_BLOCKS;
         }
-        read_buf[pos] = '\0';
-        // Now that we've read a line from the file, create the Instruction
-        
-        // this->instructions[this->last_ins].op = (Op) atoi(strtok(read_buf, " "));
-        // this->instructions[this->last_ins].address = (u64) strtoull(strtok(NULL, " "), &end, 16); 
-        // this->instructions[this->last_ins].value = (u64) strtoull(strtok(NULL, " "), &end, 16);
 
-        this->instruction.op = (Op) atoi(strtok(read_buf, " "));
-        this->instruction.address = (u64) strtoull(strtok(NULL, " "), &end, 16); 
-        this->instruction.value = (u64) strtoull(strtok(NULL, " "), &end, 16);
-        return;
-    } else {
+        Instruction* dst = ring.blocks[block];
+        size_t len = 0;
+        {
+            PROFILE_SCOPE(PHASE_TRACE_DECODE);
+            while (len < InstructionRing::BLOCK_LEN && (has_record = this->read_record(dst[len]))) {
+                len++;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(ring.lock);
+            ring.block_len[block] = len;
+            ring.tail++;
+            ring.done = !has_record;
+        }
+        ring.not_empty.notify_one();
+    }
+}
+
+// Release the block we were reading and wait for the next one. Returns false
+// once the producer has finished and every block has been consumed.
+bool Trace::next_block() {
+    PROFILE_SCOPE(PHASE_TRACE_WAIT);
+    InstructionRing& ring = *this->ring;
+    std::unique_lock<std::mutex> guard(ring.lock);
+    if (this->ring_cursor) {
+        ring.head++;
+        ring.not_full.notify_one();
+    }
+    ring.not_empty.wait(guard, [&ring] { return ring.done || ring.tail > ring.head; });
+    if (ring.tail == ring.head) {
+        return false;
+    }
+    const u64 block = ring.head % InstructionRing::NUM_BLOCKS;
+    this->ring_cursor = ring.blocks[block];
+    this->ring_end = this->ring_cursor + ring.block_len[block];
+    return true;
+}
+
+void Trace::next_instr() {
+    if (this->trace_fd == -1) {
         printf("error: invalid filename");
         this->has_next_instr = false;
+        return;
+    }
+    if (this->ring) {
+        while (this->ring_cursor == this->ring_end) {
+            if (!this->next_block()) {
+                this->end_of_trace();
+                return;
+            }
+        }
+        this->instruction = *this->ring_cursor++;
+        this->last_ins++;
+        return;
+    }
+    PROFILE_SCOPE(PHASE_TRACE_DECODE);
+    if (!this->read_record(this->instruction)) {
+        this->end_of_trace();
+        return;
+    }
+    this->last_ins++;
+}
+
+void Trace::end_of_trace() {
+    if (this->has_next_instr && !this->read_error.empty()) {
+        printf("error: the trace ends early after %lu records: %s\n", this->last_ins, this->read_error.c_str());
+    }
+    this->has_next_instr = false;
+}
+
+void Trace::tell(TracePosition& position) const {
+    position.records = this->last_ins;
+    position.offset = this->map_base ? this->cursor - this->map_base : ~0UL;
+    std::copy(this->last_address, this->last_address + 8, position.last_address);
+}
+
+bool Trace::seek(const TracePosition& position) {
+    if (this->map_base && position.offset <= this->map_len) {
+        this->cursor = this->map_base + position.offset;
+        this->last_ins = position.records;
+        std::copy(position.last_address, position.last_address + 8, this->last_address);
+        return true;
+    }
+    while (this->last_ins < position.records) {
+        this->next_instr();
+        if (!this->has_next_instr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool stat_trace(const char* trace_name, u64& size, u64& mtime) {
+    struct stat st;
+    if (stat(trace_name, &st) != 0) {
+        return false;
+    }
+    size = st.st_size;
+    mtime = st.st_mtim.tv_sec * 1000000000UL + st.st_mtim.tv_nsec;
+    return true;
+}
+
+s64 write_binary_trace(char* src_filename, const char* dst_filename, bool keep_values) {
+    Trace src(src_filename);
+    if (src.trace_fd == -1) {
+        return -1;
     }
-}
\ No newline at end of file
+    FILE* dst = fopen(dst_filename, "wb");
+    if (!dst) {
+        return -1;
+    }
+    setvbuf(dst, nullptr, _IOFBF, 1 << 20);
+
+    u8 header[BINARY_TRACE_HEADER_LEN] = {0};
+    const u32 flags = keep_values ? TRACE_HAS_VALUES : 0;
+    memcpy(header, BINARY_TRACE_MAGIC, sizeof(BINARY_TRACE_MAGIC));
+    memcpy(header + sizeof(BINARY_TRACE_MAGIC), &flags, sizeof(flags));
+    fwrite(header, 1, sizeof(header), dst);
+
+    u64 last_address[8] = {0};
+    u8 record[20];
+    src.next_instr();
+    while (src.has_next_instr) {
+        const Instruction& ins = src.instruction;
+        const u8 op = ins.op & 0x7;
+        const s64 delta = static_cast<s64>(ins.address - last_address[op]);
+        last_address[op] = ins.address;
+        // The op takes the bottom 3 bits of the key, so deltas whose zigzag
+        // form needs more than 61 bits can't be packed
+        if (zigzag_encode(delta) >> 61 != 0) {
+            printf("error: record %lu of %s jumps to address %lx, too far from the last one to pack\n",
+                src.last_ins, src_filename, ins.address);
+            fclose(dst);
+            unlink(dst_filename);
+            return -1;
+        }
+
+        size_t len = put_varint(record, (zigzag_encode(delta) << 3) | op);
+        if (keep_values) {
+            len += put_varint(record + len, ins.value);
+        }
+        fwrite(record, 1, len, dst);
+        src.next_instr();
+    }
+
+    const bool ok = !ferror(dst) && src.read_error.empty();
+    if (fclose(dst) != 0 || !ok) {
+        unlink(dst_filename);
+        return -1;
+    }
+    return src.last_ins;
+}
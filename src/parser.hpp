@@ -1,4 +1,10 @@
+#pragma once
 #include "shortints.h"
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 // TODO: Define useful function definitions
 
@@ -17,17 +23,135 @@ struct Instruction {
 
 };
 
+// Traces are either the textual Dinero format, or the packed binary format
+// written by `csim --convert`. The format is detected from the file header.
+//
+// Packed binary layout (little endian):
+//   header: "CSIMBIN1", u32 flags, u32 reserved
+//   record: varint((zigzag(address - previous address of the same op) << 3) | op)
+//           [varint(value)]      only when TRACE_HAS_VALUES is set
+// Addresses are delta encoded per op so that instruction fetches and data
+// accesses each stay local, which keeps most records at one or two bytes.
+// A delta whose zigzag form needs more than 61 bits can't be packed, so
+// --convert refuses traces that jump that far.
+enum TraceFormat : u8 {
+	DINERO_TEXT = 0,
+	PACKED_BINARY = 1,
+};
+
+const char BINARY_TRACE_MAGIC[8] = {'C', 'S', 'I', 'M', 'B', 'I', 'N', '1'};
+const size_t BINARY_TRACE_HEADER_LEN = 16;
+const u32 TRACE_HAS_VALUES = 0x1;
+
+// Compressed traces (compress(1) .Z, gzip, zstd) are recognised by their magic
+// bytes and decompressed on the fly rather than unpacked to disk first.
+enum TraceCompression : u8 {
+	UNCOMPRESSED = 0,
+	LZW_COMPRESS = 1,
+	GZIP = 2,
+	ZSTD = 3,
+};
+
+// Supplies the raw bytes of a trace when it cannot be mapped: either the file
+// itself, or a decompressor wrapped around it. Defined in parser.cpp.
+struct ByteSource;
+
+// A bounded queue of decoded instruction blocks, filled by a producer thread
+// so decompression and parsing overlap with simulation.
+struct InstructionRing {
+	static const size_t BLOCK_LEN = 4096;
+	static const size_t NUM_BLOCKS = 8;
+
+	Instruction blocks[NUM_BLOCKS][BLOCK_LEN];
+	size_t block_len[NUM_BLOCKS];
+	u64 head; // Next block to be consumed
+	u64 tail; // Next block to be produced
+	bool done;
+	bool stopping;
+	std::mutex lock;
+	std::condition_variable not_empty;
+	std::condition_variable not_full;
+
+	InstructionRing();
+};
+
+// How far a trace has been read, so a later run can carry on from there (see
+// checkpoint.hpp). offset is the byte offset of the next record when the
+// trace is mapped, or ~0 when it is streamed and the records before have to
+// be read again to get back to it.
+struct TracePosition {
+	u64 records;
+	u64 offset;
+	u64 last_address[8];
+};
+
 struct Trace {
-	Trace(char* filename); 
+	Trace(char* filename);
+	~Trace();
+	// Owns the mapping, the fd, the buffers and the producer thread, so it
+	// can't be copied
+	Trace(const Trace&) = delete;
+	Trace& operator=(const Trace&) = delete;
 	int trace_fd;
-	// A trace will have many instructions. I don't know if it would be beneficial to 
-	// store all of them or just store the last one that was read. 
-	// For now, I'm going to store all of them but this can easily be changed.
-	
-	u64 last_ins; // Index to the last read instruction 
-	// std::vector<Instruction> instructions[1024];
-	// Instruction *instructions = new Instruction[2];
+	// Records are parsed in place out of the mapped (or block-buffered) file,
+	// so only the last one that was read is kept around.
+
+	u64 last_ins; // Number of records read so far
 	Instruction instruction;
 	void next_instr(); // method to add to the instruction array
+	void tell(TracePosition& position) const;
+	// Carry on from position, as though every record before it had just
+	// been read. Returns false if the trace ends first.
+	bool seek(const TracePosition& position);
 	bool has_next_instr;
-};
\ No newline at end of file
+	TraceFormat format;
+	TraceCompression compression;
+	bool has_values;
+	// Why a compressed trace ended early (a corrupt stream, or zstd failing),
+	// or empty if it didn't
+	std::string read_error;
+
+private:
+	// Longest record we expect: "<op> <16 hex digits> <16 hex digits>\r\n"
+	// plus slack for extra whitespace. The stream buffer is topped up
+	// whenever fewer bytes than this remain.
+	static const size_t MAX_RECORD_LEN = 64;
+	static const size_t STREAM_BLOCK_SIZE = 1 << 20;
+
+	// [cursor, end) is the unparsed part of the trace. When the file could be
+	// mapped it covers the whole file, otherwise it points into stream_buf.
+	const char* cursor;
+	const char* end;
+	char* map_base;
+	size_t map_len;
+	char* stream_buf;
+	bool stream_eof;
+	ByteSource* source;
+	u64 last_address[8]; // Per-op delta base for PACKED_BINARY
+
+	// Only used for compressed traces. The producer owns everything above
+	// while it runs; the consumer only touches the ring.
+	InstructionRing* ring;
+	std::thread producer;
+	const Instruction* ring_cursor;
+	const Instruction* ring_end;
+
+	void refill();
+	void detect_format();
+	bool read_record(Instruction& ins);
+	bool parse_record(Instruction& ins);
+	bool decode_record(Instruction& ins);
+	void produce();
+	bool next_block();
+	void end_of_trace();
+};
+
+// Re-encode any readable trace as PACKED_BINARY. Values are dropped unless
+// keep_values is set, since the simulator never looks at them. Returns the
+// number of records written, or -1 on error.
+s64 write_binary_trace(char* src_filename, const char* dst_filename, bool keep_values);
+
+// The size and modification time (in ns) of trace_name, which files derived
+// from a trace keep to tell whether it has changed since. Returns false if
+// it can't be read.
+bool stat_trace(const char* trace_name, u64& size, u64& mtime);
@@ -0,0 +1,167 @@
+#include "prefetch.hpp"
+
+#include <cstring>
+
+static const char* const PREFETCHER_NAMES[] = {
+    "none", "next", "stride", "stream", "delta",
+};
+static const u64 NUM_PREFETCHERS = sizeof(PREFETCHER_NAMES) / sizeof(PREFETCHER_NAMES[0]);
+
+const char* prefetcher_name(PrefetcherKind kind) {
+    return kind < NUM_PREFETCHERS ? PREFETCHER_NAMES[kind] : "unknown";
+}
+
+bool parse_prefetcher(const char* name, PrefetcherKind& kind) {
+    for (u64 i = 0; i < NUM_PREFETCHERS; i++) {
+        if (strcmp(name, PREFETCHER_NAMES[i]) == 0) {
+            kind = static_cast<PrefetcherKind>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+Prefetcher* make_prefetcher(PrefetcherKind kind) {
+    switch (kind) {
+        case NO_PREFETCHER: return nullptr;
+        case NEXT_LINE: return new NextLinePrefetcher();
+        case STRIDE: return new StridePrefetcher();
+        case STREAM: return new StreamPrefetcher();
+        case DELTA: return new DeltaPrefetcher();
+    }
+    return nullptr;
+}
+
+void NextLinePrefetcher::observe(u64 block, PrefetchTrigger trigger, std::vector<u64>& prefetches) {
+    if (trigger != DEMAND_HIT) {
+        prefetches.push_back(block + 1);
+    }
+}
+
+StridePrefetcher::StridePrefetcher() {
+    memset(this->table, 0, sizeof(this->table));
+}
+
+void StridePrefetcher::observe(u64 block, PrefetchTrigger trigger, std::vector<u64>& prefetches) {
+    const u64 region = block >> PREFETCH_REGION_BITS;
+    Entry& entry = this->table[region % TABLE_SIZE];
+    if (!entry.is_valid || entry.region != region) {
+        entry = Entry{region, block, 0, 0, true};
+        return;
+    }
+    const s64 stride = static_cast<s64>(block - entry.last_block);
+    if (stride == 0) {
+        return;
+    }
+    if (stride == entry.stride) {
+        entry.confidence += entry.confidence < 3;
+    } else {
+        entry.confidence = entry.confidence > 0 ? entry.confidence - 1 : 0;
+        if (entry.confidence == 0) {
+            entry.stride = stride;
+        }
+    }
+    entry.last_block = block;
+    if (entry.confidence >= 2) {
+        for (u64 i = 1; i <= DEGREE; i++) {
+            prefetches.push_back(block + entry.stride * static_cast<s64>(i));
+        }
+    }
+}
+
+StreamPrefetcher::StreamPrefetcher()
+    : last_miss(0)
+    , accesses(0)
+{
+    memset(this->streams, 0, sizeof(this->streams));
+}
+
+void StreamPrefetcher::observe(u64 block, PrefetchTrigger trigger, std::vector<u64>& prefetches) {
+    this->accesses++;
+    if (trigger == DEMAND_HIT) {
+        return;
+    }
+    // A block between a stream's head and frontier moves the stream along
+    for (Stream& stream : this->streams) {
+        const s64 ahead = static_cast<s64>(block - stream.head) * stream.direction;
+        if (!stream.is_valid || ahead <= 0 || ahead > static_cast<s64>(DEPTH)) {
+            continue;
+        }
+        stream.head = block;
+        stream.last_used = this->accesses;
+        const u64 target = block + stream.direction * static_cast<s64>(DEPTH);
+        while (stream.frontier != target) {
+            stream.frontier += stream.direction;
+            prefetches.push_back(stream.frontier);
+        }
+        return;
+    }
+    if (trigger != DEMAND_MISS) {
+        return;
+    }
+
+    // Two misses to neighbouring blocks start a stream in their direction,
+    // in place of the least recently used one
+    const s64 direction = block == this->last_miss + 1 ? 1 : block == this->last_miss - 1 ? -1 : 0;
+    this->last_miss = block;
+    if (direction == 0) {
+        return;
+    }
+    Stream* replaced = &this->streams[0];
+    for (Stream& stream : this->streams) {
+        if (!stream.is_valid || stream.last_used < replaced->last_used) {
+            replaced = &stream;
+            if (!stream.is_valid) {
+                break;
+            }
+        }
+    }
+    *replaced = Stream{block, block, direction, this->accesses, true};
+    for (u64 i = 0; i < DEPTH; i++) {
+        replaced->frontier += direction;
+        prefetches.push_back(replaced->frontier);
+    }
+}
+
+DeltaPrefetcher::DeltaPrefetcher() {
+    memset(this->table, 0, sizeof(this->table));
+}
+
+void DeltaPrefetcher::observe(u64 block, PrefetchTrigger trigger, std::vector<u64>& prefetches) {
+    const u64 region = block >> PREFETCH_REGION_BITS;
+    Entry& entry = this->table[region % TABLE_SIZE];
+    if (!entry.is_valid || entry.region != region) {
+        memset(&entry, 0, sizeof(entry));
+        entry.region = region;
+        entry.last_block = block;
+        entry.is_valid = true;
+        return;
+    }
+    const s64 delta = static_cast<s64>(block - entry.last_block);
+    if (delta == 0) {
+        return;
+    }
+    entry.last_block = block;
+    if (entry.num_deltas == HISTORY_LEN) {
+        memmove(entry.deltas, entry.deltas + 1, (HISTORY_LEN - 1) * sizeof(s64));
+        entry.num_deltas--;
+    }
+    entry.deltas[entry.num_deltas++] = delta;
+    if (entry.num_deltas < 3) {
+        return;
+    }
+
+    // Most recent earlier occurrence of the latest pair of deltas
+    const u64 n = entry.num_deltas;
+    for (u64 i = n - 2; i-- > 0;) {
+        if (entry.deltas[i] != entry.deltas[n - 2] || entry.deltas[i + 1] != entry.deltas[n - 1]) {
+            continue;
+        }
+        u64 next = block;
+        for (u64 j = i + 2; j < n && j < i + 2 + DEGREE; j++) {
+            next += entry.deltas[j];
+            prefetches.push_back(next);
+        }
+        return;
+    }
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include "shortints.h"
+#include <vector>
+
+// Hardware prefetchers. A cache with a prefetcher shows it every demand
+// access, as a block number, and fills whatever blocks it asks for in the
+// background (see Cache::issue_prefetch). None of them sees a PC, so the
+// stride and delta prefetchers learn per region of memory instead.
+enum PrefetcherKind : u8 {
+    NO_PREFETCHER = 0,
+    NEXT_LINE = 1, // The next block, on a miss or first use of a prefetched block
+    STRIDE = 2,    // Repeating strides within a region
+    STREAM = 3,    // Runs of ascending or descending misses, kept a few blocks ahead
+    DELTA = 4,     // Repeats of a region's recent pattern of deltas
+};
+
+const char* prefetcher_name(PrefetcherKind kind);
+// Returns false if name is not a prefetcher
+bool parse_prefetcher(const char* name, PrefetcherKind& kind);
+
+// What a demand access found
+enum PrefetchTrigger : u8 {
+    DEMAND_HIT,
+    DEMAND_MISS,
+    PREFETCH_HIT, // First use of a prefetched block
+};
+
+struct Prefetcher {
+    virtual ~Prefetcher() {}
+    // See a demand access to block, appending any blocks to prefetch
+    virtual void observe(u64 block, PrefetchTrigger trigger, std::vector<u64>& prefetches) = 0;
+};
+
+// nullptr for NO_PREFETCHER
+Prefetcher* make_prefetcher(PrefetcherKind kind);
+
+// Blocks per region tracked by the stride and delta prefetchers (4 KiB of
+// 64 byte blocks)
+const u64 PREFETCH_REGION_BITS = 6;
+
+struct NextLinePrefetcher final : public Prefetcher {
+    void observe(u64 block, PrefetchTrigger trigger, std::vector<u64>& prefetches) override;
+};
+
+struct StridePrefetcher final : public Prefetcher {
+    StridePrefetcher();
+    void observe(u64 block, PrefetchTrigger trigger, std::vector<u64>& prefetches) override;
+
+private:
+    static const u64 TABLE_SIZE = 64;
+    static const u64 DEGREE = 2;
+    struct Entry {
+        u64 region;
+        u64 last_block;
+        s64 stride;
+        u8 confidence; // Prefetches once it reaches 2, up to 3
+        bool is_valid;
+    };
+    Entry table[TABLE_SIZE]; // Direct mapped on the region
+};
+
+struct StreamPrefetcher final : public Prefetcher {
+    StreamPrefetcher();
+    void observe(u64 block, PrefetchTrigger trigger, std::vector<u64>& prefetches) override;
+
+private:
+    static const u64 NUM_STREAMS = 4;
+    static const u64 DEPTH = 4; // Blocks kept prefetched ahead of a stream
+    struct Stream {
+        u64 head;     // Last block demanded
+        u64 frontier; // Furthest block prefetched
+        s64 direction;
+        u64 last_used;
+        bool is_valid;
+    };
+    Stream streams[NUM_STREAMS];
+    u64 last_miss;
+    u64 accesses;
+};
+
+// Delta correlation: a region's last few deltas are searched for an earlier
+// occurrence of its latest pair, and the deltas that followed that occurrence
+// are prefetched, on the bet that the pattern repeats.
+struct DeltaPrefetcher final : public Prefetcher {
+    DeltaPrefetcher();
+    void observe(u64 block, PrefetchTrigger trigger, std::vector<u64>& prefetches) override;
+
+private:
+    static const u64 TABLE_SIZE = 64;
+    static const u64 HISTORY_LEN = 8;
+    static const u64 DEGREE = 4;
+    struct Entry {
+        u64 region;
+        u64 last_block;
+        s64 deltas[HISTORY_LEN]; // Oldest first
+        u64 num_deltas;
+        bool is_valid;
+    };
+    Entry table[TABLE_SIZE];
+};
@@ -0,0 +1,180 @@
+#include "profile.hpp"
+
+#ifdef CSIM_PROFILE
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char* const PHASE_NAMES[NUM_PROFILE_PHASES] = {
+    "trace_decode", "trace_wait", "access", "fill", "advance_time", "wait_for_line", "report",
+};
+
+// Every live thread's counts, and the sums of those that have exited
+static std::mutex profiles_lock;
+static std::vector<ThreadProfile*> live_profiles;
+static u64 retired_calls[NUM_PROFILE_PHASES];
+static u64 retired_cycles[NUM_PROFILE_PHASES];
+static u64 retired_counters[NUM_PROFILE_COUNTERS];
+static u64 retired_depths[PROFILE_DEPTH_BUCKETS];
+
+ThreadProfile::ThreadProfile() {
+    for (u64 i = 0; i < NUM_PROFILE_PHASES; i++) {
+        this->calls[i].store(0);
+        this->cycles[i].store(0);
+    }
+    for (u64 i = 0; i < NUM_PROFILE_COUNTERS; i++) {
+        this->counters[i].store(0);
+    }
+    for (u64 i = 0; i < PROFILE_DEPTH_BUCKETS; i++) {
+        this->depths[i].store(0);
+    }
+    std::lock_guard<std::mutex> guard(profiles_lock);
+    live_profiles.push_back(this);
+}
+
+ThreadProfile::~ThreadProfile() {
+    std::lock_guard<std::mutex> guard(profiles_lock);
+    for (u64 i = 0; i < NUM_PROFILE_PHASES; i++) {
+        retired_calls[i] += this->calls[i].load();
+        retired_cycles[i] += this->cycles[i].load();
+    }
+    for (u64 i = 0; i < NUM_PROFILE_COUNTERS; i++) {
+        retired_counters[i] += this->counters[i].load();
+    }
+    for (u64 i = 0; i < PROFILE_DEPTH_BUCKETS; i++) {
+        retired_depths[i] += this->depths[i].load();
+    }
+    live_profiles.erase(std::find(live_profiles.begin(), live_profiles.end(), this));
+}
+
+ThreadProfile& thread_profile() {
+    static thread_local ThreadProfile profile;
+    return profile;
+}
+
+// The host's hardware counters, counted for this process and every thread it
+// starts from here on. -1 where perf_event isn't available (no PMU, as in
+// most VMs, or perf_event_paranoid forbids it).
+enum HostCounter {
+    HOST_CYCLES,
+    HOST_INSTRUCTIONS,
+    HOST_LLC_REFERENCES,
+    HOST_LLC_MISSES,
+    NUM_HOST_COUNTERS,
+};
+static const u64 HOST_COUNTER_CONFIGS[NUM_HOST_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_REFERENCES, PERF_COUNT_HW_CACHE_MISSES,
+};
+static int host_counter_fds[NUM_HOST_COUNTERS] = {-1, -1, -1, -1};
+
+static std::chrono::steady_clock::time_point start_time;
+static u64 start_clock;
+
+static int open_host_counter(u64 config) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void profile_start() {
+    thread_profile();
+    for (u64 i = 0; i < NUM_HOST_COUNTERS; i++) {
+        host_counter_fds[i] = open_host_counter(HOST_COUNTER_CONFIGS[i]);
+    }
+    start_time = std::chrono::steady_clock::now();
+    start_clock = profile_clock();
+}
+
+static bool read_host_counter(HostCounter counter, u64& value) {
+    const int fd = host_counter_fds[counter];
+    return fd >= 0 && read(fd, &value, sizeof(value)) == sizeof(value);
+}
+
+void profile_report(const char* label, u64 records, u64 simulated) {
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    const u64 clock = profile_clock() - start_clock;
+    // Cycle counts become seconds at the rate the counter ran over the run
+    const double clock_rate = seconds > 0 ? clock / seconds : 0.0;
+
+    u64 calls[NUM_PROFILE_PHASES], cycles[NUM_PROFILE_PHASES];
+    u64 counters[NUM_PROFILE_COUNTERS], depths[PROFILE_DEPTH_BUCKETS];
+    {
+        std::lock_guard<std::mutex> guard(profiles_lock);
+        std::copy(retired_calls, retired_calls + NUM_PROFILE_PHASES, calls);
+        std::copy(retired_cycles, retired_cycles + NUM_PROFILE_PHASES, cycles);
+        std::copy(retired_counters, retired_counters + NUM_PROFILE_COUNTERS, counters);
+        std::copy(retired_depths, retired_depths + PROFILE_DEPTH_BUCKETS, depths);
+        for (const ThreadProfile* profile : live_profiles) {
+            for (u64 i = 0; i < NUM_PROFILE_PHASES; i++) {
+                calls[i] += profile->calls[i].load(std::memory_order_relaxed);
+                cycles[i] += profile->cycles[i].load(std::memory_order_relaxed);
+            }
+            for (u64 i = 0; i < NUM_PROFILE_COUNTERS; i++) {
+                counters[i] += profile->counters[i].load(std::memory_order_relaxed);
+            }
+            for (u64 i = 0; i < PROFILE_DEPTH_BUCKETS; i++) {
+                depths[i] += profile->depths[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    std::string json;
+    char buf[256];
+    json += "{\"label\": \"";
+    for (const char* c = label; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            json += '\\';
+        }
+        json += *c;
+    }
+    snprintf(buf, sizeof(buf), "\", \"records\": %lu, \"simulated_records\": %lu, \"seconds\": %.6f, "
+        "\"simulated_records_per_second\": %.0f, \"clock_rate\": %.0f, \"phases\": {", records, simulated, seconds,
+        seconds > 0 ? simulated / seconds : 0.0, clock_rate);
+    json += buf;
+    for (u64 i = 0; i < NUM_PROFILE_PHASES; i++) {
+        snprintf(buf, sizeof(buf), "%s\"%s\": {\"calls\": %lu, \"cycles\": %lu, \"seconds\": %.6f}", i ? ", " : "",
+            PHASE_NAMES[i], calls[i], cycles[i], clock_rate > 0 ? cycles[i] / clock_rate : 0.0);
+        json += buf;
+    }
+    snprintf(buf, sizeof(buf), "}, \"events_completed\": %lu, \"wait_for_line\": {\"calls\": %lu, \"events\": %lu}, "
+        "\"in_flight_depth\": [", counters[COUNTER_EVENTS_COMPLETED], calls[PHASE_WAIT_FOR_LINE],
+        counters[COUNTER_WAIT_EVENTS]);
+    json += buf;
+    for (u64 i = 0; i < PROFILE_DEPTH_BUCKETS; i++) {
+        snprintf(buf, sizeof(buf), "%s%lu", i ? ", " : "", depths[i]);
+        json += buf;
+    }
+    json += "], \"host\": ";
+    u64 host_cycles, instructions, llc_references, llc_misses;
+    if (read_host_counter(HOST_CYCLES, host_cycles) && read_host_counter(HOST_INSTRUCTIONS, instructions) &&
+        read_host_counter(HOST_LLC_REFERENCES, llc_references) && read_host_counter(HOST_LLC_MISSES, llc_misses)) {
+        snprintf(buf, sizeof(buf), "{\"cycles\": %lu, \"instructions\": %lu, \"ipc\": %.3f, \"llc_references\": %lu, "
+            "\"llc_misses\": %lu}", host_cycles, instructions, host_cycles ? static_cast<double>(instructions) / host_cycles : 0.0,
+            llc_references, llc_misses);
+        json += buf;
+    } else {
+        json += "null";
+    }
+    json += "}\n";
+
+    FILE* out = fopen("profile.jsonl", "a");
+    if (out) {
+        fputs(json.c_str(), out);
+        fclose(out);
+    }
+    fprintf(stderr, "Profile appended to profile.jsonl\n");
+}
+#endif
@@ -0,0 +1,107 @@
+#pragma once
+#include "shortints.h"
+
+// Instrumentation of the simulator itself, for finding where a slow run's
+// host time goes. Built in with -DCSIM_PROFILE (`make profile`); otherwise
+// every macro below expands to nothing and profile_start/profile_report do
+// nothing, so normal builds pay nothing for it.
+//
+// Phases are timed with the host's cycle counter and are inclusive: an
+// access's time includes the fills and time advances under it.
+
+enum ProfilePhase : u8 {
+    PHASE_TRACE_DECODE, // Parsing or decoding records, on whichever thread does it
+    PHASE_TRACE_WAIT,   // The simulation waiting on the decoding thread
+    PHASE_ACCESS,       // Simulating a record, from the top of the hierarchy
+    PHASE_FILL,         // Replacing a line on a miss (Cache::put)
+    PHASE_ADVANCE_TIME, // Machine::advance_time, completing in-flight lines
+    PHASE_WAIT_FOR_LINE,
+    PHASE_REPORT,
+    NUM_PROFILE_PHASES,
+};
+
+enum ProfileCounter : u8 {
+    COUNTER_EVENTS_COMPLETED, // In-flight events completed by advance_time
+    COUNTER_WAIT_EVENTS,      // Of those, the ones completed while waiting for a line
+    NUM_PROFILE_COUNTERS,
+};
+
+// Histogram buckets of the in-flight queue's depth, sampled on every
+// advance_time: bucket 0 is empty, bucket b holds depths 2^(b-1) to 2^b - 1,
+// and the last bucket everything deeper.
+const u64 PROFILE_DEPTH_BUCKETS = 16;
+
+#ifdef CSIM_PROFILE
+#include <atomic>
+#include <chrono>
+
+// One thread's counts. Only the owning thread writes them, so updates are
+// plain loads and stores; they are atomic only so a report can read them
+// while the thread is still running.
+struct ThreadProfile {
+    std::atomic<u64> calls[NUM_PROFILE_PHASES];
+    std::atomic<u64> cycles[NUM_PROFILE_PHASES];
+    std::atomic<u64> counters[NUM_PROFILE_COUNTERS];
+    std::atomic<u64> depths[PROFILE_DEPTH_BUCKETS];
+
+    ThreadProfile();
+    ~ThreadProfile();
+};
+
+ThreadProfile& thread_profile();
+
+inline void profile_add(std::atomic<u64>& counter, u64 amount) {
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+// Host cycles, or nanoseconds where there is no cycle counter to read
+inline u64 profile_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+struct ProfileScope {
+    const ProfilePhase phase;
+    const u64 start;
+
+    explicit ProfileScope(ProfilePhase phase) : phase(phase), start(profile_clock()) {}
+    ~ProfileScope() {
+        ThreadProfile& profile = thread_profile();
+        profile_add(profile.calls[this->phase], 1);
+        profile_add(profile.cycles[this->phase], profile_clock() - this->start);
+    }
+};
+
+inline void profile_depth(u64 depth) {
+    u64 bucket = depth ? 64 - __builtin_clzl(depth) : 0;
+    bucket = bucket < PROFILE_DEPTH_BUCKETS ? bucket : PROFILE_DEPTH_BUCKETS - 1;
+    profile_add(thread_profile().depths[bucket], 1);
+}
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+// Time the rest of the enclosing block as phase
+#define PROFILE_SCOPE(phase) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(phase)
+#define PROFILE_COUNT(counter, amount) profile_add(thread_profile().counters[counter], (amount))
+#define PROFILE_DEPTH(depth) profile_depth(depth)
+
+// Start the run-wide measurements: wall clock, cycle counter and, where the
+// kernel allows it, the host's hardware counters through perf_event. Call
+// before starting any other thread, so theirs are counted too.
+void profile_start();
+// Append the run's profile to profile.jsonl as one JSON object on one line.
+// records is how many trace records were read, simulated how many were
+// simulated (records times the configurations run over them).
+void profile_report(const char* label, u64 records, u64 simulated);
+#else
+#define PROFILE_SCOPE(phase) ((void)0)
+// Arguments go unevaluated, but still count as used
+#define PROFILE_COUNT(counter, amount) ((void)sizeof(amount))
+#define PROFILE_DEPTH(depth) ((void)sizeof(depth))
+
+inline void profile_start() {}
+inline void profile_report(const char* label, u64 records, u64 simulated) {}
+#endif
@@ -0,0 +1,48 @@
+#include "replacement.hpp"
+
+#include <cstring>
+
+static const char* const POLICY_NAMES[] = {
+    "random", "lru", "plru", "bitplru", "srrip", "brrip",
+};
+static const u64 NUM_POLICIES = sizeof(POLICY_NAMES) / sizeof(POLICY_NAMES[0]);
+
+const char* replacement_policy_name(ReplacementPolicy policy) {
+    return policy < NUM_POLICIES ? POLICY_NAMES[policy] : "unknown";
+}
+
+bool parse_replacement_policy(const char* name, ReplacementPolicy& policy) {
+    for (u64 i = 0; i < NUM_POLICIES; i++) {
+        if (strcmp(name, POLICY_NAMES[i]) == 0) {
+            policy = static_cast<ReplacementPolicy>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool is_replacement_policy_supported(ReplacementPolicy policy, u64 assoc) {
+    switch (policy) {
+        case RANDOM: return true;
+        // Ages are a byte each
+        case LRU: return assoc <= 256;
+        // The tree needs a power of two ways, one bit per inner node
+        case TREE_PLRU: return assoc <= 64 && (assoc & (assoc - 1)) == 0;
+        case BIT_PLRU: return assoc <= 64;
+        case SRRIP: return true;
+        case BRRIP: return true;
+    }
+    return false;
+}
+
+u64 replacement_state_bytes(ReplacementPolicy policy, u64 assoc) {
+    switch (policy) {
+        case RANDOM: return Replacement<RANDOM>::state_bytes(assoc);
+        case LRU: return Replacement<LRU>::state_bytes(assoc);
+        case TREE_PLRU: return Replacement<TREE_PLRU>::state_bytes(assoc);
+        case BIT_PLRU: return Replacement<BIT_PLRU>::state_bytes(assoc);
+        case SRRIP: return Replacement<SRRIP>::state_bytes(assoc);
+        case BRRIP: return Replacement<BRRIP>::state_bytes(assoc);
+    }
+    return 0;
+}
@@ -0,0 +1,211 @@
+#pragma once
+#include "shortints.h"
+#include <cstring>
+
+// Replacement policies. Each policy is a specialisation of Replacement<> with
+// only static members, so a cache whose policy is fixed at compile time calls
+// straight into it; Cache picks one at runtime with a switch on its policy.
+//
+// A policy keeps state_bytes(assoc) bytes of state per set, stored by the
+// cache in one contiguous array next to its lines:
+//   reset(state, assoc)              set up the state of an empty set
+//   touch(state, assoc, way)         a line was hit
+//   fill(state, assoc, way, rng)     a new block was placed in a line
+//   victim(state, assoc, rng)        the line to evict from a full set
+enum ReplacementPolicy : u8 {
+    RANDOM = 0,
+    LRU = 1,
+    TREE_PLRU = 2,
+    BIT_PLRU = 3,
+    SRRIP = 4,
+    BRRIP = 5,
+};
+
+const char* replacement_policy_name(ReplacementPolicy policy);
+// Returns false if name is not a policy
+bool parse_replacement_policy(const char* name, ReplacementPolicy& policy);
+// Whether the policy can manage a set of this many ways
+bool is_replacement_policy_supported(ReplacementPolicy policy, u64 assoc);
+// Bytes of state the policy keeps per set
+u64 replacement_state_bytes(ReplacementPolicy policy, u64 assoc);
+
+// xorshift64*: small, fast, and seeded, so runs are reproducible.
+struct FastRandom {
+    u64 state;
+    FastRandom(u64 seed = 0x9e3779b97f4a7c15UL) : state(seed ? seed : 1) {}
+    u64 next() {
+        this->state ^= this->state >> 12;
+        this->state ^= this->state << 25;
+        this->state ^= this->state >> 27;
+        return this->state * 0x2545f4914f6cdd1dUL;
+    }
+    // Uniform in [0, bound)
+    u64 below(u64 bound) {
+        return (this->next() >> 32) % bound;
+    }
+};
+
+template <ReplacementPolicy Policy> struct Replacement;
+
+template <> struct Replacement<RANDOM> {
+    static constexpr u64 state_bytes(u64 assoc) { return 0; }
+    static void reset(u8* state, u64 assoc) {}
+    static void touch(u8* state, u64 assoc, u64 way) {}
+    static void fill(u8* state, u64 assoc, u64 way, FastRandom& rng) {}
+    static u64 victim(u8* state, u64 assoc, FastRandom& rng) {
+        return rng.below(assoc);
+    }
+};
+
+// True LRU: one age byte per way, 0 being the most recently used. The ages
+// of a set are always a permutation of 0 .. assoc - 1.
+template <> struct Replacement<LRU> {
+    static constexpr u64 state_bytes(u64 assoc) { return assoc; }
+    static void reset(u8* state, u64 assoc) {
+        for (u64 way = 0; way < assoc; way++) {
+            state[way] = static_cast<u8>(assoc - 1 - way);
+        }
+    }
+    static void touch(u8* state, u64 assoc, u64 way) {
+        const u8 age = state[way];
+        for (u64 i = 0; i < assoc; i++) {
+            state[i] += state[i] < age;
+        }
+        state[way] = 0;
+    }
+    static void fill(u8* state, u64 assoc, u64 way, FastRandom& rng) {
+        touch(state, assoc, way);
+    }
+    static u64 victim(u8* state, u64 assoc, FastRandom& rng) {
+        for (u64 way = 0; way < assoc; way++) {
+            if (state[way] == assoc - 1) {
+                return way;
+            }
+        }
+        return 0;
+    }
+};
+
+// Tree pseudo-LRU: assoc - 1 bits forming a binary tree over the ways (node n
+// has children 2n and 2n + 1, the root is node 1). Each bit points towards
+// the half that was used less recently.
+template <> struct Replacement<TREE_PLRU> {
+    static constexpr u64 state_bytes(u64 assoc) { return sizeof(u64); }
+    static u64 levels(u64 assoc) {
+        u64 levels = 0;
+        while ((1UL << levels) < assoc) {
+            levels++;
+        }
+        return levels;
+    }
+    static void reset(u8* state, u64 assoc) {
+        memset(state, 0, sizeof(u64));
+    }
+    static void touch(u8* state, u64 assoc, u64 way) {
+        u64 bits;
+        memcpy(&bits, state, sizeof(bits));
+        const u64 depth = levels(assoc);
+        u64 node = 1;
+        for (u64 level = 0; level < depth; level++) {
+            const u64 branch = (way >> (depth - 1 - level)) & 1;
+            // Point the node away from the way just used
+            bits = (bits & ~(1UL << node)) | ((branch ^ 1) << node);
+            node = 2 * node + branch;
+        }
+        memcpy(state, &bits, sizeof(bits));
+    }
+    static void fill(u8* state, u64 assoc, u64 way, FastRandom& rng) {
+        touch(state, assoc, way);
+    }
+    static u64 victim(u8* state, u64 assoc, FastRandom& rng) {
+        u64 bits;
+        memcpy(&bits, state, sizeof(bits));
+        const u64 depth = levels(assoc);
+        u64 node = 1;
+        u64 way = 0;
+        for (u64 level = 0; level < depth; level++) {
+            const u64 branch = (bits >> node) & 1;
+            way = 2 * way + branch;
+            node = 2 * node + branch;
+        }
+        return way;
+    }
+};
+
+// Bit pseudo-LRU (MRU bits): one bit per way, set when the way is used. Once
+// every bit is set they are all cleared but the one just used. The victim is
+// the first way whose bit is clear.
+template <> struct Replacement<BIT_PLRU> {
+    static constexpr u64 state_bytes(u64 assoc) { return sizeof(u64); }
+    static void reset(u8* state, u64 assoc) {
+        memset(state, 0, sizeof(u64));
+    }
+    static void touch(u8* state, u64 assoc, u64 way) {
+        u64 bits;
+        memcpy(&bits, state, sizeof(bits));
+        bits |= 1UL << way;
+        const u64 all = assoc == 64 ? ~0UL : (1UL << assoc) - 1;
+        if (bits == all) {
+            bits = 1UL << way;
+        }
+        memcpy(state, &bits, sizeof(bits));
+    }
+    static void fill(u8* state, u64 assoc, u64 way, FastRandom& rng) {
+        touch(state, assoc, way);
+    }
+    static u64 victim(u8* state, u64 assoc, FastRandom& rng) {
+        u64 bits;
+        memcpy(&bits, state, sizeof(bits));
+        return __builtin_ctzl(~bits);
+    }
+};
+
+// Static re-reference interval prediction (Jaleel et al.): a 2-bit
+// re-reference prediction value per way. Hits predict a near re-reference,
+// new blocks a long one, and the victim is a way predicted distant, ageing
+// the whole set until there is one.
+template <> struct Replacement<SRRIP> {
+    static const u8 MAX_RRPV = 3;
+    static constexpr u64 state_bytes(u64 assoc) { return assoc; }
+    static void reset(u8* state, u64 assoc) {
+        memset(state, MAX_RRPV, assoc);
+    }
+    static void touch(u8* state, u64 assoc, u64 way) {
+        state[way] = 0;
+    }
+    static void fill(u8* state, u64 assoc, u64 way, FastRandom& rng) {
+        state[way] = MAX_RRPV - 1;
+    }
+    static u64 victim(u8* state, u64 assoc, FastRandom& rng) {
+        for (;;) {
+            for (u64 way = 0; way < assoc; way++) {
+                if (state[way] == MAX_RRPV) {
+                    return way;
+                }
+            }
+            for (u64 way = 0; way < assoc; way++) {
+                state[way]++;
+            }
+        }
+    }
+};
+
+// Bimodal RRIP: SRRIP, except new blocks are predicted distant, and only
+// occasionally (1 in 32) long, so blocks that are never reused don't wash
+// out the working set.
+template <> struct Replacement<BRRIP> {
+    static constexpr u64 state_bytes(u64 assoc) { return assoc; }
+    static void reset(u8* state, u64 assoc) {
+        Replacement<SRRIP>::reset(state, assoc);
+    }
+    static void touch(u8* state, u64 assoc, u64 way) {
+        Replacement<SRRIP>::touch(state, assoc, way);
+    }
+    static void fill(u8* state, u64 assoc, u64 way, FastRandom& rng) {
+        const bool is_long = rng.below(32) == 0;
+        state[way] = is_long ? Replacement<SRRIP>::MAX_RRPV - 1 : Replacement<SRRIP>::MAX_RRPV;
+    }
+    static u64 victim(u8* state, u64 assoc, FastRandom& rng) {
+        return Replacement<SRRIP>::victim(state, assoc, rng);
+    }
+};
@@ -0,0 +1,156 @@
+#include "sampling.hpp"
+#include "profile.hpp"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+bool parse_sampling_spec(const char* spec, SamplingConfig& config) {
+    char* end;
+    SamplingConfig parsed;
+    parsed.period = strtoull(spec, &end, 10);
+    if (*end != ':') {
+        return false;
+    }
+    parsed.warmup = strtoull(end + 1, &end, 10);
+    if (*end != ':') {
+        return false;
+    }
+    parsed.measure = strtoull(end + 1, &end, 10);
+    if (parsed.measure == 0 || parsed.warmup + parsed.measure > parsed.period) {
+        return false;
+    }
+    parsed.warming = parsed.period - parsed.warmup - parsed.measure;
+    if (*end == ':') {
+        parsed.warming = strtoull(end + 1, &end, 10);
+    }
+    if (*end != '\0' || parsed.warming + parsed.warmup + parsed.measure > parsed.period) {
+        return false;
+    }
+    config = parsed;
+    return true;
+}
+
+RunningStat::RunningStat() : count(0), mean(0), m2(0) {}
+
+void RunningStat::add(double x) {
+    this->count++;
+    const double delta = x - this->mean;
+    this->mean += delta / this->count;
+    this->m2 += delta * (x - this->mean);
+}
+
+double RunningStat::stddev() const {
+    return this->count > 1 ? sqrt(this->m2 / (this->count - 1)) : 0.0;
+}
+
+double RunningStat::ci95() const {
+    return this->count > 1 ? 1.96 * this->stddev() / sqrt(static_cast<double>(this->count)) : 0.0;
+}
+
+Sampler::Sampler(Hierarchy& hierarchy, const SamplingConfig& config)
+    : hierarchy(hierarchy)
+    , config(config)
+    , records(0)
+    , window_start()
+{}
+
+bool Sampler::is_fully_warmed() const {
+    return this->config.warming == this->config.period - this->config.warmup - this->config.measure;
+}
+
+Sampler::Snapshot Sampler::snapshot() {
+    Snapshot snap;
+    snap.time = this->hierarchy.machine.time;
+    snap.energy = this->hierarchy.total_energy();
+    size_t i = 0;
+    for (const Hierarchy::Row& row : this->hierarchy.rows()) {
+        // Every access is counted as a hit once it completes, misses included
+        snap.accesses[i] = row.cache.read_hits + row.cache.write_hits;
+        snap.misses[i] = row.cache.read_misses + row.cache.write_misses;
+        i++;
+    }
+    return snap;
+}
+
+void Sampler::step(const Instruction& ins) {
+    const u64 offset = this->records++ % this->config.period;
+    const u64 detail_start = this->config.period - this->config.warmup - this->config.measure;
+    const u64 measure_start = this->config.period - this->config.measure;
+
+    if (offset < detail_start) {
+        if (offset >= detail_start - this->config.warming) {
+            this->hierarchy.warm(ins);
+        }
+        return;
+    }
+    if (offset == measure_start) {
+        this->window_start = this->snapshot();
+    }
+    this->hierarchy.step(ins);
+    if (offset == this->config.period - 1) {
+        const Snapshot end = this->snapshot();
+        const double len = static_cast<double>(this->config.measure);
+        this->time_per_record.add((end.time - this->window_start.time) / len);
+        this->energy_per_record.add((end.energy - this->window_start.energy) / len);
+        for (size_t i = 0; i < Hierarchy::NUM_ROWS; i++) {
+            const u64 accesses = end.accesses[i] - this->window_start.accesses[i];
+            if (accesses > 0) {
+                this->miss_rate[i].add(static_cast<double>(end.misses[i] - this->window_start.misses[i]) / accesses);
+            }
+        }
+    }
+}
+
+void Sampler::report(const char* trace_name) {
+    PROFILE_SCOPE(PHASE_REPORT);
+    const double records = static_cast<double>(this->records);
+    const double time_ms = this->time_per_record.mean * records / 1e9;
+    const double time_ci = this->time_per_record.ci95() * records / 1e9;
+    // Energy is kept in femtojoules
+    const double energy_mj = this->energy_per_record.mean * records / 1e12;
+    const double energy_ci = this->energy_per_record.ci95() * records / 1e12;
+
+    printf("\nSampled run complete! (%lu windows of %lu records every %lu records, %lu warmed)\n",
+        this->time_per_record.count, this->config.measure, this->config.period,
+        this->config.warming + this->config.warmup);
+    // The intervals only cover the spread between windows. With partial
+    // warming every window starts from caches that missed most of the trace,
+    // which shifts all of them the same way, so an interval would just be
+    // confidently wrong.
+    const bool is_fully_warmed = this->is_fully_warmed();
+    if (is_fully_warmed) {
+        printf("Time: %.6f ms +/- %.6f (%.2f%%)\n", time_ms, time_ci,
+            time_ms > 0 ? 100.0 * time_ci / time_ms : 0.0);
+        printf("Energy: %.6f mJ +/- %.6f (%.2f%%)\n\n", energy_mj, energy_ci,
+            energy_mj > 0 ? 100.0 * energy_ci / energy_mj : 0.0);
+    } else {
+        printf("Time: %.6f ms (biased, no interval)\n", time_ms);
+        printf("Energy: %.6f mJ (biased, no interval)\n\n", energy_mj);
+    }
+    printf("File: %s\nL2 associativity: %lu\n", trace_name, this->hierarchy.config.l2_associativity);
+    if (this->hierarchy.config.policy != DEFAULT_CONFIG.policy) {
+        printf("Replacement: %s\n", replacement_policy_name(this->hierarchy.config.policy));
+    }
+    printf("Cache  Miss_Rate    +/-95%%   Windows\n");
+    size_t i = 0;
+    for (const Hierarchy::Row& row : this->hierarchy.rows()) {
+        if (is_fully_warmed) {
+            printf("%-7s%9.6f %9.6f %9lu\n", row.name, this->miss_rate[i].mean,
+                this->miss_rate[i].ci95(), this->miss_rate[i].count);
+        } else {
+            printf("%-7s%9.6f %9s %9lu\n", row.name, this->miss_rate[i].mean, "-", this->miss_rate[i].count);
+        }
+        i++;
+    }
+    if (!is_fully_warmed) {
+        printf("warning: only %lu of every %lu records between windows were warmed, so the caches start each "
+            "window colder than they would be and every estimate is biased. Leave out <warming> to warm them all "
+            "and get confidence intervals.\n", this->config.warming,
+            this->config.period - this->config.warmup - this->config.measure);
+    } else {
+        printf("note: the intervals cover the spread between windows, not the error from warming only tags\n");
+    }
+    if (is_fully_warmed && this->time_per_record.count < 30) {
+        printf("warning: fewer than 30 windows, the confidence intervals are optimistic\n");
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+#include "simulator.hpp"
+
+// Sampled simulation in the style of SMARTS: most of the trace is fast
+// forwarded with functional warming (Hierarchy::warm keeps tags and dirty
+// bits up to date, but nothing is timed or counted), and every period a
+// short stretch is simulated in detail. The first part of that stretch
+// warms up the in-flight state, the rest is measured. Totals are
+// extrapolated from the measured windows, with 95% confidence intervals.
+//
+// Sampling here does not give the order of magnitude speedup it does over
+// a cycle-level core model. Detailed simulation of this hierarchy is
+// already cheap, and functional warming costs nearly as much: on a 5M
+// record trace, 100000:2000:1000 took 0.73 s against 0.76 s for a full run
+// (0.26 s against 0.33 s from a packed trace). Profiling the warmed run puts
+// its time in decoding records and in filling the blocks the trace misses
+// on, which warming has to do anyway; skipping repeated reads of a block
+// took out half the warming calls and no measurable time.
+//
+// Warming can be limited to the records just before each detailed stretch,
+// skipping the rest of the period outright. That is faster
+// (100000:500:1000:2000 took 0.58 s, 0.14 s packed) but biased, since the
+// caches miss most of the trace: there it put the time 3% high. Such runs
+// are reported without confidence intervals, which only cover the spread
+// between windows and would hide the bias.
+struct SamplingConfig {
+    u64 period;  // Records from the start of one window to the next
+    u64 warming; // Functionally warmed records before each detailed stretch
+    u64 warmup;  // Detailed but unmeasured records before each window
+    u64 measure; // Detailed and measured records per window
+};
+
+// Parse "<period>:<warmup>:<measure>[:<warming>]", all in trace records.
+// Without a warming length every record outside the detailed stretches is
+// functionally warmed.
+bool parse_sampling_spec(const char* spec, SamplingConfig& config);
+
+// Mean and variance of a series of measurements (Welford's method)
+struct RunningStat {
+    u64 count;
+    double mean;
+    double m2;
+
+    RunningStat();
+    void add(double x);
+    double stddev() const;
+    // Half width of the 95% confidence interval of the mean
+    double ci95() const;
+};
+
+struct Sampler {
+    Sampler(Hierarchy& hierarchy, const SamplingConfig& config);
+
+    // Fast forward, warm up or measure one record, depending on where it
+    // falls in the sampling period.
+    void step(const Instruction& ins);
+    // Print the extrapolated results
+    void report(const char* trace_name);
+
+private:
+    struct Snapshot {
+        Time time;
+        Joule energy;
+        u64 accesses[Hierarchy::NUM_ROWS];
+        u64 misses[Hierarchy::NUM_ROWS];
+    };
+    Snapshot snapshot();
+    // Whether every record outside the detailed stretches is warmed
+    bool is_fully_warmed() const;
+
+    Hierarchy& hierarchy;
+    const SamplingConfig config;
+    u64 records;
+    Snapshot window_start;
+    RunningStat time_per_record;
+    RunningStat energy_per_record;
+    RunningStat miss_rate[Hierarchy::NUM_ROWS];
+};
@@ -2,155 +2,975 @@
 #include "cache.hpp"
 #include <cstdio>
 #include "simulator.hpp"
+#include "batch.hpp"
+#include "bench.hpp"
+#include "checkpoint.hpp"
+#include "missstream.hpp"
+#include "interval.hpp"
+#include "stackdist.hpp"
+#include "multicore.hpp"
+#include "sampling.hpp"
+#include "profile.hpp"
+#include <cassert>
+#include <cerrno>
+#include <cctype>
+#include <cstdarg>
 #include <string>
 #include <cstring>
 #include <iostream>
 #include <fstream>
+#include <chrono>
+#include <sys/stat.h>
 
 
-int custom_assoc = 0;   
-bool has_custom_assoc = false;
+// csim --convert <in> <out> [--keep-values]
+int convert_main(int argc, char* argv[]) {
+    if (argc < 4 || (argc == 5 && strcmp(argv[4], "--keep-values") != 0) || argc > 5) {
+        printf("Usage: csim --convert <trace to read> <packed trace to write> [--keep-values]\n");
+        return -1;
+    }
+    const bool keep_values = argc == 5;
+    s64 records = write_binary_trace(argv[2], argv[3], keep_values);
+    if (records < 0) {
+        printf("error: could not convert %s to %s\n", argv[2], argv[3]);
+        return -1;
+    }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Usage: csim -f <required, file name of trace> \n-a <associativity level, leave blank for default>\n");
+    struct stat src_stat, dst_stat;
+    if (stat(argv[2], &src_stat) != 0) {
+        printf("error: can't stat %s: %s\n", argv[2], strerror(errno));
         return -1;
-    } else if (argc == 2 || argc == 4) {
-        printf("Usage: csim -f <required, file name of trace> \n-a <associativity level; 2, 4, or 8; blank for default>\n");
+    }
+    if (stat(argv[3], &dst_stat) != 0) {
+        printf("error: can't stat %s: %s\n", argv[3], strerror(errno));
         return -1;
-    } else {
-        if (argc == 5 && strncmp(argv[3], "-a", 3) == 0) {
-            has_custom_assoc = true;
-            if (strlen(argv[4]) > 1) {
-                printf("error: please give an associativity from 1 to 8\n");
-                return -1;
-            }
-            custom_assoc =  atoi(argv[4]);
+    }
+    printf("Converted %ld records: %ld bytes -> %ld bytes (%.1f%%)\n", records,
+        (long)src_stat.st_size, (long)dst_stat.st_size,
+        src_stat.st_size > 0 ? 100.0 * dst_stat.st_size / src_stat.st_size : 0.0);
+    return 0;
+}
+
+// Size with an optional K/M/G suffix, in bytes. Returns 0 if malformed.
+static u64 parse_size(const char* str, char** end) {
+    u64 size = strtoull(str, end, 10);
+    switch (**end) {
+        case 'K': case 'k': size = KiB(size); (*end)++; break;
+        case 'M': case 'm': size = MiB(size); (*end)++; break;
+        case 'G': case 'g': size = GiB(size); (*end)++; break;
+        default: break;
+    }
+    return size;
+}
+
+static bool is_power_of_two(u64 value) {
+    return value && !(value & (value - 1));
+}
+
+bool parse_config_spec(const char* spec, SimConfig& config, ReplacementPolicy default_policy) {
+    SimConfig parsed = DEFAULT_CONFIG;
+    parsed.policy = default_policy;
+    char* end;
+    parsed.l2_capacity = parse_size(spec, &end);
+    if (*end != ':') {
+        return false;
+    }
+    parsed.l2_associativity = strtoull(end + 1, &end, 10);
+    if (*end == ':' && isdigit(end[1])) {
+        parsed.block_size = parse_size(end + 1, &end);
+    }
+    if (*end == ':') {
+        const char* name = end + 1;
+        end = const_cast<char*>(name) + strcspn(name, ",");
+        const std::string policy_name(name, end - name);
+        if (!parse_replacement_policy(policy_name.c_str(), parsed.policy)) {
+            return false;
         }
-    } 
-    
-    int a_l2 =  has_custom_assoc ? custom_assoc : 4; 
-    
-    Trace trace(argv[2]);
+    }
+    if (*end != '\0' && *end != ',') {
+        return false;
+    }
+    if (!is_power_of_two(parsed.l2_capacity) || !is_power_of_two(parsed.l2_associativity) ||
+        !is_power_of_two(parsed.block_size) ||
+        parsed.l2_associativity * parsed.block_size > parsed.l2_capacity ||
+        KiB(32) < parsed.block_size ||
+        parsed.l2_capacity / parsed.l2_associativity < MIN_WAY_SIZE ||
+        !is_replacement_policy_supported(parsed.policy, parsed.l2_associativity)) {
+        return false;
+    }
+    config = parsed;
+    return true;
+}
 
-    if (trace.trace_fd == -1) {
-        printf("error: invalid filename\n");
-        return -1;
+bool is_production_config(const SimConfig& config) {
+    return config.l2_capacity == DEFAULT_CONFIG.l2_capacity &&
+        config.l2_associativity == DEFAULT_CONFIG.l2_associativity &&
+        config.block_size == DEFAULT_CONFIG.block_size &&
+        config.policy == DEFAULT_CONFIG.policy &&
+        config.l1_prefetcher == NO_PREFETCHER && config.l2_prefetcher == NO_PREFETCHER &&
+        config.l1_mshrs == 0 && config.l2_mshrs == 0 && config.window == 0 &&
+        config.write_buffer_depth == 0 && config.dram.channels == 0;
+}
+
+template <>
+Hierarchy::BasicHierarchy(const SimConfig& config)
+    : config(config)
+    , machine()
+    , dram(GiB(8), config.block_size, dram_time_penalty, mW(800), W(4), dram_transfer_penalty, machine)
+    , l2(config.l2_capacity, config.l2_associativity, config.block_size, l2_time_penalty, mW(800), W(2), l2_transfer_penalty, L2_FLAGS, machine, &dram, config.policy)
+    , write_buffer(l2, config.write_buffer_depth, config.drain_policy, config.block_size, l2_time_penalty, mW(50), mW(100), machine)
+    , l1d(L1_CAPACITY, L1_ASSOCIATIVITY, config.block_size, l1_time_penalty, mW(500), W(1), l1_transfer_penalty, L1_FLAGS, machine,
+        config.write_buffer_depth ? static_cast<Cache*>(&write_buffer) : &l2, config.policy)
+    , l1i(L1_CAPACITY, L1_ASSOCIATIVITY, config.block_size, l1_time_penalty, mW(500), W(1), l1_transfer_penalty, L1_FLAGS, machine, &l2, config.policy)
+    , window_stall_time(0)
+    , fetch_stall_time(0)
+    , retire_times(config.window, 0)
+    , window_pos(0)
+    , last_retire_time(0)
+{
+    this->machine.add_cache(&this->dram);
+    this->machine.add_cache(&this->l2);
+    this->machine.add_cache(&this->l1d);
+    this->machine.add_cache(&this->l1i);
+    if (this->write_buffer.is_enabled()) {
+        this->machine.add_cache(&this->write_buffer);
+    }
+    if (config.dram.channels) {
+        this->dram.set_dram_model(new DramModel(config.dram, config.block_size));
     }
+    this->l2.set_prefetcher(make_prefetcher(config.l2_prefetcher));
+    this->l1d.set_prefetcher(make_prefetcher(config.l1_prefetcher));
+    this->l1i.set_prefetcher(make_prefetcher(config.l1_prefetcher));
+    if (this->is_non_blocking()) {
+        this->l2.set_mshrs(config.l2_mshrs);
+        this->l1d.set_mshrs(config.l1_mshrs);
+        this->l1i.set_mshrs(config.l1_mshrs);
+    }
+}
 
-    Machine machine = Machine();
+template <>
+ProductionHierarchy::BasicHierarchy(const SimConfig& config)
+    : config(config)
+    , machine()
+    , dram(GiB(8), config.block_size, dram_time_penalty, mW(800), W(4), dram_transfer_penalty, machine)
+    , l2(l2_time_penalty, mW(800), W(2), l2_transfer_penalty, machine, dram)
+    , write_buffer(l2, 0, EAGER_DRAIN, config.block_size, l2_time_penalty, mW(50), mW(100), machine)
+    , l1d(l1_time_penalty, mW(500), W(1), l1_transfer_penalty, machine, l2)
+    , l1i(l1_time_penalty, mW(500), W(1), l1_transfer_penalty, machine, l2)
+    , window_stall_time(0)
+    , fetch_stall_time(0)
+    , retire_times()
+    , window_pos(0)
+    , last_retire_time(0)
+{
+    assert(is_production_config(config));
+    this->machine.add_cache(&this->dram);
+    this->machine.add_cache(&this->l2);
+    this->machine.add_cache(&this->l1d);
+    this->machine.add_cache(&this->l1i);
+}
 
-    Time l1_time_penalty = ps(500); 
-    Time l2_time_penalty = ns(5) - l1_time_penalty; 
-    Time dram_time_penalty = ns(50) - l2_time_penalty; 
+template <typename L2, typename L1>
+void BasicHierarchy<L2, L1>::step(const Instruction& ins) {
+    if (this->is_non_blocking()) {
+        this->step_out_of_order(ins);
+        return;
+    }
+    PROFILE_SCOPE(PHASE_ACCESS);
+    // Switch based on operation from parser.
+    // Call into the Memory Controller to handle everything.
+    switch (ins.op) {
+        case READ: {
+            #ifndef NDEBUG
+            printf("read!\n");
+            #endif
+            
+            this->l1d.read(ins.address);
+            break;
+        }
 
-    Joule l1_transfer_penalty = J(0);
-    Joule l2_transfer_penalty = pJ(5) - l1_transfer_penalty;
-    Joule dram_transfer_penalty = pJ(640) - l2_transfer_penalty;
+        case WRITE: {
+            #ifndef NDEBUG
+            printf("write!\n");
+            #endif
+            this->l1d.write(ins.address, ins.value);
+            break;
+        }
 
-    CacheFlags dram_flags = 0;
-    CacheFlags l2_flags = CacheFlagBits::ASYNC_WRITE | CacheFlagBits::WRITE_BACK;
-    CacheFlags l1_flags = CacheFlagBits::SYNC_WRITE | CacheFlagBits::WRITE_THROUGH;
+        case FETCH: {
+            #ifndef NDEBUG
+            printf("fetch!\n");
+            #endif
+            this->l1i.read(ins.address);
+            break;
+        }
 
-    Cache dram = Cache(GiB(8), 1, 64, dram_time_penalty, mW(800), W(4), dram_transfer_penalty, dram_flags, machine, nullptr);
-    Cache l2 = Cache(KiB(256), a_l2, 64, l2_time_penalty, mW(800), W(2), l2_transfer_penalty, l2_flags, machine, &dram);
-    Cache l1d = Cache(KiB(32), 1, 64, l1_time_penalty, mW(500), W(1), l1_transfer_penalty, l1_flags, machine, &l2);
-    Cache l1i = Cache(KiB(32), 1, 64, l1_time_penalty, mW(500), W(1), l1_transfer_penalty, l1_flags, machine, &l2);
+        case IGNORE: {
+            #ifndef NDEBUG
+            printf("ignore!\n");
+            #endif
+            break;
+        }
 
-    machine.caches.push_back(&dram);
-    machine.caches.push_back(&l2);
-    machine.caches.push_back(&l1d);
-    machine.caches.push_back(&l1i);
-    
-    trace.next_instr();
-    while (trace.has_next_instr) {
-        // Switch based on operation from parser.
-        // Call into the Memory Controller to handle everything.
-        switch (trace.instruction.op) {
-            case READ: {
-                #ifndef NDEBUG
-                printf("read!\n");
-                #endif
-                
-                l1d.read(trace.instruction.address);
-                break;
-            }
+        case FLUSH: { 
+            printf("This is a flush! This case should never be tested!. \
+                something has gone horribly wrong!\n");
+            break;
+        }
 
-            case WRITE: {
-                #ifndef NDEBUG
-                printf("write!\n");
-                #endif
-                l1d.write(trace.instruction.address, trace.instruction.value);
-                break;
-            }
+    }
 
-            case FETCH: {
-                #ifndef NDEBUG
-                printf("fetch!\n");
-                #endif
-                l1i.read(trace.instruction.address);
-                break;
-            }
+    // NOTE(Nate): Not sure from here
+    // Choosing to assume that cycle penalty always applies on cache access
+    // if (!machine.waited_this_access) {
+    this->machine.advance_time(CYCLE_TIME);
+    // }
+    // machine.waited_this_access = false;
+    // NOTE(Nate): To here. Because of writes.
+}
 
-            case IGNORE: {
-                #ifndef NDEBUG
-                printf("ignore!\n");
-                #endif
-                break;
+template <typename L2, typename L1>
+void BasicHierarchy<L2, L1>::step_out_of_order(const Instruction& ins) {
+    PROFILE_SCOPE(PHASE_ACCESS);
+    if (ins.op != READ && ins.op != WRITE && ins.op != FETCH) {
+        if (ins.op == FLUSH) {
+            printf("This is a flush! This case should never be tested!. \
+                something has gone horribly wrong!\n");
+        }
+        this->machine.advance_time(CYCLE_TIME);
+        return;
+    }
+    // The record takes the place of the oldest in the window, which has to
+    // retire first
+    Time& retire_time = this->retire_times[this->window_pos];
+    if (retire_time > this->machine.time) {
+        this->window_stall_time += retire_time - this->machine.time;
+        this->machine.advance_time(retire_time - this->machine.time);
+    }
+    const u64 set_index = this->l1d.set_index_of(ins.address);
+    const u64 tag = this->l1d.tag_of(ins.address);
+    Time done;
+    switch (ins.op) {
+        case READ: done = this->l1d.issue_at(ins.address, false, set_index, tag); break;
+        case WRITE: done = this->l1d.issue_at(ins.address, true, set_index, tag); break;
+        default: {
+            done = this->l1i.issue_at(ins.address, false, set_index, tag);
+            // Anything slower than an L1 hit missed
+            if (done > this->machine.time + l1_time_penalty) {
+                this->fetch_stall_time += done - this->machine.time;
+                this->machine.advance_time(done - this->machine.time);
             }
+            break;
+        }
+    }
+    this->last_retire_time = std::max(this->last_retire_time, done);
+    retire_time = this->last_retire_time;
+    this->window_pos = (this->window_pos + 1) % this->retire_times.size();
+    this->machine.advance_time(CYCLE_TIME);
+}
 
-            case FLUSH: { 
-                printf("This is a flush! This case should never be tested!. \
-                    something has gone horribly wrong!\n");
-                break;
+// Records decoded at a time by access_batch, and how far ahead of the
+// record being simulated its L2 set is prefetched. Prefetching only pays
+// once the L2 outgrows the host's caches; below that it costs more than it
+// saves, and the L1s always fit.
+const size_t DECODE_CHUNK_LEN = 256;
+const size_t PREFETCH_DISTANCE = 8;
+const u64 PREFETCH_MIN_FOOTPRINT = MiB(1);
+
+template <typename L2, typename L1>
+void BasicHierarchy<L2, L1>::access_batch(const Instruction* ins, size_t len) {
+    if (this->is_non_blocking()) {
+        for (size_t i = 0; i < len; i++) {
+            this->step_out_of_order(ins[i]);
+        }
+        return;
+    }
+    // Both L1s have the same geometry, so one decode serves either
+    u64 l1_set[DECODE_CHUNK_LEN];
+    u64 l1_tag[DECODE_CHUNK_LEN];
+    u64 l2_set[DECODE_CHUNK_LEN];
+    const bool prefetch_l2 = this->l2.footprint() > PREFETCH_MIN_FOOTPRINT;
+    for (size_t chunk = 0; chunk < len; chunk += DECODE_CHUNK_LEN) {
+        const size_t chunk_len = std::min(len - chunk, DECODE_CHUNK_LEN);
+        const Instruction* const chunk_ins = ins + chunk;
+        for (size_t i = 0; i < chunk_len; i++) {
+            l1_set[i] = this->l1d.set_index_of(chunk_ins[i].address);
+            l1_tag[i] = this->l1d.tag_of(chunk_ins[i].address);
+            l2_set[i] = this->l2.set_index_of(chunk_ins[i].address);
+        }
+        for (size_t i = 0; prefetch_l2 && i < std::min(chunk_len, PREFETCH_DISTANCE); i++) {
+            this->l2.prefetch_set(l2_set[i]);
+        }
+
+        for (size_t i = 0; i < chunk_len; i++) {
+            if (prefetch_l2 && i + PREFETCH_DISTANCE < chunk_len) {
+                this->l2.prefetch_set(l2_set[i + PREFETCH_DISTANCE]);
             }
 
+            PROFILE_SCOPE(PHASE_ACCESS);
+            const Instruction& cur = chunk_ins[i];
+            switch (cur.op) {
+                case READ: this->l1d.read_at(cur.address, l1_set[i], l1_tag[i]); break;
+                case WRITE: this->l1d.write_at(cur.address, cur.value, l1_set[i], l1_tag[i]); break;
+                case FETCH: this->l1i.read_at(cur.address, l1_set[i], l1_tag[i]); break;
+                case IGNORE: break;
+                case FLUSH:
+                    printf("This is a flush! This case should never be tested!. \
+                        something has gone horribly wrong!\n");
+                    break;
+            }
+            this->machine.advance_time(CYCLE_TIME);
         }
+    }
+}
+
+template <typename L2, typename L1>
+void BasicHierarchy<L2, L1>::warm(const Instruction& ins) {
+    switch (ins.op) {
+        case READ: this->l1d.warm(ins.address, false); break;
+        case WRITE: this->l1d.warm(ins.address, true); break;
+        case FETCH: this->l1i.warm(ins.address, false); break;
+        default: break;
+    }
+}
 
-        // NOTE(Nate): Not sure from here
-        // Choosing to assume that cycle penalty always applies on cache access
-        // if (!machine.waited_this_access) {
-        machine.advance_time(CYCLE_TIME);
-        // }
-        // machine.waited_this_access = false;
-        // NOTE(Nate): To here. Because of writes.
-        trace.next_instr();
+template <typename L2, typename L1>
+void BasicHierarchy<L2, L1>::finish() {
+    if (this->last_retire_time > this->machine.time) {
+        this->machine.advance_time(this->last_retire_time - this->machine.time);
     }
-    machine.in_flight_queue.flush();
+    if (this->write_buffer.is_enabled()) {
+        this->write_buffer.flush();
+    }
+    this->dram.flush();
+    this->machine.drain();
+}
+
+void appendf(std::string& dst, const char* format, ...) {
+    char buf[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    dst.append(buf, len < static_cast<int>(sizeof(buf)) ? len : sizeof(buf) - 1);
+}
+
+void append_csv_row(std::string& csv, const char* name, Cache& cache) {
+    appendf(csv, "%s,%lu,%lu,%lu,%lu,%lu,%s,%s\n", name,
+        cache.read_hits, cache.read_misses, cache.write_hits, cache.write_misses, cache.dirty_evict_count, unit_to_string(cache.active_time(), 's', -12).c_str(), unit_to_string(cache.calc_energy(), 'J', -15).c_str());
+}
+
+// Useful prefetches over all prefetches; over the misses there would have
+// been without them; and the fraction of them that arrived before they were
+// needed
+static void prefetch_rates(const Cache& cache, double& accuracy, double& coverage, double& timeliness) {
+    const u64 demand_misses = cache.read_misses + cache.write_misses;
+    accuracy = cache.prefetches_issued ? static_cast<double>(cache.prefetch_hits) / cache.prefetches_issued : 0.0;
+    coverage = cache.prefetch_hits + demand_misses ?
+        static_cast<double>(cache.prefetch_hits) / (cache.prefetch_hits + demand_misses) : 0.0;
+    timeliness = cache.prefetch_hits ?
+        static_cast<double>(cache.prefetch_hits - cache.late_prefetches) / cache.prefetch_hits : 0.0;
+}
+
+void append_prefetch_csv_row(std::string& csv, const char* name, Cache& cache) {
+    double accuracy, coverage, timeliness;
+    prefetch_rates(cache, accuracy, coverage, timeliness);
+    appendf(csv, "%s,%lu,%lu,%lu,%lu,%.6f,%.6f,%.6f\n", name, cache.prefetches_issued, cache.prefetch_hits,
+        cache.late_prefetches, cache.unused_prefetches, accuracy, coverage, timeliness);
+}
+
+void append_prefetch_table_row(std::string& table, const char* name, Cache& cache) {
+    double accuracy, coverage, timeliness;
+    prefetch_rates(cache, accuracy, coverage, timeliness);
+    appendf(table, "%-7s%7lu %7lu %7lu %7lu %8.4f %8.4f %10.4f\n", name, cache.prefetches_issued, cache.prefetch_hits,
+        cache.late_prefetches, cache.unused_prefetches, accuracy, coverage, timeliness);
+}
+
+void append_mshr_csv_row(std::string& csv, const char* name, Cache& cache) {
+    appendf(csv, "%s,%lu,%lu,%s\n", name, cache.mshr_merges, cache.mshr_full,
+        unit_to_string(cache.mshr_wait_time, 's', -12).c_str());
+}
 
-    // // We're done print contents
-    Time total_time = machine.time;
+void append_mshr_table_row(std::string& table, const char* name, Cache& cache) {
+    appendf(table, "%-7s%7lu %8lu %28s\n", name, cache.mshr_merges, cache.mshr_full,
+        unit_to_string(cache.mshr_wait_time, 's', -12).c_str());
+}
+
+static void append_write_buffer_csv(std::string& csv, WriteBuffer& buffer) {
+    appendf(csv, "Write buffer: depth %lu drain %s\n", buffer.depth, write_drain_policy_name(buffer.drain_policy));
+    csv += "Writes, Coalesced, Drains, Full_Stalls, Stall_Time, Read_Waits, Read_Wait_Time, Time_Active, Energy_Used\n";
+    appendf(csv, "%lu,%lu,%lu,%lu,%s,%lu,%s,%s,%s\n", buffer.buffered_writes, buffer.coalesced_writes,
+        buffer.drains, buffer.full_stalls, unit_to_string(buffer.stall_time, 's', -12).c_str(), buffer.read_waits,
+        unit_to_string(buffer.read_wait_time, 's', -12).c_str(), unit_to_string(buffer.active_time(), 's', -12).c_str(),
+        unit_to_string(buffer.calc_energy(), 'J', -15).c_str());
+}
+
+static void append_dram_csv(std::string& csv, const DramModel& model) {
+    appendf(csv, "DRAM model: %s row, channels %lu ranks %lu banks %lu\n", row_policy_name(model.config.row_policy),
+        model.config.channels, model.config.ranks, model.config.banks);
+    csv += "Row_Hits, Row_Misses, Row_Conflicts, Activations, Reads, Writes, Refreshes, Forwarded_Reads, Write_Drains\n";
+    appendf(csv, "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", model.row_hits, model.row_misses, model.row_conflicts,
+        model.activations, model.reads, model.writes, model.refreshes, model.forwarded_reads, model.write_drains);
+}
+
+static void append_dram_table(std::string& table, const DramModel& model) {
+    const u64 accesses = model.row_hits + model.row_misses + model.row_conflicts;
+    appendf(table, "\nDRAM: %s row, %lu channels of %lu ranks of %lu banks\n", row_policy_name(model.config.row_policy),
+        model.config.channels, model.config.ranks, model.config.banks);
+    appendf(table, "Row hits: %lu (%.2f%%)\nRow misses: %lu\nRow conflicts: %lu\n", model.row_hits,
+        accesses ? 100.0 * model.row_hits / accesses : 0.0, model.row_misses, model.row_conflicts);
+    appendf(table, "Activations: %lu\nReads: %lu (%lu more from the write queue)\nWrites: %lu in %lu drains\nRefreshes: %lu\n",
+        model.activations, model.reads, model.forwarded_reads, model.writes, model.write_drains, model.refreshes);
+}
+
+static void append_write_buffer_table(std::string& table, WriteBuffer& buffer) {
+    appendf(table, "\nWrite buffer: %lu entries, %s drain\n", buffer.depth, write_drain_policy_name(buffer.drain_policy));
+    appendf(table, "Writes: %lu (%lu coalesced, %.2f%%)\nDrains: %lu\n", buffer.buffered_writes,
+        buffer.coalesced_writes, buffer.buffered_writes ? 100.0 * buffer.coalesced_writes / buffer.buffered_writes : 0.0,
+        buffer.drains);
+    appendf(table, "Full stalls: %lu for %s\nRead waits: %lu for %s\n", buffer.full_stalls,
+        unit_to_string(buffer.stall_time, 's', -12).c_str(), buffer.read_waits,
+        unit_to_string(buffer.read_wait_time, 's', -12).c_str());
+    appendf(table, "Time active: %s\nEnergy used: %s\n", unit_to_string(buffer.active_time(), 's', -12).c_str(),
+        unit_to_string(buffer.calc_energy(), 'J', -15).c_str());
+}
+
+void append_table_row(std::string& table, const char* name, Cache& cache) {
+    appendf(table, "%-7s%7lu %7lu %7lu %7lu %12lu %28s %28s\n", name,
+        cache.read_hits, cache.read_misses, cache.write_hits, cache.write_misses, cache.dirty_evict_count, unit_to_string(cache.active_time(), 's', -12).c_str(), unit_to_string(cache.calc_energy(), 'J', -15).c_str());
+}
+
+template <typename L2, typename L1>
+Joule BasicHierarchy<L2, L1>::total_energy() {
     Joule total_energy = 0;
-    for (Cache* cache : machine.caches) {
+    for (Cache* cache : this->machine.caches) {
         total_energy += cache->calc_energy();
     }
+    return total_energy;
+}
+
+// Geometry other than the L2 associativity is only spelled out when it
+// differs from the default, so existing results.csv readers keep working.
+template <typename L2, typename L1>
+bool BasicHierarchy<L2, L1>::is_default_geometry() const {
+    return this->config.l2_capacity == DEFAULT_CONFIG.l2_capacity &&
+        this->config.block_size == DEFAULT_CONFIG.block_size;
+}
+
+template <typename L2, typename L1>
+bool BasicHierarchy<L2, L1>::has_prefetchers() const {
+    return this->config.l1_prefetcher != NO_PREFETCHER || this->config.l2_prefetcher != NO_PREFETCHER;
+}
+
+template <typename L2, typename L1>
+bool BasicHierarchy<L2, L1>::is_non_blocking() const {
+    return this->config.l1_mshrs > 0;
+}
+
+template <typename L2, typename L1>
+std::string BasicHierarchy<L2, L1>::csv_results(const char* trace_name) {
+    std::string csv;
+    appendf(csv, "File: %s assoc: %lu", trace_name, this->config.l2_associativity);
+    if (!this->is_default_geometry()) {
+        appendf(csv, " l2_size: %lu block_size: %lu", this->config.l2_capacity, this->config.block_size);
+    }
+    if (this->config.policy != DEFAULT_CONFIG.policy) {
+        appendf(csv, " policy: %s", replacement_policy_name(this->config.policy));
+    }
+    appendf(csv, "\nTime: %s\nEnergy: %s\n",
+        unit_to_string(this->machine.time, 's', -12).c_str(),
+        unit_to_string(this->total_energy(), 'J', -15).c_str());
+    csv += CSV_HEADER;
+    for (const Row& row : this->rows()) {
+        append_csv_row(csv, row.name, row.cache);
+    }
+    if (this->has_prefetchers()) {
+        appendf(csv, "Prefetchers: L1 %s L2 %s\n", prefetcher_name(this->config.l1_prefetcher),
+            prefetcher_name(this->config.l2_prefetcher));
+        csv += PREFETCH_CSV_HEADER;
+        for (const Row& row : this->rows()) {
+            if (row.cache.has_prefetcher()) {
+                append_prefetch_csv_row(csv, row.name, row.cache);
+            }
+        }
+    }
+    if (this->is_non_blocking()) {
+        appendf(csv, "Non-blocking: L1 MSHRs %lu L2 MSHRs %lu window %lu\nWindow_Stall: %s\nFetch_Stall: %s\n",
+            this->config.l1_mshrs, this->config.l2_mshrs, this->config.window,
+            unit_to_string(this->window_stall_time, 's', -12).c_str(),
+            unit_to_string(this->fetch_stall_time, 's', -12).c_str());
+        csv += MSHR_CSV_HEADER;
+        for (const Row& row : this->rows()) {
+            if (row.cache.is_non_blocking()) {
+                append_mshr_csv_row(csv, row.name, row.cache);
+            }
+        }
+    }
+    if (this->write_buffer.is_enabled()) {
+        append_write_buffer_csv(csv, this->write_buffer);
+    }
+    if (this->dram.dram_model()) {
+        append_dram_csv(csv, *this->dram.dram_model());
+    }
+    return csv;
+}
+
+template <typename L2, typename L1>
+std::string BasicHierarchy<L2, L1>::table_results(const char* trace_name) {
+    std::string table;
+    appendf(table, "\nRun complete!\nTime: %s\nEnergy: %s\n\n", 
+        unit_to_string(this->machine.time, 's', -12).c_str(),
+        unit_to_string(this->total_energy(), 'J', -15).c_str()
+    );
+    appendf(table, "File: %s\nL2 associativity: %lu\n", trace_name, this->config.l2_associativity);
+    if (!this->is_default_geometry()) {
+        appendf(table, "L2 size: %lu\nBlock size: %lu\n", this->config.l2_capacity, this->config.block_size);
+    }
+    if (this->config.policy != DEFAULT_CONFIG.policy) {
+        appendf(table, "Replacement: %s\n", replacement_policy_name(this->config.policy));
+    }
+    table += TABLE_HEADER;
+    for (const Row& row : this->rows()) {
+        append_table_row(table, row.name, row.cache);
+    }
+    if (this->has_prefetchers()) {
+        appendf(table, "\nPrefetchers: L1 %s, L2 %s\n", prefetcher_name(this->config.l1_prefetcher),
+            prefetcher_name(this->config.l2_prefetcher));
+        table += PREFETCH_TABLE_HEADER;
+        for (const Row& row : this->rows()) {
+            if (row.cache.has_prefetcher()) {
+                append_prefetch_table_row(table, row.name, row.cache);
+            }
+        }
+    }
+    if (this->is_non_blocking()) {
+        appendf(table, "\nNon-blocking: L1 MSHRs %lu, L2 MSHRs %lu, window %lu\nWindow stalls: %s\nFetch stalls: %s\n",
+            this->config.l1_mshrs, this->config.l2_mshrs, this->config.window,
+            unit_to_string(this->window_stall_time, 's', -12).c_str(),
+            unit_to_string(this->fetch_stall_time, 's', -12).c_str());
+        table += MSHR_TABLE_HEADER;
+        for (const Row& row : this->rows()) {
+            if (row.cache.is_non_blocking()) {
+                append_mshr_table_row(table, row.name, row.cache);
+            }
+        }
+    }
+    if (this->write_buffer.is_enabled()) {
+        append_write_buffer_table(table, this->write_buffer);
+    }
+    if (this->dram.dram_model()) {
+        append_dram_table(table, *this->dram.dram_model());
+    }
+    return table;
+}
+
+template <typename L2, typename L1>
+void BasicHierarchy<L2, L1>::report(const char* trace_name) {
+    PROFILE_SCOPE(PHASE_REPORT);
     // Note that you'd have to manually flush out the results. We want it to be a running average for data collection!
-    // Line 129 was written by Google Bard.
     std::ofstream result_csv("results.csv", std::ios::app);
-    result_csv << "File: " << argv[2] << " assoc: " << a_l2 << "\n";
-
-    result_csv << "Time: " << unit_to_string(total_time, 's', -12).c_str() << "\n";
-    result_csv << "Energy: " << unit_to_string(total_energy, 'J', -15).c_str() << "\n";
-    result_csv << "Cache, RHits, RMiss, WHits, WMiss, Dirty_Evicts, Time_Active, Energy_Used\n";
-    result_csv << "L1d," << l1d.read_hits << "," << l1d.read_misses << "," << l1d.write_hits << "," << l1d.write_misses << "," << l1d.dirty_evict_count << "," << unit_to_string(l1d.active_time, 's', -12).c_str() << "," << unit_to_string(l1d.calc_energy(), 'J', -15).c_str() << "\n";
-    result_csv << "L1i," << l1i.read_hits << "," << l1i.read_misses << "," << l1i.write_hits << "," << l1i.write_misses << "," << l1i.dirty_evict_count << "," << unit_to_string(l1i.active_time, 's', -12).c_str() << "," << unit_to_string(l1i.calc_energy(), 'J', -15).c_str()<< "\n";
-    result_csv << "L2," << l1i.read_hits << "," << l1i.read_misses << "," << l1i.write_hits << "," << l1i.write_misses << "," << l1i.dirty_evict_count << "," << unit_to_string(l1i.active_time, 's', -12).c_str() << "," << unit_to_string(l1i.calc_energy(), 'J', -15).c_str()<< "\n";
-    result_csv << "DRAM," << dram.read_hits << "," << dram.read_misses << "," << dram.write_hits << "," << dram.write_misses << "," << dram.dirty_evict_count << "," << unit_to_string(dram.active_time, 's', -12).c_str() << "," << unit_to_string(dram.calc_energy(), 'J', -15).c_str()<< "\n";
-    printf("\nRun complete!\nTime: %s\nEnergy: %s\n\n", 
-        unit_to_string(total_time, 's', -12).c_str(),
-        unit_to_string(total_energy, 'J', -15).c_str()
-    );
-    printf("File: %s\nL2 associativity: %d\n", argv[2], a_l2);
-    printf("\
-Cache    RHits   RMiss   WHits   WMiss Dirty_Evicts                  Time_Active                  Energy_Used\n\
-L1d    %7lu %7lu %7lu %7lu %12lu %28s %28s\n\
-L1i    %7lu %7lu %7lu %7lu %12lu %28s %28s\n\
-L2     %7lu %7lu %7lu %7lu %12lu %28s %28s\n\
-DRAM   %7lu %7lu %7lu %7lu %12lu %28s %28s\n",
-        l1d.read_hits, l1d.read_misses, l1d.write_hits, l1d.write_misses, l1d.dirty_evict_count, unit_to_string(l1d.active_time, 's', -12).c_str(), unit_to_string(l1d.calc_energy(), 'J', -15).c_str(),
-        l1i.read_hits, l1i.read_misses, l1i.write_hits, l1i.write_misses, l1i.dirty_evict_count, unit_to_string(l1i.active_time, 's', -12).c_str(), unit_to_string(l1i.calc_energy(), 'J', -15).c_str(),
-        l2.read_hits, l2.read_misses, l2.write_hits, l2.write_misses, l2.dirty_evict_count, unit_to_string(l2.active_time, 's', -12).c_str(), unit_to_string(l2.calc_energy(), 'J', -15).c_str(),
-        dram.read_hits, dram.read_misses, dram.write_hits, dram.write_misses, dram.dirty_evict_count, unit_to_string(dram.active_time, 's', -12).c_str(), unit_to_string(dram.calc_energy(), 'J', -15).c_str()
-    );
+    result_csv << this->csv_results(trace_name);
+    fputs(this->table_results(trace_name).c_str(), stdout);
+}
+
+template struct BasicHierarchy<Cache, Cache>;
+template struct BasicHierarchy<ProductionL2, ProductionL1>;
+
+// Number of records decoded at a time and fed to every hierarchy in turn.
+const size_t SWEEP_BATCH_LEN = 4096;
+
+// Run every hierarchy (or its sampler, when sampling) over the trace, up to
+// record until or the end of the trace, whichever comes first. Stopping
+// early leaves the trace just past the last record simulated, to be carried
+// on from by another call; reaching the end finishes the hierarchies.
+// Samples them into intervals as they go, if given. Returns the time taken
+// in seconds.
+//
+// A batch of records is decoded once, then each hierarchy is run over the
+// whole batch before moving on to the next one, so each hierarchy's state
+// stays warm in the host caches.
+template <typename H>
+static double simulate(Trace& trace, const std::vector<H*>& hierarchies, const std::vector<Sampler*>& samplers,
+    u64 until = ~0UL, IntervalLog* intervals = nullptr) {
+    const bool is_sampled = !samplers.empty();
+    std::vector<Instruction> batch(SWEEP_BATCH_LEN);
+    const auto run_start = std::chrono::steady_clock::now();
+    // A record period sample due at the end of a batch waits until the next
+    // batch has been read. If the trace has ended by then, the sample taken
+    // after finish() stands in for it, rather than a second row at the same
+    // record count.
+    bool is_sample_pending = false;
+    while (trace.has_next_instr && trace.last_ins < until) {
+        u64 batch_limit = std::min<u64>(SWEEP_BATCH_LEN, until - trace.last_ins);
+        if (intervals) {
+            batch_limit = std::min(batch_limit, intervals->records_until_sample(trace.last_ins));
+        }
+        size_t batch_len = 0;
+        while (batch_len < batch_limit) {
+            trace.next_instr();
+            if (!trace.has_next_instr) {
+                break;
+            }
+            batch[batch_len++] = trace.instruction;
+        }
+        if (is_sample_pending && batch_len > 0) {
+            for (size_t h = 0; h < hierarchies.size(); h++) {
+                intervals->sample(h, trace.last_ins - batch_len, *hierarchies[h]);
+            }
+            is_sample_pending = false;
+        }
+        for (size_t h = 0; h < hierarchies.size(); h++) {
+            if (is_sampled) {
+                for (size_t i = 0; i < batch_len; i++) {
+                    samplers[h]->step(batch[i]);
+                }
+                continue;
+            }
+            if (intervals && intervals->spec.is_time) {
+                // Time can only be checked between records
+                const u64 first = trace.last_ins - batch_len;
+                for (size_t i = 0; i < batch_len; i++) {
+                    hierarchies[h]->step(batch[i]);
+                    if (intervals->is_sample_due(h, first + i + 1, hierarchies[h]->machine.time)) {
+                        intervals->sample(h, first + i + 1, *hierarchies[h]);
+                    }
+                }
+                continue;
+            }
+            hierarchies[h]->access_batch(&batch[0], batch_len);
+        }
+        is_sample_pending = intervals && !intervals->spec.is_time && !is_sampled && batch_len > 0 &&
+            intervals->is_sample_due(0, trace.last_ins, 0);
+    }
+    if (!trace.has_next_instr) {
+        for (size_t h = 0; h < hierarchies.size(); h++) {
+            hierarchies[h]->finish();
+            if (intervals) {
+                intervals->sample(h, trace.last_ins, *hierarchies[h]);
+            }
+        }
+    } else if (is_sample_pending) {
+        for (size_t h = 0; h < hierarchies.size(); h++) {
+            intervals->sample(h, trace.last_ins, *hierarchies[h]);
+        }
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+}
+
+// Replay the L1s' requests to the L2 from stream_name into every
+// configuration, recording them there first if it isn't up to date
+static int run_from_l1_stream(char* trace_name, const char* stream_name, const std::vector<SimConfig>& configs) {
+    L1Stream stream;
+    if (!load_l1_stream(stream_name, trace_name, configs[0].block_size, stream)) {
+        if (!record_l1_stream(trace_name, configs[0].block_size, stream)) {
+            return -1;
+        }
+        if (!write_l1_stream(stream_name, stream)) {
+            printf("error: can't write L1 stream %s\n", stream_name);
+            return -1;
+        }
+        printf("L1 stream: %lu requests from %lu records recorded to %s\n", stream.header.num_requests,
+            stream.header.records, stream_name);
+    }
+
+    std::vector<Hierarchy*> hierarchies;
+    for (const SimConfig& config : configs) {
+        hierarchies.push_back(new Hierarchy(config));
+    }
+    const double run_seconds = replay_l1_stream(stream, hierarchies);
+    for (Hierarchy* hierarchy : hierarchies) {
+        hierarchy->report(trace_name);
+        delete hierarchy;
+    }
+    const u64 records = stream.header.records;
+    printf("Records: %lu in %.3f s (%.0f records/s)\n", records, run_seconds,
+        run_seconds > 0 ? records / run_seconds : 0.0);
+    if (configs.size() > 1) {
+        printf("Configurations: %zu (%.0f simulated records/s)\n", configs.size(),
+            run_seconds > 0 ? records * configs.size() / run_seconds : 0.0);
+    }
+    profile_report(trace_name, records, records * configs.size());
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && strcmp(argv[1], "--convert") == 0) {
+        return convert_main(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0) {
+        return batch_main(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--stackdist") == 0) {
+        return stackdist_main(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--multicore") == 0) {
+        return multicore_main(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+        return bench_main(argc, argv);
+    }
+
+    const char* usage = "Usage: csim -f <required, file name of trace> \n-a <associativity level; 1 to 8; blank for default>\n-r <replacement policy: random, lru, plru, bitplru, srrip or brrip>\n-p <L1 prefetcher>[:<L2 prefetcher>] (none, next, stride, stream or delta)\n-m <L1 MSHRs>[:<L2 MSHRs>] (non-blocking caches)\n-w <records in flight, with -m>\n-b <write buffer entries>[:<drain policy: eager or lazy>]\n--dram <open|closed>[:<channels>:<ranks>:<banks>]\n--sweep <L2 size>:<L2 associativity>[:<block size>][:<policy>][,...]\n--sample <period>:<warmup>:<measure>[:<warming>]\n--checkpoint <records>:<file>\n--restore <file>\n--l1-stream <file>\n--interval <records>|<time>[:<file>]\n   or: csim --batch <batch file> [-j <threads>]\n   or: csim --multicore -f <trace> -f <trace> [...] [-r <policy>] [--config <spec>] [--quantum <cycles>]\n   or: csim --stackdist -f <trace> [--block <size>] [--max-sets <n>] [--max-assoc <n>] [--stream all|data|inst]\n   or: csim --convert <trace> <packed trace> [--keep-values]\n   or: csim --bench [--check] [--baseline <file>] [--checksums <file>] [--update] [--threshold <percent>] [--repeat <n>] [<trace> ...]\n";
+    char* trace_name = nullptr;
+    std::vector<SimConfig> configs;
+    int custom_assoc = 0;
+    bool has_custom_assoc = false;
+    ReplacementPolicy policy = DEFAULT_CONFIG.policy;
+    PrefetcherKind l1_prefetcher = NO_PREFETCHER, l2_prefetcher = NO_PREFETCHER;
+    u64 l1_mshrs = 0, l2_mshrs = 0, window = 0;
+    u64 write_buffer_depth = 0;
+    WriteDrainPolicy drain_policy = EAGER_DRAIN;
+    DramConfig dram = DEFAULT_CONFIG.dram;
+    std::vector<const char*> sweep_specs;
+    bool is_sampled = false;
+    SamplingConfig sampling;
+    u64 checkpoint_records = 0;
+    const char* checkpoint_name = nullptr;
+    const char* restore_name = nullptr;
+    const char* l1_stream_name = nullptr;
+    bool has_intervals = false;
+    IntervalSpec interval_spec;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 == argc) {
+            printf("%s", usage);
+            return -1;
+        }
+        if (strcmp(argv[i], "-f") == 0) {
+            trace_name = argv[++i];
+        } else if (strcmp(argv[i], "-a") == 0) {
+            has_custom_assoc = true;
+            if (strlen(argv[++i]) > 1 || argv[i][0] < '1' || argv[i][0] > '8') {
+                printf("error: please give an associativity from 1 to 8\n");
+                return -1;
+            }
+            custom_assoc = atoi(argv[i]);
+        } else if (strcmp(argv[i], "-r") == 0) {
+            if (!parse_replacement_policy(argv[++i], policy)) {
+                printf("error: unknown replacement policy '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-p") == 0) {
+            char* l2_name = strchr(argv[++i], ':');
+            if (l2_name) {
+                *l2_name++ = '\0';
+            }
+            if (!parse_prefetcher(argv[i], l1_prefetcher) || (l2_name && !parse_prefetcher(l2_name, l2_prefetcher))) {
+                printf("error: unknown prefetcher, expected none, next, stride, stream or delta\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0) {
+            char* end;
+            l1_mshrs = l2_mshrs = strtoull(argv[++i], &end, 10);
+            if (*end == ':') {
+                l2_mshrs = strtoull(end + 1, &end, 10);
+            }
+            if (*end != '\0' || l1_mshrs == 0 || l2_mshrs == 0) {
+                printf("error: bad MSHR counts '%s', expected <L1 MSHRs>[:<L2 MSHRs>]\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-w") == 0) {
+            char* end;
+            window = strtoull(argv[++i], &end, 10);
+            if (*end != '\0' || window == 0) {
+                printf("error: please give a window of at least one record\n");
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-b") == 0) {
+            char* end;
+            write_buffer_depth = strtoull(argv[++i], &end, 10);
+            if (write_buffer_depth == 0 || (*end == ':' && !parse_write_drain_policy(end + 1, drain_policy)) ||
+                (*end != ':' && *end != '\0')) {
+                printf("error: bad write buffer '%s', expected <entries>[:eager|lazy]\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--dram") == 0) {
+            if (!parse_dram_spec(argv[++i], dram)) {
+                printf("error: bad DRAM spec '%s', expected <open|closed>[:<channels>:<ranks>:<banks>]\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--sweep") == 0) {
+            sweep_specs.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "--sample") == 0) {
+            is_sampled = true;
+            if (!parse_sampling_spec(argv[++i], sampling)) {
+                printf("error: bad sampling spec '%s', expected <period>:<warmup>:<measure>[:<warming>]\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--checkpoint") == 0) {
+            if (!parse_checkpoint_spec(argv[++i], checkpoint_records, checkpoint_name)) {
+                printf("error: bad checkpoint spec '%s', expected <records>:<file>\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--restore") == 0) {
+            restore_name = argv[++i];
+        } else if (strcmp(argv[i], "--l1-stream") == 0) {
+            l1_stream_name = argv[++i];
+        } else if (strcmp(argv[i], "--interval") == 0) {
+            has_intervals = true;
+            if (!parse_interval_spec(argv[++i], interval_spec)) {
+                printf("error: bad interval '%s', expected <records>|<time>[ps|ns|us|ms][:<file>]\n", argv[i]);
+                return -1;
+            }
+        } else {
+            printf("%s", usage);
+            return -1;
+        }
+    }
+    if (!trace_name) {
+        printf("%s", usage);
+        return -1;
+    }
+    if (window && !l1_mshrs) {
+        printf("error: -w needs non-blocking caches (-m)\n");
+        return -1;
+    }
+    if (l1_mshrs && !window) {
+        window = DEFAULT_WINDOW;
+    }
+    // Every configuration in a sweep is simulated from one pass over the
+    // trace. They're parsed once all flags are in, so -r can come after.
+    for (const char* sweep : sweep_specs) {
+        for (const char* spec = sweep; spec; spec = strchr(spec, ',') ? strchr(spec, ',') + 1 : nullptr) {
+            SimConfig config;
+            if (!parse_config_spec(spec, config, policy)) {
+                printf("error: bad configuration '%s'\n", spec);
+                return -1;
+            }
+            configs.push_back(config);
+        }
+    }
+    if (configs.empty()) {
+        SimConfig config = DEFAULT_CONFIG;
+        config.l2_associativity = has_custom_assoc ? custom_assoc : 4;
+        config.policy = policy;
+        if (!is_replacement_policy_supported(config.policy, config.l2_associativity)) {
+            printf("error: the %s policy needs a power of two associativity\n", replacement_policy_name(config.policy));
+            return -1;
+        }
+        configs.push_back(config);
+    }
+    for (SimConfig& config : configs) {
+        config.l1_prefetcher = l1_prefetcher;
+        config.l2_prefetcher = l2_prefetcher;
+        config.l1_mshrs = l1_mshrs;
+        config.l2_mshrs = l2_mshrs;
+        config.window = window;
+        config.write_buffer_depth = write_buffer_depth;
+        config.drain_policy = drain_policy;
+        config.dram = dram;
+    }
+    if ((checkpoint_name || restore_name) && is_sampled) {
+        printf("error: --checkpoint and --restore don't work with --sample\n");
+        return -1;
+    }
+    if (checkpoint_name && (configs.size() != 1 || !can_checkpoint(configs[0]))) {
+        printf("error: --checkpoint needs a single configuration without -p, -m, -b or --dram\n");
+        return -1;
+    }
+    if (has_intervals && (is_sampled || l1_stream_name)) {
+        printf("error: --interval doesn't work with --sample or --l1-stream\n");
+        return -1;
+    }
+    if (l1_stream_name) {
+        if (is_sampled || checkpoint_name || restore_name) {
+            printf("error: --l1-stream doesn't work with --sample, --checkpoint or --restore\n");
+            return -1;
+        }
+        for (const SimConfig& config : configs) {
+            if (!can_replay_l1_stream(config) || config.block_size != configs[0].block_size) {
+                printf("error: --l1-stream needs configurations with one block size, no L1 prefetcher, -m or -b\n");
+                return -1;
+            }
+        }
+        profile_start();
+        return run_from_l1_stream(trace_name, l1_stream_name, configs);
+    }
+    
+    profile_start();
+    Trace trace(trace_name);
+
+    if (trace.trace_fd == -1) {
+        printf("error: invalid filename\n");
+        return -1;
+    }
+
+    IntervalLog* intervals = nullptr;
+    if (has_intervals) {
+        intervals = new IntervalLog(interval_spec, configs.size());
+        if (!intervals->is_open()) {
+            printf("error: can't write intervals to %s\n", interval_spec.filename);
+            return -1;
+        }
+    }
+    double run_seconds = 0;
+    u64 start_records = 0;
+    if (!is_sampled && configs.size() == 1 && is_production_config(configs[0]) && !checkpoint_name && !restore_name) {
+        // The default configuration is also built at compile time, which
+        // gives the same results faster.
+        ProductionHierarchy* hierarchy = new ProductionHierarchy(configs[0]);
+        run_seconds = simulate(trace, std::vector<ProductionHierarchy*>{hierarchy}, {}, ~0UL, intervals);
+        if (!trace.read_error.empty()) {
+            return -1;
+        }
+        hierarchy->report(trace_name);
+        delete hierarchy;
+    } else {
+        std::vector<Hierarchy*> hierarchies;
+        std::vector<Sampler*> samplers;
+        for (const SimConfig& config : configs) {
+            hierarchies.push_back(new Hierarchy(config));
+            if (is_sampled) {
+                samplers.push_back(new Sampler(*hierarchies.back(), sampling));
+            }
+        }
+        if (restore_name) {
+            TracePosition position;
+            for (Hierarchy* hierarchy : hierarchies) {
+                if (!restore_checkpoint(restore_name, trace_name, *hierarchy, position)) {
+                    return -1;
+                }
+            }
+            if (!trace.seek(position)) {
+                printf("error: the trace ends before checkpoint %s was taken\n", restore_name);
+                return -1;
+            }
+            start_records = trace.last_ins;
+        }
+        if (checkpoint_name) {
+            run_seconds = simulate(trace, hierarchies, samplers, checkpoint_records, intervals);
+            TracePosition position;
+            trace.tell(position);
+            if (trace.last_ins < checkpoint_records) {
+                printf("error: the trace ends before record %lu, so there is no checkpoint\n", checkpoint_records);
+            } else if (!write_checkpoint(checkpoint_name, trace_name, *hierarchies[0], position)) {
+                printf("error: can't write checkpoint %s\n", checkpoint_name);
+                return -1;
+            }
+        }
+        run_seconds += simulate(trace, hierarchies, samplers, ~0UL, intervals);
+        if (!trace.read_error.empty()) {
+            return -1;
+        }
+        for (size_t i = 0; i < hierarchies.size(); i++) {
+            if (is_sampled) {
+                samplers[i]->report(trace_name);
+                delete samplers[i];
+            } else {
+                hierarchies[i]->report(trace_name);
+            }
+            delete hierarchies[i];
+        }
+    }
+    // Flushes whatever samples are left
+    delete intervals;
+    // Records restored from a checkpoint weren't simulated this time
+    const u64 records = trace.last_ins - start_records;
+    printf("Records: %lu in %.3f s (%.0f records/s)\n", records, run_seconds,
+        run_seconds > 0 ? records / run_seconds : 0.0);
+    if (configs.size() > 1) {
+        printf("Configurations: %zu (%.0f simulated records/s)\n", configs.size(),
+            run_seconds > 0 ? records * configs.size() / run_seconds : 0.0);
+    }
+    profile_report(trace_name, records, records * configs.size());
     return 0;
-}
\ No newline at end of file
+}
@@ -1,3 +1,11 @@
+#pragma once
+#include "cache.hpp"
+#include "cache_level.hpp"
+#include "dram.hpp"
+#include "parser.hpp"
+#include "write_buffer.hpp"
+#include <string>
+
 #define KHz(num) ((num)*1000UL)
 #define MHz(num) (KHz(num)*1000UL)
 #define GHz(num) (MHz(num)*1000UL)
@@ -9,3 +17,148 @@
 using Freq = u64;
 const Freq CLOCK_SPEED = GHz(2);
 const Time CYCLE_TIME = s(1) / CLOCK_SPEED;
+
+// One point in the design space. Everything not listed here (L1 geometry,
+// latencies, power) is fixed.
+struct SimConfig {
+    u64 l2_capacity;
+    u64 l2_associativity;
+    u64 block_size;
+    ReplacementPolicy policy; // Used by every level
+    PrefetcherKind l1_prefetcher; // Used by both L1s
+    PrefetcherKind l2_prefetcher;
+    // Non-blocking caches: MSHRs per L1 and in the L2, and how many records
+    // the core keeps in flight. 0 MSHRs for blocking caches and an in-order
+    // core.
+    u64 l1_mshrs;
+    u64 l2_mshrs;
+    u64 window;
+    // Entries in the write buffer between the L1d and the L2; 0 for none
+    u64 write_buffer_depth;
+    WriteDrainPolicy drain_policy;
+    // Banks and timings behind the DRAM; no channels for a flat latency
+    DramConfig dram;
+};
+
+constexpr SimConfig DEFAULT_CONFIG = {KiB(256), 4, 64, RANDOM, NO_PREFETCHER, NO_PREFETCHER, 0, 0, 0, 0, EAGER_DRAIN,
+    {0, 0, 0, OPEN_ROW}};
+const u64 DEFAULT_WINDOW = 32;
+
+// Parse "<L2 size>:<L2 associativity>[:<block size>][:<policy>]", where the
+// size may carry a K, M or G suffix, e.g. "256K:8", "1M:16:128" or
+// "256K:8:lru". Without a policy in the spec, default_policy is used.
+bool parse_config_spec(const char* spec, SimConfig& config, ReplacementPolicy default_policy = RANDOM);
+
+// The parts of the hierarchy that are the same in every configuration
+const u64 L1_CAPACITY = KiB(32);
+const u64 L1_ASSOCIATIVITY = 1;
+const CacheFlags L2_FLAGS = CacheFlagBits::ASYNC_WRITE | CacheFlagBits::WRITE_BACK;
+const CacheFlags L1_FLAGS = CacheFlagBits::SYNC_WRITE | CacheFlagBits::WRITE_THROUGH;
+
+const Time l1_time_penalty = ps(500);
+const Time l2_time_penalty = ns(5) - l1_time_penalty;
+const Time dram_time_penalty = ns(50) - l2_time_penalty;
+
+const Joule l1_transfer_penalty = J(0);
+const Joule l2_transfer_penalty = pJ(5) - l1_transfer_penalty;
+const Joule dram_transfer_penalty = pJ(640) - l2_transfer_penalty;
+
+// A complete memory hierarchy (L1d and L1i over a shared L2 over DRAM, with
+// a write buffer under the L1d if configured) with its own Machine, so
+// several can be driven side by side from one trace. L2 and L1 are the types
+// of the levels: Cache for any configuration, or a CacheLevel when the
+// configuration is known at compile time.
+template <typename L2, typename L1>
+struct BasicHierarchy {
+    BasicHierarchy(const SimConfig& config);
+
+    const SimConfig config;
+    Machine machine;
+    MainMemory dram;
+    L2 l2;
+    WriteBuffer write_buffer;
+    L1 l1d;
+    L1 l1i;
+
+    // Simulate one trace record, including the cycle it takes to issue.
+    // With non-blocking caches the core issues a record every cycle and
+    // carries on past misses, keeping up to config.window records in
+    // flight. It only stalls when the oldest of those hasn't finished, when
+    // a miss finds every L1 MSHR busy, or on an instruction fetch that
+    // misses, since the records after it depend on it.
+    void step(const Instruction& ins);
+    // step() over a run of records, with the same results. The L1 and L2
+    // sets and tags of every record are worked out in one pass up front.
+    // When the L2 is too big to stay in the host's caches, its set for the
+    // record a few ahead is prefetched, so the host's cache misses on it
+    // overlap with simulating earlier records.
+    void access_batch(const Instruction* ins, size_t len);
+    // Only update cache state for one trace record (see Cache::warm)
+    void warm(const Instruction& ins);
+    // Drain anything still in flight once the trace is done.
+    void finish();
+    // Print the results table and append them to results.csv
+    void report(const char* trace_name);
+    // The same results as report(), as text rather than written out
+    std::string csv_results(const char* trace_name);
+    std::string table_results(const char* trace_name);
+    Joule total_energy();
+
+    // The levels in the order they are reported
+    struct Row {
+        const char* name;
+        Cache& cache;
+    };
+    static const size_t NUM_ROWS = 4;
+
+    // Time the core spent waiting on a full window and on fetch misses
+    Time window_stall_time, fetch_stall_time;
+    std::vector<Row> rows() {
+        return {{"L1d", this->l1d}, {"L1i", this->l1i}, {"L2", this->l2}, {"DRAM", this->dram}};
+    }
+
+private:
+    bool is_default_geometry() const;
+    bool has_prefetchers() const;
+    bool is_non_blocking() const;
+    void step_out_of_order(const Instruction& ins);
+
+    // When each record in the window retires, oldest at window_pos, and
+    // when the latest one does. Records retire in order.
+    std::vector<Time> retire_times;
+    size_t window_pos;
+    Time last_retire_time;
+};
+
+// Any configuration
+using Hierarchy = BasicHierarchy<Cache, Cache>;
+
+// DEFAULT_CONFIG built at compile time, for when per-record throughput
+// matters most. Gives the same results as a Hierarchy of DEFAULT_CONFIG.
+using ProductionL2 = CacheLevel<DEFAULT_CONFIG.l2_capacity, DEFAULT_CONFIG.l2_associativity,
+    DEFAULT_CONFIG.block_size, L2_FLAGS, MainMemory, DEFAULT_CONFIG.policy>;
+using ProductionL1 = CacheLevel<L1_CAPACITY, L1_ASSOCIATIVITY, DEFAULT_CONFIG.block_size,
+    L1_FLAGS, ProductionL2, DEFAULT_CONFIG.policy>;
+using ProductionHierarchy = BasicHierarchy<ProductionL2, ProductionL1>;
+
+// Whether config is the one ProductionHierarchy is built for
+bool is_production_config(const SimConfig& config);
+
+// printf onto the end of a string
+void appendf(std::string& dst, const char* format, ...);
+
+// The per level results, as csv and as a table
+const char* const CSV_HEADER = "Cache, RHits, RMiss, WHits, WMiss, Dirty_Evicts, Time_Active, Energy_Used\n";
+const char* const TABLE_HEADER = "Cache    RHits   RMiss   WHits   WMiss Dirty_Evicts                  Time_Active                  Energy_Used\n";
+void append_csv_row(std::string& csv, const char* name, Cache& cache);
+void append_table_row(std::string& table, const char* name, Cache& cache);
+// Accuracy, coverage and timeliness of a level's prefetcher
+const char* const PREFETCH_CSV_HEADER = "Prefetch, Issued, Useful, Late, Unused, Accuracy, Coverage, Timeliness\n";
+const char* const PREFETCH_TABLE_HEADER = "Cache   Issued  Useful    Late  Unused Accuracy Coverage Timeliness\n";
+void append_prefetch_csv_row(std::string& csv, const char* name, Cache& cache);
+void append_prefetch_table_row(std::string& table, const char* name, Cache& cache);
+// How a non-blocking level's MSHRs coped
+const char* const MSHR_CSV_HEADER = "MSHR, Merges, Full, Wait_Time\n";
+const char* const MSHR_TABLE_HEADER = "Cache    Merges     Full                    Wait_Time\n";
+void append_mshr_csv_row(std::string& csv, const char* name, Cache& cache);
+void append_mshr_table_row(std::string& table, const char* name, Cache& cache);
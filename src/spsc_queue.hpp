@@ -0,0 +1,47 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// A bounded lock-free queue from one producer thread to one consumer thread.
+// The capacity must be a power of two. head and tail only ever grow, and are
+// kept on separate host cache lines so the two threads don't fight over one.
+template <typename T>
+struct SpscQueue {
+    SpscQueue(size_t capacity)
+        : slots(capacity)
+        , mask(capacity - 1)
+        , head(0)
+        , tail(0)
+    {}
+
+    // Producer only. Returns false if the queue is full.
+    bool try_push(const T& item) {
+        const size_t tail = this->tail.load(std::memory_order_relaxed);
+        if (tail - this->head.load(std::memory_order_acquire) == this->slots.size()) {
+            return false;
+        }
+        this->slots[tail & this->mask] = item;
+        this->tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false if the queue is empty.
+    bool try_pop(T& item) {
+        const size_t head = this->head.load(std::memory_order_relaxed);
+        if (head == this->tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = this->slots[head & this->mask];
+        this->head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> slots;
+    const size_t mask;
+    char head_padding[64];
+    std::atomic<size_t> head;
+    char tail_padding[64];
+    std::atomic<size_t> tail;
+};
@@ -0,0 +1,139 @@
+#include "stackdist.hpp"
+#include "cache.hpp"
+#include "parser.hpp"
+#include <cmath>
+#include <cstring>
+
+StackDistanceEngine::StackDistanceEngine(u64 block_size, u64 max_sets, u64 max_assoc)
+    : block_bits(static_cast<u64>(log2(static_cast<double>(block_size))))
+    , max_assoc(max_assoc)
+    , accesses(0)
+    , cold_misses(0)
+    , profiles(static_cast<u64>(log2(static_cast<double>(max_sets))) + 1)
+    , last_access()
+{
+    for (u64 set_bits = 0; set_bits < this->profiles.size(); set_bits++) {
+        this->profiles[set_bits].set_bits = set_bits;
+        this->profiles[set_bits].distance_counts.assign(max_assoc, 0);
+    }
+}
+
+void StackDistanceEngine::access(u64 addr) {
+    const u64 time = ++this->accesses;
+    const u64 block = addr >> this->block_bits;
+    auto last = this->last_access.find(block);
+    const bool is_cold = last == this->last_access.end();
+
+    for (SetProfile& profile : this->profiles) {
+        const u64 set_index = address_set_index(addr, this->block_bits, profile.set_bits);
+        const u64 set_key = set_index << TIME_BITS;
+        if (!is_cold) {
+            // Count the keys in this set newer than the block's last access
+            const u64 last_key = set_key | last->second;
+            const u64 newer = profile.recency.order_of_key(set_key + (1UL << TIME_BITS))
+                - profile.recency.order_of_key(last_key) - 1;
+            if (newer < this->max_assoc) {
+                profile.distance_counts[newer]++;
+            }
+            profile.recency.erase(last_key);
+        }
+        profile.recency.insert(set_key | time);
+    }
+
+    if (is_cold) {
+        this->cold_misses++;
+        this->last_access.emplace(block, time);
+    } else {
+        last->second = time;
+    }
+}
+
+u64 StackDistanceEngine::hits(u64 set_bits, u64 assoc) const {
+    const SetProfile& profile = this->profiles[set_bits];
+    u64 hits = 0;
+    for (u64 distance = 0; distance < assoc && distance < this->max_assoc; distance++) {
+        hits += profile.distance_counts[distance];
+    }
+    return hits;
+}
+
+void StackDistanceEngine::write_csv(FILE* out) const {
+    fprintf(out, "Sets, Assoc, Capacity, Accesses, Hits, Misses, Miss_Rate\n");
+    for (const SetProfile& profile : this->profiles) {
+        for (u64 assoc = 1; assoc <= this->max_assoc; assoc *= 2) {
+            const u64 hits = this->hits(profile.set_bits, assoc);
+            const u64 misses = this->accesses - hits;
+            fprintf(out, "%lu,%lu,%lu,%lu,%lu,%lu,%.6f\n", 1UL << profile.set_bits, assoc,
+                (1UL << profile.set_bits) * assoc << this->block_bits, this->accesses, hits,
+                misses, this->accesses ? static_cast<double>(misses) / this->accesses : 0.0);
+        }
+    }
+}
+
+static bool is_power_of_two(u64 value) {
+    return value && !(value & (value - 1));
+}
+
+int stackdist_main(int argc, char* argv[]) {
+    const char* usage = "Usage: csim --stackdist -f <trace> [--block <size>] [--max-sets <n>] [--max-assoc <n>] [--stream all|data|inst]\n";
+    char* trace_name = nullptr;
+    u64 block_size = 64;
+    u64 max_sets = 4096;
+    u64 max_assoc = 16;
+    bool count_data = true;
+    bool count_inst = true;
+    for (int i = 2; i < argc; i++) {
+        if (i + 1 == argc) {
+            printf("%s", usage);
+            return -1;
+        }
+        if (strcmp(argv[i], "-f") == 0) {
+            trace_name = argv[++i];
+        } else if (strcmp(argv[i], "--block") == 0) {
+            block_size = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--max-sets") == 0) {
+            max_sets = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--max-assoc") == 0) {
+            max_assoc = strtoull(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            const char* stream = argv[++i];
+            count_data = strcmp(stream, "inst") != 0;
+            count_inst = strcmp(stream, "data") != 0;
+            if (strcmp(stream, "all") != 0 && strcmp(stream, "data") != 0 && strcmp(stream, "inst") != 0) {
+                printf("%s", usage);
+                return -1;
+            }
+        } else {
+            printf("%s", usage);
+            return -1;
+        }
+    }
+    // Set indices share a key with 40 bits of access time
+    if (!trace_name || !is_power_of_two(block_size) || !is_power_of_two(max_sets) ||
+        !is_power_of_two(max_assoc) || max_sets > (1UL << 23)) {
+        printf("%s", usage);
+        return -1;
+    }
+
+    Trace trace(trace_name);
+    if (trace.trace_fd == -1) {
+        printf("error: invalid filename\n");
+        return -1;
+    }
+
+    StackDistanceEngine engine(block_size, max_sets, max_assoc);
+    trace.next_instr();
+    while (trace.has_next_instr) {
+        const Instruction& ins = trace.instruction;
+        const bool is_data = ins.op == READ || ins.op == WRITE;
+        if ((is_data && count_data) || (ins.op == FETCH && count_inst)) {
+            engine.access(ins.address);
+        }
+        trace.next_instr();
+    }
+    if (!trace.read_error.empty()) {
+        return -1;
+    }
+    engine.write_csv(stdout);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "shortints.h"
+#include <cstdio>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
+
+// csim --stackdist -f <trace> [--block <size>] [--max-sets <n>] [--max-assoc <n>]
+//      [--stream all|data|inst]
+//
+// Computes LRU miss curves for every cache size and associativity in a single
+// pass over a trace, instead of re-simulating each point with Cache::read and
+// Cache::write. Prints one CSV row per (sets, associativity) pair.
+int stackdist_main(int argc, char* argv[]);
+
+// Mattson stack distances, computed per set for every power of two number of
+// sets from 1 (fully associative) up to max_sets at once.
+//
+// The stack distance of an access is the number of distinct blocks in the
+// same set touched since the last access to its block; with LRU replacement
+// the access hits in an A-way cache exactly when that distance is below A.
+// Following Olken, each set count keeps an order statistics tree holding,
+// for every block, the time of its last access (keyed by set, then time).
+// The distance is then the number of keys in the block's set that are newer
+// than its last access, which the tree counts in O(log n).
+struct StackDistanceEngine {
+    StackDistanceEngine(u64 block_size, u64 max_sets, u64 max_assoc);
+
+    void access(u64 addr);
+    // Accesses that hit in a cache with 2^set_bits sets and assoc ways
+    u64 hits(u64 set_bits, u64 assoc) const;
+    void write_csv(FILE* out) const;
+
+    const u64 block_bits;
+    const u64 max_assoc;
+    u64 accesses;
+    u64 cold_misses;
+
+private:
+    // Access times are the low TIME_BITS of a key, the set index the rest.
+    static const u64 TIME_BITS = 40;
+    using RecencyTree = __gnu_pbds::tree<u64, __gnu_pbds::null_type, std::less<u64>,
+        __gnu_pbds::rb_tree_tag, __gnu_pbds::tree_order_statistics_node_update>;
+
+    struct SetProfile {
+        u64 set_bits;
+        RecencyTree recency;
+        // distance_counts[d] is the number of accesses at stack distance d.
+        // Distances of max_assoc or more miss in every profiled cache.
+        std::vector<u64> distance_counts;
+    };
+    std::vector<SetProfile> profiles;
+    // Block address -> time of its last access. Shared by every profile,
+    // since the time of an access doesn't depend on the geometry.
+    std::unordered_map<u64, u64> last_access;
+};
@@ -0,0 +1,38 @@
+#pragma once
+#include "shortints.h"
+#include <cstddef>
+
+// The integer encodings of packed traces (see parser.hpp) and L1 miss
+// streams (see missstream.hpp)
+
+inline u64 zigzag_encode(s64 value) {
+    return (static_cast<u64>(value) << 1) ^ static_cast<u64>(value >> 63);
+}
+
+inline s64 zigzag_decode(u64 value) {
+    return static_cast<s64>((value >> 1) ^ (~(value & 1) + 1));
+}
+
+// LEB128 style variable length integers: 7 bits per byte, high bit set on
+// every byte but the last.
+inline size_t put_varint(u8* dst, u64 value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        dst[len++] = static_cast<u8>(value) | 0x80;
+        value >>= 7;
+    }
+    dst[len++] = static_cast<u8>(value);
+    return len;
+}
+
+inline bool get_varint(const char*& p, const char* end, u64& value) {
+    value = 0;
+    for (u32 shift = 0; p < end && shift < 64; shift += 7) {
+        const u8 byte = static_cast<u8>(*p++);
+        value |= static_cast<u64>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,179 @@
+#include "write_buffer.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+const char* write_drain_policy_name(WriteDrainPolicy policy) {
+    switch (policy) {
+        case EAGER_DRAIN: return "eager";
+        case LAZY_DRAIN: return "lazy";
+    }
+    return "?";
+}
+
+bool parse_write_drain_policy(const char* name, WriteDrainPolicy& policy) {
+    if (strcmp(name, "eager") == 0) {
+        policy = EAGER_DRAIN;
+    } else if (strcmp(name, "lazy") == 0) {
+        policy = LAZY_DRAIN;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// One block's worth of capacity, as the geometry only serves to split
+// addresses into blocks
+WriteBuffer::WriteBuffer(Cache& next, u64 depth, WriteDrainPolicy policy, u64 block_size,
+    Time drain_time, Watt idle_power, Watt running_power, Machine& machine)
+    : Cache(block_size, 1, block_size, drain_time, idle_power, running_power, 0, machine)
+    , depth(depth)
+    , drain_policy(policy)
+    , buffered_writes(0)
+    , coalesced_writes(0)
+    , drains(0)
+    , full_stalls(0)
+    , read_waits(0)
+    , stall_time(0)
+    , read_wait_time(0)
+    , next(next)
+    , drain_time(drain_time)
+    , entries()
+    , port_free_time(0)
+    , line()
+{
+    this->line.set_metadata(0, true, false, false);
+}
+
+bool WriteBuffer::is_enabled() const {
+    return this->depth > 0;
+}
+
+void WriteBuffer::flush() {
+    for (Entry& entry : this->entries) {
+        if (!entry.is_scheduled) {
+            this->schedule(entry, this->machine.time);
+        }
+    }
+}
+
+// Drop the entries that have drained by now
+void WriteBuffer::retire(Time now) {
+    while (!this->entries.empty() && this->entries.front().is_scheduled &&
+        this->entries.front().drain_finish <= now) {
+        this->entries.pop_front();
+    }
+}
+
+// The write reaches the next level when the drain starts; the port stays
+// busy until the next level is done with it.
+void WriteBuffer::schedule(Entry& entry, Time now) {
+    const Time start = std::max(now, this->port_free_time);
+    const Time done = this->next.access_from(entry.block << this->block_bits, true, start);
+    entry.is_scheduled = true;
+    entry.drain_start = start;
+    entry.drain_finish = std::max(done, start + this->drain_time);
+    this->port_free_time = entry.drain_finish;
+    this->drains++;
+    this->machine.push_busy(this, entry.drain_finish);
+}
+
+void WriteBuffer::schedule_lazy(Time now) {
+    // Entries still waiting are the newest ones
+    u64 waiting = 0;
+    for (const Entry& entry : this->entries) {
+        waiting += !entry.is_scheduled;
+    }
+    while (waiting > this->depth / 2) {
+        this->schedule(this->entries[this->entries.size() - waiting], now);
+        waiting--;
+    }
+}
+
+Time WriteBuffer::accept(const address addr, Time start) {
+    const u64 block = addr >> this->block_bits;
+    this->buffered_writes++;
+    this->retire(start);
+    for (const Entry& entry : this->entries) {
+        if (entry.block == block && (!entry.is_scheduled || entry.drain_start > start)) {
+            this->coalesced_writes++;
+            return start;
+        }
+    }
+    if (this->entries.size() >= this->depth) {
+        Entry& oldest = this->entries.front();
+        if (!oldest.is_scheduled) {
+            this->schedule(oldest, start);
+        }
+        this->full_stalls++;
+        this->stall_time += oldest.drain_finish - start;
+        start = oldest.drain_finish;
+        this->retire(start);
+    }
+    this->entries.push_back(Entry{block, false, 0, 0});
+    if (this->drain_policy == EAGER_DRAIN) {
+        this->schedule(this->entries.back(), start);
+    } else {
+        this->schedule_lazy(start);
+    }
+    return start;
+}
+
+Time WriteBuffer::read_ready(const address addr, Time start) {
+    const u64 block = addr >> this->block_bits;
+    this->retire(start);
+    // The newest write to the block, and everything before it, has to drain
+    size_t newest = this->entries.size();
+    for (size_t i = 0; i < this->entries.size(); i++) {
+        if (this->entries[i].block == block) {
+            newest = i;
+        }
+    }
+    if (newest == this->entries.size()) {
+        return start;
+    }
+    for (size_t i = 0; i <= newest; i++) {
+        if (!this->entries[i].is_scheduled) {
+            this->schedule(this->entries[i], start);
+        }
+    }
+    this->read_waits++;
+    this->read_wait_time += this->entries[newest].drain_finish - start;
+    return this->entries[newest].drain_finish;
+}
+
+const Line& WriteBuffer::read_at(const address addr, u64 set_index, u64 tag) {
+    const Time ready = this->read_ready(addr, this->machine.time);
+    this->machine.advance_time(ready - this->machine.time);
+    return this->next.read(addr);
+}
+
+const Line& WriteBuffer::write_at(const address addr, value val, u64 set_index, u64 tag) {
+    const Time taken = this->accept(addr, this->machine.time);
+    this->machine.advance_time(taken - this->machine.time);
+    return this->line;
+}
+
+Time WriteBuffer::access_from(const address addr, bool is_write, Time start) {
+    if (is_write) {
+        return this->accept(addr, start);
+    }
+    return this->next.access_from(addr, false, this->read_ready(addr, start));
+}
+
+// Writes still in the buffer don't matter to functional state
+void WriteBuffer::warm(const address addr, bool is_write) {
+    this->next.warm(addr, is_write);
+}
+
+Line& WriteBuffer::line_at(const u64 line_index) {
+    return this->line;
+}
+
+void WriteBuffer::child_evicted(const address addr) {
+    this->next.child_evicted(addr);
+}
+
+Time WriteBuffer::fill_latency(const address addr) {
+    return this->next.fill_latency(addr);
+}
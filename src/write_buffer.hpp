@@ -0,0 +1,80 @@
+#pragma once
+#include "cache.hpp"
+#include <deque>
+
+// When a write buffer sends its entries on
+enum WriteDrainPolicy : u8 {
+    EAGER_DRAIN, // Each entry as soon as the port to the next level is free
+    LAZY_DRAIN,  // Oldest first, only while more than half the entries are waiting
+};
+
+const char* write_drain_policy_name(WriteDrainPolicy policy);
+// Returns false if name is not a drain policy
+bool parse_write_drain_policy(const char* name, WriteDrainPolicy& policy);
+
+// A write buffer between a write-through cache and the next level. It is the
+// cache's parent, so every write-through, miss and eviction passes through
+// it. Holds no lines.
+//
+// A write takes an entry and the cache carries on. Writes to a block whose
+// entry hasn't started draining yet coalesce into it. Entries drain in
+// order, one at a time, each holding the port to the next level for that
+// level's write: at least its hit latency, or a whole fill on a miss. A
+// write that finds every entry taken stalls until the oldest has drained. A
+// read of a block with a write still waiting drains up to that write first
+// and waits for it, so it sees the write.
+//
+// The next level is written through Cache::access_from, so it takes the
+// write at the time the drain starts without holding up the machine.
+// With depth 0 there is no buffer and nothing should go through it.
+struct WriteBuffer final : public Cache {
+    WriteBuffer(Cache& next, u64 depth, WriteDrainPolicy policy, u64 block_size,
+        Time drain_time, Watt idle_power, Watt running_power, Machine& machine);
+
+    bool is_enabled() const;
+    // Start draining everything still waiting, for the end of a run
+    void flush();
+
+    const Line& read_at(address addr, u64 set_index, u64 tag) override;
+    const Line& write_at(address addr, value val, u64 set_index, u64 tag) override;
+    void warm(address addr, bool is_write) override;
+    Line& line_at(u64 line_index) override;
+    void child_evicted(address addr) override;
+    Time fill_latency(address addr) override;
+    Time access_from(address addr, bool is_write, Time start) override;
+
+    const u64 depth;
+    const WriteDrainPolicy drain_policy;
+    // Writes taken, how many of them coalesced into a waiting entry, and
+    // how many drains that left. Writes that found the buffer full stalled
+    // for stall_time in all; reads that had to wait for a write to drain
+    // first waited read_wait_time.
+    u64 buffered_writes, coalesced_writes, drains;
+    u64 full_stalls, read_waits;
+    Time stall_time, read_wait_time;
+
+private:
+    struct Entry {
+        u64 block;
+        bool is_scheduled; // Given a time to drain
+        Time drain_start, drain_finish;
+    };
+    Cache& next;
+    const Time drain_time;
+    // Oldest first. Entries drain in this order, so those scheduled come
+    // first and finish in order.
+    std::deque<Entry> entries;
+    Time port_free_time; // When the last scheduled drain finishes
+    // Handed back for every access: valid, clean and never in flight.
+    Line line;
+
+    // Take a write at start, returning when it was taken. Times are taken
+    // in the order accesses arrive, so an access starting earlier than the
+    // one before it may find entries gone that had not drained by then.
+    Time accept(address addr, Time start);
+    // The earliest time a read of addr at start sees every write to it
+    Time read_ready(address addr, Time start);
+    void retire(Time now);
+    void schedule(Entry& entry, Time now);
+    void schedule_lazy(Time now);
+};